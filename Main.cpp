@@ -1,10 +1,10 @@
 #include "ncbind.hpp"
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
 using namespace std;
-#include <process.h>
-
-#define WM_SAVE_TLG_PROGRESS (WM_APP+4)
-#define WM_SAVE_TLG_DONE     (WM_APP+5)
 
 iTJSDispatch2 *getLayerClass(void)
 {
@@ -20,9 +20,13 @@ iTJSDispatch2 *getLayerAssignImages(void)
   return  var.AsObjectNoAddRef();
 }
 
-#include "compress.hpp"
+#include "utils.hpp"
 #include "savetlg5.hpp"
 #include "savepng.hpp"
+#include "saveimage.hpp"
+#include "savequeue.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
 
 //---------------------------------------------------------------------------
 // ウインドウ拡張
@@ -33,7 +37,7 @@ class WindowSaveImage;
 /**
  * セーブ処理スレッド用情報
  */
-class SaveInfo {
+class SaveInfo : public SaveJob {
 
 	friend class WindowSaveImage;
 	
@@ -44,9 +48,11 @@ protected:
 	tTJSVariant layer; //< レイヤ
 	tTJSVariant filename; //< ファイル名
 	tTJSVariant info;  //< 保存用タグ情報
-	bool canceled;        //< キャンセル指示
+	atomic<bool> canceled; //< キャンセル指示
+	bool failed;          //< 保存処理中のエラー
 	tTJSVariant handler;  //< ハンドラ値
-	tTJSVariant progressPercent; //< 進行度合い
+	int progressPercent;  //< 進行度合い（保存スレッド側）
+	EncodeStats stats;    //< 計測値（保存スレッド側で加算し，終了通知後にメインスレッドで参照する）
 	
 protected:
 	/**
@@ -64,33 +70,44 @@ protected:
 	}
 	
 	// 経過イベント送信
-	void eventProgress(iTJSDispatch2 *objthis) {
-		tTJSVariant *vars[] = {&handler, &progressPercent, &layer, &filename};
+	void eventProgress(iTJSDispatch2 *objthis, int percent) {
+		tTJSVariant progress = percent;
+		tTJSVariant *vars[] = {&handler, &progress, &layer, &filename};
 		objthis->FuncCall(0, L"onSaveLayerImageProgress", NULL, NULL, 4, vars, objthis);
 	}
 
 	// 終了イベント送信
 	void eventDone(iTJSDispatch2 *objthis) {
-		tTJSVariant result = canceled ? 1 : 0;
+		tTJSVariant result = failed ? 2 : canceled ? 1 : 0;
 		tTJSVariant *vars[] = {&handler, &result, &layer, &filename};
 		objthis->FuncCall(0, L"onSaveLayerImageDone", NULL, NULL, 4, vars, objthis);
 	}
 	
 public:
 	// コンストラクタ
-	SaveInfo(int handler, WindowSaveImage *notify, tTJSVariant layer, const tjs_char *filename, tTJSVariant info)
-		: handler(handler), notify(notify), layer(layer), filename(filename), info(info), canceled(false) {}
+	SaveInfo(int handler, WindowSaveImage *notify, tTJSVariant layer, const tjs_char *filename, tTJSVariant info, int priority, tjs_int deadline, double pixels, size_t reserved, size_t working)
+		: SaveJob(priority, deadline, pixels, reserved, working), handler(handler), notify(notify), layer(layer), filename(filename), info(info), canceled(false), failed(false), progressPercent(-1) {}
 	
 	// デストラクタ
 	~SaveInfo() {}
 
+	// PNG形式で保存するか（拡張子が.pngの時のみPNG，それ以外はTLG5）
+	static bool isPng(const tjs_char *filename) {
+		ttstr ext(TVPExtractStorageExt(ttstr(filename)));
+		ext.ToLowerCase();
+		return ext == TJS_W(".png");
+	}
+
 	// ハンドラ取得
 	int getHandler() {
 		return (int)handler;
 	}
 	
  	// 処理開始
-	void start();
+	virtual bool run(bool lowEffort);
+
+	// 未実行のまま破棄（キャンセル扱いで終了通知する）
+	virtual void discard();
 
 	// 処理キャンセル
 	void cancel() {
@@ -102,6 +119,69 @@ public:
 		canceled = true;
 		notify = NULL;
 	}
+
+	// 通知先取得（メインスレッドからのみ参照する）
+	WindowSaveImage *getNotify() {
+		return notify;
+	}
+};
+
+/**
+ * 保存スレッドからの通知をメインスレッドで配送する
+ * 通知はキューに溜めておき，エンジンの Continuous イベントで処理する
+ */
+class SaveEventDispatcher : public tTVPContinuousEventCallbackIntf {
+
+	struct Event {
+		SaveInfo *sender;
+		int percent; //< 進行度合い（負なら終了通知）
+	};
+
+	mutex lock;
+	deque<Event> events;
+	bool hooked;
+
+	SaveEventDispatcher() : hooked(false) {}
+
+public:
+	static SaveEventDispatcher &instance() {
+		static SaveEventDispatcher dispatcher;
+		return dispatcher;
+	}
+
+	/**
+	 * 配送の開始（メインスレッドから呼ぶ）
+	 */
+	void start() {
+		if (!hooked) {
+			TVPAddContinuousEventHook(this);
+			hooked = true;
+		}
+	}
+
+	/**
+	 * 配送の終了（メインスレッドから呼ぶ）
+	 */
+	void shutdown() {
+		if (hooked) {
+			TVPRemoveContinuousEventHook(this);
+			hooked = false;
+		}
+		OnContinuousCallback(0);
+	}
+
+	/**
+	 * 通知の登録（保存スレッドから呼ばれる）
+	 * @param sender 通知元
+	 * @param percent 進行度合い（負なら終了通知）
+	 */
+	void post(SaveInfo *sender, int percent) {
+		lock_guard<mutex> guard(lock);
+		Event ev = { sender, percent };
+		events.push_back(ev);
+	}
+
+	virtual void TJS_INTF_METHOD OnContinuousCallback(tjs_uint64 tick);
 };
 
 /**
@@ -109,65 +189,31 @@ public:
  */
 class WindowSaveImage {
 
+	friend class SaveEventDispatcher;
+
 protected:
 	iTJSDispatch2 *objthis; //< オブジェクト情報の参照
 
 	vector<SaveInfo*> saveinfos; //< セーブ中情報保持用
-
-	// 実行スレッド
-	static void checkThread(void *data) {
-		((SaveInfo*)data)->start();
-	}
+	vector<EncodeStats> statistics; //< 最後に終了したセーブの計測値（ハンドラごと）
 
 	// 経過通知
-	void eventProgress(SaveInfo *sender) {
+	void eventProgress(SaveInfo *sender, int percent) {
 		int handler = sender->getHandler();
 		if (saveinfos[handler] == sender) {
-			sender->eventProgress(objthis);
+			sender->eventProgress(objthis, percent);
 		}
 	}
 
-	// 終了通知
+	// 終了通知（イベント処理で例外が起きても sender は破棄する）
 	void eventDone(SaveInfo *sender) {
+		unique_ptr<SaveInfo> guard(sender);
 		int handler = sender->getHandler();
 		if (saveinfos[handler] == sender) {
 			saveinfos[handler] = NULL;
+			statistics[handler] = sender->stats;
 			sender->eventDone(objthis);
 		}
-		delete sender;
-	}
-
-	/*
-	 * ウインドウイベント処理レシーバ
-	 */
-	static bool __stdcall receiver(void *userdata, tTVPWindowMessage *Message) {
-		if (Message->Msg == WM_SAVE_TLG_PROGRESS) {
-			iTJSDispatch2 *obj = (iTJSDispatch2*)userdata;
-			WindowSaveImage *self = ncbInstanceAdaptor<WindowSaveImage>::GetNativeInstance(obj);
-			if (self) {
-				self->eventProgress((SaveInfo*)Message->WParam);
-			}
-			return true;
-		} else if (Message->Msg == WM_SAVE_TLG_DONE) {
-			iTJSDispatch2 *obj = (iTJSDispatch2*)userdata;
-			WindowSaveImage *self = ncbInstanceAdaptor<WindowSaveImage>::GetNativeInstance(obj);
-			if (self) {
-				self->eventDone((SaveInfo*)Message->WParam);
-			}
-			return true;
-		}
-		return false;
-	}
-
-	// ユーザメッセージレシーバの登録/解除
-	void setReceiver(tTVPWindowMessageReceiver receiver, bool enable) {
-		tTJSVariant mode     = enable ? (tTVInteger)(tjs_int)wrmRegister : (tTVInteger)(tjs_int)wrmUnregister;
-		tTJSVariant proc     = (tTVInteger)(tjs_intptr_t)receiver;
-		tTJSVariant userdata = (tTVInteger)(tjs_intptr_t)objthis;
-		tTJSVariant *p[] = {&mode, &proc, &userdata};
-		if (objthis->FuncCall(0, L"registerMessageReceiver", NULL, NULL, 4, p, objthis) != TJS_S_OK) {
-			TVPThrowExceptionMessage(L"can't regist user message receiver");
-		}
 	}
 
 public:
@@ -176,14 +222,13 @@ public:
 	 * コンストラクタ
 	 */
 	WindowSaveImage(iTJSDispatch2 *objthis) : objthis(objthis) {
-		setReceiver(receiver, true);
+		SaveEventDispatcher::instance().start();
 	}
 
 	/**
 	 * デストラクタ
 	 */
 	~WindowSaveImage() {
-		setReceiver(receiver, false);
 		for (int i=0;i<(int)saveinfos.size();i++) {
 			SaveInfo *saveinfo = saveinfos[i];
 			if (saveinfo) {
@@ -193,18 +238,31 @@ public:
 		}
 	}
 
+	// インスタンス取得
+	static WindowSaveImage *getInstance(iTJSDispatch2 *objthis) {
+		WindowSaveImage *obj = ncbInstanceAdaptor<WindowSaveImage>::GetNativeInstance(objthis);
+		if (!obj) {
+			obj = new WindowSaveImage(objthis);
+			ncbInstanceAdaptor<WindowSaveImage>::SetNativeInstance(objthis, obj);
+		}
+		return obj;
+	}
+
 	/**
-	 * メッセージ送信
-	 * @param msg メッセージ
-	 * @param wparam WPARAM
-	 * @param lparam LPARAM
+	 * レイヤセーブ開始
+	 * Window.startSaveLayerImage = function(layer, filename, info=void, priority=0, deadline=0);
+	 * @param priority 優先度（大きいほど先に処理される）
+	 * @param deadline 期限(ms)。間に合わない見込みのときは圧縮率を落として保存する（0なら期限なし）
 	 */
-	void postMessage(UINT msg, WPARAM wparam=NULL, LPARAM lparam=NULL) {
-		// ウィンドウハンドルを取得して通知
-		tTJSVariant val;
-		objthis->PropGet(0, TJS_W("HWND"), NULL, &val, objthis);
-		HWND hwnd = reinterpret_cast<HWND>((tjs_intptr_t)(val));
-		::PostMessage(hwnd, msg, wparam, lparam);
+	static tjs_error TJS_INTF_METHOD startSaveLayerImageFunc(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis) {
+		if (numparams < 2) return TJS_E_BADPARAMCOUNT;
+		tTJSVariant info;
+		if (numparams > 2) info = *param[2];
+		int     priority = (numparams > 3 && param[3]->Type() != tvtVoid) ? (int)param[3]->AsInteger() : 0;
+		tjs_int deadline = (numparams > 4 && param[4]->Type() != tvtVoid) ? (tjs_int)param[4]->AsInteger() : 0;
+		int handler = getInstance(objthis)->startSaveLayerImage(*param[0], param[1]->GetString(), info, priority, deadline);
+		if (result) *result = handler;
+		return TJS_S_OK;
 	}
 
 	/**
@@ -212,8 +270,10 @@ public:
 	 * @param layer レイヤ
 	 * @param filename ファイル名
 	 * @param info タグ情報
+	 * @param priority 優先度
+	 * @param deadline 期限(ms)
 	 */
-	int startSaveLayerImage(tTJSVariant layer, const tjs_char *filename, tTJSVariant info) {
+	int startSaveLayerImage(tTJSVariant layer, const tjs_char *filename, tTJSVariant info, int priority, tjs_int deadline) {
 		int handler = saveinfos.size();
 		for (int i=0;i<(int)saveinfos.size();i++) {
 			if (saveinfos[i] == NULL) {
@@ -223,11 +283,23 @@ public:
 		}
 		if (handler >= (int)saveinfos.size()) {
 			saveinfos.resize(handler + 1);
+			statistics.resize(handler + 1);
 		}
 
+		// メモリ使用量の見積もり（複製レイヤ分は投入時点から使用量に含める）
+		// 呼び出し時点の画像を保存するため複製はここで作り，予算を超える場合はキューの中で処理開始を待たせる
+		long width = 0, height = 0, pitch = 0;
+		GetLayerSize(layer.AsObjectNoAddRef(), width, height, &pitch);
+		size_t reserved = (size_t)(pitch < 0 ? -pitch : pitch) * height;
+		size_t working  = SaveInfo::isPng(filename) ? CompressPNG ::estimateMemory(width, height)
+		/*                                       */ : CompressTLG5::estimateMemory(width, height);
+
 		// 保存用にレイヤを複製する
 		tTJSVariant newLayer;
+		EncodeStats stats;
 		{
+			StageTimer timer(&stats, EncodeStats::STAGE_CLONE);
+			TraceSpan span("clone", handler);
 			// 新しいレイヤを生成
 			tTJSVariant window(objthis, objthis);
 			tTJSVariant primaryLayer;
@@ -254,12 +326,81 @@ public:
 				TVPThrowExceptionMessage(L"保存処理用レイヤの生成に失敗しました");
 			}
 		}
-		SaveInfo *saveInfo = new SaveInfo(handler, this, newLayer, filename, info);
+		SaveInfo *saveInfo = new SaveInfo(handler, this, newLayer, filename, info, priority, deadline, (double)width * height, reserved, working);
+		saveInfo->stats = stats;
 		saveinfos[handler] = saveInfo;
-		_beginthread(checkThread, 0, saveInfo);
+		statistics[handler] = stats;
+		SaveQueue::instance().push(saveInfo);
 		return handler;
 	}
 	
+	/**
+	 * レイヤセーブの計測値の取得
+	 * Window.getSaveStatistics = function(handler);
+	 * @return 計測値の辞書。保存中・未使用のハンドラなら void
+	 */
+	static tjs_error TJS_INTF_METHOD getSaveStatisticsFunc(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis) {
+		if (numparams < 1) return TJS_E_BADPARAMCOUNT;
+		EncodeStats const *stats = getInstance(objthis)->getSaveStatistics((int)param[0]->AsInteger());
+		if (result) {
+			result->Clear();
+			if (stats) {
+				ncbDictionaryAccessor dict;
+				StoreSaveStatistics(*stats, dict.GetDispatch());
+				*result = dict;
+			}
+		}
+		return TJS_S_OK;
+	}
+
+	/**
+	 * 終了したレイヤセーブの計測値
+	 * @return 保存中・未使用のハンドラなら NULL
+	 */
+	EncodeStats const *getSaveStatistics(int handler) const {
+		if (handler < 0 || handler >= (int)saveinfos.size() || saveinfos[handler] != NULL) return NULL;
+		return &statistics[handler];
+	}
+
+	/**
+	 * 保存処理全体のメモリ予算(byte)
+	 * 処理中の作業領域が予算を超える間は新しい保存処理の開始を待たせる
+	 */
+	tTVInteger getSaveMemoryBudget() const {
+		return (tTVInteger)SaveQueue::instance().getMemoryBudget();
+	}
+	void setSaveMemoryBudget(tTVInteger budget) {
+		SaveQueue::instance().setMemoryBudget(budget > 0 ? (size_t)budget : 0);
+	}
+
+	/**
+	 * 保存処理のトレース記録（全ウインドウ共通）
+	 * 有効にするとそれまでの記録を破棄して記録を開始する
+	 */
+	bool getSaveTraceEnabled() const {
+		return TraceEnabled();
+	}
+	void setSaveTraceEnabled(bool enable) {
+		TraceThreadName("main");
+		TraceEnable(enable);
+	}
+
+	/**
+	 * トレースの記録を Chrome の trace event 形式（JSON）でファイルに書き出す
+	 * @param filename ファイル名
+	 * @return 書き出した区間の数
+	 */
+	tTVInteger dumpSaveTrace(const tjs_char *filename) {
+		return (tTVInteger)DumpSaveTrace(filename);
+	}
+
+	/**
+	 * 保存処理全体の現在のメモリ使用量(byte)
+	 */
+	tTVInteger getSaveMemoryUsage() const {
+		return (tTVInteger)SaveQueue::instance().getMemoryUsage();
+	}
+
 	/**
 	 * レイヤセーブのキャンセル
 	 */
@@ -288,39 +429,90 @@ public:
 bool
 SaveInfo::progress(int percent)
 {
-	if ((int)progressPercent != percent) {
+	if (progressPercent != percent) {
 		progressPercent = percent;
-		if (notify) {
-			notify->postMessage(WM_SAVE_TLG_PROGRESS, (WPARAM)this);
-			Sleep(0);
-		}
+		SaveEventDispatcher::instance().post(this, percent);
 	}
 	return canceled;
 }
 
 /*
  * 保存処理開始
+ * @param lowEffort 圧縮率を落として高速に保存する
+ * @return 保存が完了したら true
  */
+bool
+SaveInfo::run(bool lowEffort)
+{
+	// 待機中にキャンセル・中止されていたら保存しない
+	if (!canceled) {
+		TraceSpan span("save", getHandler());
+		iTJSDispatch2  *lay = layer.AsObjectNoAddRef();
+		iTJSDispatch2  *nfo = info.Type() == tvtObject ? info.AsObjectNoAddRef() : NULL;
+		const tjs_char *fn  = filename.GetString();
+		// 画像をセーブ（拡張子別）
+		try {
+			SaveLayerImage(lay, fn, nfo, isPng(fn), progressFunc, (void*)this, lowEffort, &stats);
+		} catch (...) {
+			// 保存スレッドからは例外を投げられないので終了イベントで通知する
+			failed = true;
+		}
+	}
+	bool done = !canceled && !failed;
+	// 完了通知（破棄はメインスレッド側で行う）
+	SaveEventDispatcher::instance().post(this, -1);
+	return done;
+}
+
 void
-SaveInfo::start()
+SaveInfo::discard()
+{
+	canceled = true;
+	SaveEventDispatcher::instance().post(this, -1);
+}
+
+/**
+ * イベント処理中の例外をログに出力する（catch 節から呼ぶ）
+ */
+static void
+ReportEventError()
 {
-	iTJSDispatch2  *lay = layer.AsObjectNoAddRef();
-	iTJSDispatch2  *nfo = info.Type() == tvtObject ? info.AsObjectNoAddRef() : NULL;
-	const tjs_char *fn  = filename.GetString();
-	ttstr ext(TVPExtractStorageExt(ttstr(fn)));
-	ext.ToLowerCase();
-	// 画像をセーブ（拡張子別）
-	if (ext == TJS_W(".png")) {
-		CompressAndSave<CompressPNG >::saveLayerImage(lay, fn, nfo, progressFunc, (void*)this);
-	} else {
-		CompressAndSave<CompressTLG5>::saveLayerImage(lay, fn, nfo, progressFunc, (void*)this);
-	}
-	// 完了通知
-	if (notify) {
-		notify->postMessage(WM_SAVE_TLG_DONE, (WPARAM)this);
-		Sleep(0);
-	} else {
-		delete this;
+	try {
+		throw;
+	} catch (eTJSError &e) {
+		TVPAddLog(ttstr(TJS_W("layerExSave: save event handler failed: ")) + e.GetMessage());
+	} catch (...) {
+		TVPAddLog(TJS_W("layerExSave: save event handler failed"));
+	}
+}
+
+/**
+ * 溜まった通知の配送
+ * イベント処理（スクリプト）の例外はエンジンに投げ返さず，ログに出力して次の通知に進む
+ */
+void TJS_INTF_METHOD
+SaveEventDispatcher::OnContinuousCallback(tjs_uint64 tick)
+{
+	deque<Event> current;
+	{
+		lock_guard<mutex> guard(lock);
+		if (events.empty()) return;
+		current.swap(events);
+	}
+	while (!current.empty()) {
+		Event ev = current.front();
+		current.pop_front();
+		try {
+			WindowSaveImage *notify = ev.sender->getNotify();
+			if (ev.percent >= 0) {
+				if (notify) notify->eventProgress(ev.sender, ev.percent);
+			} else {
+				if (notify) notify->eventDone(ev.sender);
+				else        delete ev.sender;
+			}
+		} catch (...) {
+			ReportEventError();
+		}
 	}
 }
 
@@ -340,8 +532,21 @@ NCB_GET_INSTANCE_HOOK(WindowSaveImage)
 };
 
 NCB_ATTACH_CLASS_WITH_HOOK(WindowSaveImage, Window) {
-	NCB_METHOD(startSaveLayerImage);
+	NCB_METHOD_RAW_CALLBACK(startSaveLayerImage, WindowSaveImage::startSaveLayerImageFunc, 0);
+	NCB_METHOD_RAW_CALLBACK(getSaveStatistics, WindowSaveImage::getSaveStatisticsFunc, 0);
 	NCB_METHOD(cancelSaveLayerImage);
 	NCB_METHOD(stopSaveLayerImage);
+	NCB_PROPERTY(saveMemoryBudget, getSaveMemoryBudget, setSaveMemoryBudget);
+	NCB_PROPERTY_RO(saveMemoryUsage, getSaveMemoryUsage);
+	NCB_PROPERTY(saveTraceEnabled, getSaveTraceEnabled, setSaveTraceEnabled);
+	NCB_METHOD(dumpSaveTrace);
 };
 
+// 保存スレッド・並列処理スレッドの停止
+static void PreUnregistCallback()
+{
+	SaveQueue::instance().shutdown();
+	SaveEventDispatcher::instance().shutdown();
+	ParallelExecutor::instance().shutdown();
+}
+NCB_PRE_UNREGIST_CALLBACK(PreUnregistCallback);
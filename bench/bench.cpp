@@ -0,0 +1,331 @@
+#include "encoder.hpp"
+#include "streamwriter.hpp"
+#include "trace.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+//---------------------------------------------------------------------------
+// エンコーダのベンチマーク
+//
+// 使い方: layerExSave_bench [options] <file|dir>...
+//   入力は詰めて並べた RGBA8888 の生データ（ファイル名に 640x480 のように大きさを含めるか -s で指定）
+//   ディレクトリを指定した場合は *.rgba / *.raw を全て読む
+
+typedef std::chrono::steady_clock Clock;
+
+static double
+Elapsed(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/**
+ * プロセスの最大常駐メモリ量(byte)
+ */
+static size_t
+PeakRSS()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return (size_t)pmc.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru)) return 0;
+#if defined(__APPLE__)
+	return (size_t)ru.ru_maxrss;
+#else
+	return (size_t)ru.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// 実行設定
+struct BenchOptions {
+	long width, height;     //< ファイル名に大きさがない場合の大きさ
+	int repeat;             //< 繰り返し回数（最速の結果を使う）
+	int level;              //< PNG の圧縮レベル（-1 なら既定値）
+	bool lowEffort;         //< TLG5/PNG の高速モード
+	bool tlg5, png, lodepng;
+	std::string output;     //< 保存計測用の出力ファイル
+	std::string trace;      //< トレースの出力ファイル（空なら記録しない）
+	BenchOptions() : width(0), height(0), repeat(3), level(-1), lowEffort(false),
+					 tlg5(true), png(true), lodepng(true), output("layerexsave_bench.out") {}
+};
+
+// 1回分の計測結果
+struct BenchResult {
+	double encode;     //< メモリ上への圧縮(ms)
+	double save;       //< ファイルへの保存(ms)
+	size_t size;       //< 圧縮後の大きさ
+	EncodeStats stats; //< 最速の保存時の段階ごとの計測値
+	BenchResult() : encode(0), save(0), size(0) {}
+};
+
+// エンコーダごとの集計
+struct BenchTotal {
+	const char *name;
+	double raw, packed, encode, save;
+	size_t peak;
+	int count;
+	BenchTotal(const char *name) : name(name), raw(0), packed(0), encode(0), save(0), peak(0), count(0) {}
+};
+
+/**
+ * 1エンコーダ分の計測
+ * @param encode メモリ上に圧縮して大きさを返す処理
+ * @param save save(stats) でファイルに保存する処理
+ */
+template <typename ENCODE, typename SAVE>
+static BenchResult
+Measure(int repeat, ENCODE const &encode, SAVE const &save)
+{
+	BenchResult best;
+	for (int i = 0; i < repeat; i++) {
+		Clock::time_point start = Clock::now();
+		size_t size = encode();
+		const double t = Elapsed(start);
+		if (!i || t < best.encode) best.encode = t;
+		best.size = size;
+
+		EncodeStats stats;
+		start = Clock::now();
+		save(&stats);
+		double s = Elapsed(start);
+		if (!i || s < best.save) {
+			best.save  = s;
+			best.stats = stats;
+		}
+	}
+	return best;
+}
+
+/**
+ * 段階の所要時間(ms)
+ */
+static double
+StageTime(EncodeStats const &stats, int stage)
+{
+	return stats.time[stage] / 1000000.0;
+}
+
+static void
+Report(BenchTotal &total, const std::string &file, long w, long h, BenchResult const &r)
+{
+	const double raw = (double)w * h * 4;
+	const size_t peak = PeakRSS();
+	printf("%-24s %-8s %5ldx%-5ld %9.2f %8.1f %7.2f%% %9.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.1f\n",
+		   file.c_str(), total.name, w, h,
+		   r.encode, raw / (1024.0 * 1024.0) / (r.encode / 1000.0), r.size * 100.0 / raw, r.save,
+		   StageTime(r.stats, EncodeStats::STAGE_FILTER), StageTime(r.stats, EncodeStats::STAGE_LZSS),
+		   StageTime(r.stats, EncodeStats::STAGE_DEFLATE), StageTime(r.stats, EncodeStats::STAGE_CRC),
+		   StageTime(r.stats, EncodeStats::STAGE_WRITE), peak / (1024.0 * 1024.0));
+	total.raw    += raw;
+	total.packed += (double)r.size;
+	total.encode += r.encode;
+	total.save   += r.save;
+	total.peak    = peak;
+	total.count++;
+}
+
+/**
+ * ファイル名から大きさを取り出す（"name_640x480.rgba" など）
+ */
+static bool
+ParseSize(const std::string &name, long &w, long &h)
+{
+	for (size_t i = 0; i < name.size(); i++) {
+		if (name[i] < '0' || name[i] > '9' || (i > 0 && name[i-1] >= '0' && name[i-1] <= '9')) continue;
+		char *end;
+		long pw = strtol(name.c_str() + i, &end, 10);
+		if (*end != 'x' || end[1] < '0' || end[1] > '9') continue;
+		long ph = strtol(end + 1, &end, 10);
+		if (pw > 0 && ph > 0) {
+			w = pw, h = ph;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+BenchFile(BenchOptions const &opt, const std::filesystem::path &path, std::vector<BenchTotal> &totals)
+{
+	const std::string name = path.filename().string();
+	long w = opt.width, h = opt.height;
+	ParseSize(name, w, h);
+	if (w <= 0 || h <= 0) {
+		fprintf(stderr, "%s: unknown image size (use -s WxH)\n", name.c_str());
+		return;
+	}
+
+	std::ifstream in(path, std::ios::binary);
+	std::vector<unsigned char> rgba((size_t)w * h * 4);
+	if (!in.read((char*)&rgba[0], rgba.size())) {
+		fprintf(stderr, "%s: too short for %ldx%ld\n", name.c_str(), w, h);
+		return;
+	}
+
+	// BGRA のレイヤ画像への取り込み（複製ステージ相当）
+	Clock::time_point start = Clock::now();
+	std::vector<unsigned char> bgra(rgba.size());
+	for (size_t i = 0; i < rgba.size(); i += 4) {
+		bgra[i+0] = rgba[i+2], bgra[i+1] = rgba[i+1], bgra[i+2] = rgba[i+0], bgra[i+3] = rgba[i+3];
+	}
+	printf("%-24s %-8s %5ldx%-5ld %9.2f\n", name.c_str(), "clone", w, h, Elapsed(start));
+
+	const ImageRef image(w, h, w * 4, &bgra[0]);
+
+	// メモリ上への圧縮と，書き出しステージを通したファイルへの保存（段階ごとの時間は保存時に計測する）
+	auto bench = [&](BenchTotal &total, auto const &encode) {
+		BenchResult r = Measure(opt.repeat, [&]() {
+			MemorySink memory;
+			encode(memory, (EncodeStats*)NULL);
+			return memory.data.size();
+		}, [&](EncodeStats *stats) {
+			FileSink file(opt.output);
+			StreamWriter output(file);
+			encode(output, stats);
+		});
+		Report(total, name, w, h, r);
+	};
+
+	if (opt.tlg5) {
+		TLG5Options tlg5;
+		tlg5.lowEffort = opt.lowEffort;
+		bench(totals[0], [&](ByteSink &sink, EncodeStats *stats) { EncodeTLG5(image, sink, tlg5, NULL, NULL, stats); });
+	}
+	PngOptions png;
+	png.level     = opt.level;
+	png.lowEffort = opt.lowEffort;
+	if (opt.png) {
+		bench(totals[1], [&](ByteSink &sink, EncodeStats *stats) { EncodePNG(image, sink, png, NULL, NULL, stats); });
+	}
+	if (opt.lodepng) {
+		// 圧縮レベル未指定なら LodePNG 組み込みの deflate を使う
+		png.optimize = true;
+		bench(totals[2], [&](ByteSink &sink, EncodeStats *stats) { EncodePNG(image, sink, png, NULL, NULL, stats); });
+	}
+}
+
+static void
+Usage()
+{
+	fprintf(stderr,
+			"usage: layerExSave_bench [options] <file|dir>...\n"
+			"  -s WxH       image size for files without WxH in the name\n"
+			"  -n N         repeat count (best time is reported, default 3)\n"
+			"  -e LIST      encoders to run: tlg5,png,lodepng (default all)\n"
+			"  -l LEVEL     PNG compression level 0-9 (default: encoder default)\n"
+			"  -f           low effort mode for tlg5/png\n"
+			"  -o FILE      output file for the save measurement\n"
+			"  -t FILE      write a Chrome trace (JSON) of all runs to FILE\n"
+			"run one encoder per process (-e) for an exact per-encoder peak RSS\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	BenchOptions opt;
+	std::vector<std::filesystem::path> inputs;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool more = i + 1 < argc;
+		if (arg == "-s" && more) {
+			if (!ParseSize(argv[++i], opt.width, opt.height)) { Usage(); return 1; }
+		} else if (arg == "-n" && more) {
+			opt.repeat = std::max(1, atoi(argv[++i]));
+		} else if (arg == "-e" && more) {
+			std::string list = std::string(",") + argv[++i] + ",";
+			opt.tlg5    = list.find(",tlg5,")    != std::string::npos;
+			opt.png     = list.find(",png,")     != std::string::npos;
+			opt.lodepng = list.find(",lodepng,") != std::string::npos;
+		} else if (arg == "-l" && more) {
+			opt.level = atoi(argv[++i]);
+		} else if (arg == "-f") {
+			opt.lowEffort = true;
+		} else if (arg == "-o" && more) {
+			opt.output = argv[++i];
+		} else if (arg == "-t" && more) {
+			opt.trace = argv[++i];
+		} else if (!arg.empty() && arg[0] == '-') {
+			Usage();
+			return 1;
+		} else {
+			inputs.push_back(arg);
+		}
+	}
+	if (inputs.empty()) {
+		Usage();
+		return 1;
+	}
+
+	// 入力ファイルの列挙
+	std::vector<std::filesystem::path> files;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		if (std::filesystem::is_directory(inputs[i])) {
+			for (auto const &entry : std::filesystem::recursive_directory_iterator(inputs[i])) {
+				std::string ext = entry.path().extension().string();
+				if (entry.is_regular_file() && (ext == ".rgba" || ext == ".raw")) files.push_back(entry.path());
+			}
+		} else {
+			files.push_back(inputs[i]);
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	if (!opt.trace.empty()) {
+		TraceThreadName("bench");
+		TraceEnable(true);
+	}
+
+	std::vector<BenchTotal> totals;
+	totals.push_back(BenchTotal("tlg5"));
+	totals.push_back(BenchTotal("png"));
+	totals.push_back(BenchTotal("lodepng"));
+
+	printf("%-24s %-8s %11s %9s %8s %8s %9s %8s %8s %8s %8s %8s %8s\n",
+		   "file", "encoder", "size", "encode ms", "MB/s", "ratio", "save ms",
+		   "filter", "lzss", "deflate", "crc", "write", "peak MB");
+	for (size_t i = 0; i < files.size(); i++) {
+		try {
+			BenchFile(opt, files[i], totals);
+		} catch (std::exception &e) {
+			fprintf(stderr, "%s: %s\n", files[i].string().c_str(), e.what());
+		}
+	}
+	std::filesystem::remove(opt.output);
+
+	if (!opt.trace.empty()) {
+		std::string json;
+		size_t count = TraceDump(json);
+		std::ofstream out(opt.trace.c_str(), std::ios::binary);
+		out.write(json.data(), json.size());
+		if (!out) fprintf(stderr, "%s: write failed\n", opt.trace.c_str());
+		else      fprintf(stderr, "%s: %zu spans\n", opt.trace.c_str(), count);
+	}
+
+	printf("\n%-8s %6s %10s %9s %8s %10s %8s\n", "encoder", "files", "encode ms", "MB/s", "ratio", "save ms", "peak MB");
+	for (size_t i = 0; i < totals.size(); i++) {
+		BenchTotal const &t = totals[i];
+		if (!t.count) continue;
+		printf("%-8s %6d %10.2f %9.1f %7.2f%% %10.2f %8.1f\n",
+			   t.name, t.count, t.encode, t.raw / (1024.0 * 1024.0) / (t.encode / 1000.0),
+			   t.packed * 100.0 / t.raw, t.save, t.peak / (1024.0 * 1024.0));
+	}
+	return 0;
+}
@@ -1,14 +1,18 @@
 #ifndef _layerexsave_compress_hpp_
 #define _layerexsave_compress_hpp_
 
-#include "utils.hpp"
+#include "encoder.hpp"
+#include "streamwriter.hpp"
+#include "trace.hpp"
 
+#include <cstring>
 #include <vector>
 
-typedef bool ProgressFunc(int percent, void *userdata);
-
 class CompressBase {
-	enum { INITIAL_DATASIZE = 1024*100 };
+	enum {
+		INITIAL_DATASIZE = 1024*100,
+		FLUSH_SIZE       = 1024*256  //< 書き出しステージへ渡す単位
+	};
 
 protected:
 	ProgressFunc *progress;
@@ -16,10 +20,14 @@ protected:
 
 	typedef unsigned char BYTE;
 	typedef std::vector<BYTE> DATA;
-	DATA data;      //< 格納データ
-	ULONG cur;      //< 格納位置
-	ULONG size;     //< 格納サイズ
-	ULONG dataSize; //< データ領域確保サイズ
+	DATA data;       //< 格納データ
+	size_t cur;      //< 格納位置
+	size_t size;     //< 格納サイズ
+	size_t dataSize; //< データ領域確保サイズ
+	size_t base;     //< data 先頭のファイル上の位置
+	ByteSink *sink;  //< 出力先（NULL ならメモリ上に全て保持）
+	bool lowEffort;  //< 圧縮率より速度を優先する
+	EncodeStats *stats; //< 計測値の加算先（NULL なら計測しない）
 
 public:
 	/**
@@ -27,13 +35,13 @@ public:
 	 */
 	CompressBase(ProgressFunc *_progress=NULL, void *_progressData=NULL)
 		: progress(_progress), progressData(_progressData),
-		  cur(0), size(0), dataSize(INITIAL_DATASIZE)
+		  cur(0), size(0), dataSize(INITIAL_DATASIZE), base(0), sink(NULL), lowEffort(false), stats(NULL)
 	{
 		data.resize(dataSize);
 	}
 	CompressBase(CompressBase const *ref)
 		: progress(ref->progress), progressData(ref->progressData),
-		  cur(0), size(0), dataSize(INITIAL_DATASIZE)
+		  cur(0), size(0), dataSize(INITIAL_DATASIZE), base(0), sink(NULL), lowEffort(ref->lowEffort), stats(ref->stats)
 	{
 		data.resize(dataSize);
 	}
@@ -43,6 +51,30 @@ public:
 	 */
 	virtual ~CompressBase() {}
 
+	/**
+	 * 保存時に出力側で使うメモリ量の見積もり
+	 * （格納データ領域と書き出しステージのキュー）
+	 */
+	static size_t estimateOutputMemory() {
+		return FLUSH_SIZE * 4 + StreamWriter::MAX_QUEUED_SIZE;
+	}
+
+	/**
+	 * 圧縮負荷の設定
+	 * @param low true なら圧縮率を落として高速に処理する
+	 */
+	void setLowEffort(bool low) {
+		lowEffort = low;
+	}
+
+	/**
+	 * 計測値の加算先の設定
+	 * @param s 加算先（NULL なら計測しない）
+	 */
+	void setStats(EncodeStats *s) {
+		stats = s;
+	}
+
 	/**
 	 * プログレス処理
 	 * @return キャンセルされた
@@ -63,6 +95,7 @@ public:
 			if (size > dataSize) {
 				dataSize = size * 2;
 				data.resize(dataSize);
+				if (stats) stats->allocations++;
 			}
 		}
 	}
@@ -83,39 +116,43 @@ public:
 	 */
 	template <typename ANYINT>
 	inline void writeInt32(ANYINT num) {
-		writeInt32(num, cur);
+		writeInt32(num, tell());
 		cur += 4;
 	}
 	template <typename ANYINT>
 	inline void writeBigInt32(ANYINT num) {
-		writeBigInt32(num, cur);
+		writeBigInt32(num, tell());
 		cur += 4;
 	}
 
 	/**
 	 * 32bit数値の書き出し
 	 * @param num 数値
+	 * @param pos 書き出し位置（tell() で得たファイル上の位置）
 	 */
 	template <typename ANYINT>
-	inline void writeInt32(ANYINT num, int cur) {
-		resize(cur + 4);
-		data[cur++] =  num        & 0xff;
-		data[cur++] = (num >> 8)  & 0xff;
-		data[cur++] = (num >> 16) & 0xff;
-		data[cur++] = (num >> 24) & 0xff;
+	inline void writeInt32(ANYINT num, size_t pos) {
+		BYTE buf[4];
+		buf[0] =  num        & 0xff;
+		buf[1] = (num >> 8)  & 0xff;
+		buf[2] = (num >> 16) & 0xff;
+		buf[3] = (num >> 24) & 0xff;
+		writeBuffer(buf, 4, pos);
 	}
 
 	/**
 	 * 32bit数値の書き出し
 	 * @param num 数値
+	 * @param pos 書き出し位置（tell() で得たファイル上の位置）
 	 */
 	template <typename ANYINT>
-	inline void writeBigInt32(ANYINT num, int cur) {
-		resize(cur + 4);
-		data[cur++] = (num >> 24) & 0xff;
-		data[cur++] = (num >> 16) & 0xff;
-		data[cur++] = (num >> 8)  & 0xff;
-		data[cur++] =  num        & 0xff;
+	inline void writeBigInt32(ANYINT num, size_t pos) {
+		BYTE buf[4];
+		buf[0] = (num >> 24) & 0xff;
+		buf[1] = (num >> 16) & 0xff;
+		buf[2] = (num >> 8)  & 0xff;
+		buf[3] =  num        & 0xff;
+		writeBuffer(buf, 4, pos);
 	}
 
 	/**
@@ -130,12 +167,54 @@ public:
 	}
 
 	/**
-	 * データをファイルに書き出す
-	 * @param out 出力先ストリーム
+	 * 指定位置へのバッファの書き出し
+	 * 書き出しステージに渡し済みの位置なら上書き指示として送る
+	 * @param buf バッファ
+	 * @param size 出力バイト数
+	 * @param pos 書き出し位置（tell() で得たファイル上の位置）
 	 */
-	void store(IStream *out) {
-		ULONG s;
-		out->Write(&data[0], size, &s);
+	void writeBuffer(const void *buf, size_t size, size_t pos) {
+		const BYTE *p = (const BYTE*)buf;
+		if (pos < base) {
+			size_t len = base - pos;
+			if (len > size) len = size;
+			StageTimer timer(stats, EncodeStats::STAGE_WRITE);
+			sink->patch(pos, p, len);
+			p += len, pos += len, size -= len;
+		}
+		if (size > 0) {
+			resize(pos - base + size);
+			memcpy((void*)&data[pos - base], p, size);
+		}
+	}
+
+	/**
+	 * 現在の書き出し位置
+	 * @return ファイル先頭からの位置
+	 */
+	size_t tell() const {
+		return base + cur;
+	}
+
+	/**
+	 * 現在位置までのデータを書き出しステージに渡す
+	 * @param force 規定サイズに満たなくても渡す
+	 */
+	void flush(bool force=false) {
+		if (!sink || !cur || (!force && cur < FLUSH_SIZE)) return;
+		resize(cur);
+		DATA chunk(data.begin() + cur, data.begin() + size);
+		chunk.resize(dataSize);
+		chunk.swap(data);
+		chunk.resize(cur);
+		if (stats) stats->allocations++;
+		{
+			StageTimer timer(stats, EncodeStats::STAGE_WRITE);
+			sink->push(chunk);
+		}
+		base += cur;
+		size -= cur;
+		cur = 0;
 	}
 
 	/**
@@ -144,58 +223,46 @@ public:
 	 * @param height 画像縦幅
 	 * @param buffer 画像バッファ
 	 * @param pitch 画像データのピッチ
-	 * @param tagsDict タグ情報
 	 * @return キャンセルされたら true
 	 */
-	virtual bool compress(long width, long height, BufRefT buffer, long pitch, iTJSDispatch2 *tagsDict) = 0;
+	virtual bool compress(long width, long height, BufRefT buffer, long pitch) = 0;
 
 	/**
-	 * ファイルに保存する
+	 * 圧縮しながら出力先に順次渡す
+	 * @param image 画像
+	 * @param output 出力先（完了時に finish，キャンセル・失敗時に abort を呼ぶ）
+	 * @return キャンセルされたら true
 	 */
-	bool save(iTJSDispatch2 *layer, const tjs_char *filename, iTJSDispatch2 *info) {
-		// レイヤ画像情報
-		BufRefT buffer;
-		long width, height, pitch;
-		if (!GetLayerBufferAndSize(layer, width, height, buffer, pitch)) {
-			ttstr msg = filename;
-			msg += L":invalid layer";
-			TVPThrowExceptionMessage(msg.c_str());
-		}
-		bool canceled = compress(width, height, buffer, pitch, info);
-
-		// 圧縮がキャンセルされていなければファイル保存
-		if (!canceled) {
-			IStream *out = TVPCreateIStream(filename, TJS_BS_WRITE);
-			if (!out) {
-				ttstr msg = filename;
-				msg += L":can't open";
-				TVPThrowExceptionMessage(msg.c_str());
-			}
-			try {
-				// 格納
-				store(out);
-			} catch (...) {
-				out->Release();
-				throw;
+	bool encode(ImageRef const &image, ByteSink &output) {
+		StageTimer total(stats, EncodeStats::STAGE_TOTAL);
+		TraceSpan span("encode");
+		sink = &output;
+		bool canceled;
+		try {
+			canceled = compress(image.width, image.height, image.buffer, image.pitch);
+
+			// 圧縮がキャンセルされていなければ残りを書き出して完了を待つ
+			if (!canceled) {
+				flush(true);
+				StageTimer timer(stats, EncodeStats::STAGE_WRITE);
+				output.finish();
+				if (stats) {
+					stats->bytesIn  += (unsigned long long)image.width * image.height * 4;
+					stats->bytesOut += tell();
+				}
+			} else {
+				output.abort();
 			}
-			out->Release();
+		} catch (...) {
+			sink = NULL;
+			output.abort();
+			throw;
 		}
+		sink = NULL;
 
 		return canceled;
 	}
 
 };
 
-/**
- * 任意の型で保存
- */
-template <class COMPRESS>
-struct CompressAndSave {
-	typedef COMPRESS CompressClass;
-	static bool saveLayerImage(iTJSDispatch2 *layer, const tjs_char *filename, iTJSDispatch2 *info, ProgressFunc *progress=NULL, void *progressData=NULL) {
-		CompressClass work(progress, progressData);
-		return        work.save(layer, filename, info);
-	}
-};
-
 #endif
@@ -0,0 +1,353 @@
+#include "encoder.hpp"
+#include "streamwriter.hpp"
+#include "lodepng.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace fs = std::filesystem;
+
+//---------------------------------------------------------------------------
+// PNG 画像の一括変換
+//
+// 使い方: layerExSave_convert [options] <file|dir>...
+//   ディレクトリを指定した場合はその下の *.png を全て変換し，出力先に同じ構成で書き出す
+//   入力の内容と変換設定のハッシュを出力先の .layerexsave_convert に記録し，
+//   前回から変わっていないファイルは変換しない
+
+typedef std::chrono::steady_clock Clock;
+
+static const char *MANIFEST_NAME = ".layerexsave_convert";
+
+// 実行設定
+struct ConvertOptions {
+	fs::path output;       //< 出力先ディレクトリ
+	int jobs;              //< 同時に変換するファイル数
+	bool png;              //< PNG で出力する（false なら TLG5）
+	bool lowEffort;        //< 圧縮率より速度を優先する
+	bool raw;              //< PNG をフィルタなしの逐次圧縮で出力する
+	int level;             //< PNG の圧縮レベル（-1 なら既定値）
+	int strategy;          //< PNG の zlib 圧縮方針
+	bool force;            //< 記録に関係なく全て変換する
+	bool quiet;            //< 変換したファイルを表示しない
+	ConvertOptions() : output("."), jobs(0), png(false), lowEffort(false), raw(false),
+					   level(-1), strategy(0), force(false), quiet(false) {}
+
+	/**
+	 * 出力に影響する設定（変わったら変換し直す）
+	 */
+	std::string key() const {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%s:%d:%d:%d:%d", png ? "png" : "tlg5", lowEffort, raw, level, strategy);
+		return buf;
+	}
+};
+
+// 変換1件分
+struct ConvertJob {
+	fs::path input;       //< 入力ファイル
+	std::string name;     //< 出力先からの相対パス（拡張子変更済み）
+	unsigned long long hash;
+	enum { PENDING, DONE, SKIPPED, FAILED } state;
+	ConvertJob() : hash(0), state(PENDING) {}
+};
+
+/**
+ * 内容のハッシュ（FNV-1a 64bit）
+ */
+static unsigned long long
+Hash(unsigned long long h, const void *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static bool
+ReadFile(const fs::path &path, std::vector<unsigned char> &data)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in) return false;
+	data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return !in.bad();
+}
+
+/**
+ * 変換記録（出力ファイル名 → 入力と設定のハッシュ）
+ * 変換が終わるたびに追記し，最後に整理して書き直す
+ */
+class Manifest {
+	fs::path path;
+	std::map<std::string, unsigned long long> entries;
+	std::mutex mutex;
+	FILE *log;
+public:
+	Manifest(const fs::path &path) : path(path), log(NULL) {
+		std::ifstream in(path);
+		std::string line;
+		while (std::getline(in, line)) {
+			size_t tab = line.find('\t');
+			if (tab == std::string::npos) continue;
+			entries[line.substr(tab + 1)] = strtoull(line.substr(0, tab).c_str(), NULL, 16);
+		}
+	}
+	~Manifest() {
+		if (log) fclose(log);
+	}
+	bool matches(const std::string &name, unsigned long long hash) {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<std::string, unsigned long long>::const_iterator it = entries.find(name);
+		return it != entries.end() && it->second == hash;
+	}
+	void add(const std::string &name, unsigned long long hash) {
+		std::lock_guard<std::mutex> lock(mutex);
+		entries[name] = hash;
+		if (!log) log = fopen(path.string().c_str(), "a");
+		if (log) {
+			fprintf(log, "%016llx\t%s\n", hash, name.c_str());
+			fflush(log);
+		}
+	}
+	void save() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (log) {
+			fclose(log);
+			log = NULL;
+		}
+		FILE *fp = fopen(path.string().c_str(), "w");
+		if (!fp) return;
+		for (std::map<std::string, unsigned long long>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+			fprintf(fp, "%016llx\t%s\n", it->second, it->first.c_str());
+		}
+		fclose(fp);
+	}
+};
+
+/**
+ * 1ファイルの変換
+ * 一時ファイルに書き出してから置き換えるので，途中で止まっても壊れたファイルは残らない
+ */
+static void
+Convert(ConvertOptions const &opt, Manifest &manifest, ConvertJob &job, std::string &message)
+{
+	std::vector<unsigned char> source;
+	if (!ReadFile(job.input, source)) throw EncodeError("can't read");
+
+	const std::string key = opt.key();
+	job.hash = Hash(Hash(14695981039346656037ULL, key.data(), key.size()), source.data(), source.size());
+
+	const fs::path target = opt.output / fs::u8path(job.name);
+	if (fs::exists(target) && fs::equivalent(target, job.input)) throw EncodeError("output would overwrite the input");
+	if (!opt.force && manifest.matches(job.name, job.hash) && fs::exists(target)) {
+		job.state = ConvertJob::SKIPPED;
+		return;
+	}
+
+	// RGBA で展開して BGRA に並べ替える
+	Clock::time_point start = Clock::now();
+	std::vector<unsigned char> image;
+	unsigned width, height;
+	unsigned error = lodepng::decode(image, width, height, source, LCT_RGBA, 8);
+	if (error) throw EncodeError(std::string("decode failed: ") + lodepng_error_text(error));
+	for (size_t i = 0; i < image.size(); i += 4) std::swap(image[i], image[i+2]);
+	std::vector<unsigned char>().swap(source);
+
+	fs::create_directories(target.parent_path());
+	const fs::path temp = target.string() + ".tmp";
+	try {
+		FileSink file(temp.string());
+		StreamWriter output(file);
+		const ImageRef ref(width, height, (long)width * 4, image.empty() ? NULL : &image[0]);
+		if (opt.png) {
+			PngOptions png;
+			png.level     = opt.level;
+			png.strategy  = opt.strategy;
+			png.optimize  = !opt.raw;
+			png.lowEffort = opt.lowEffort;
+			EncodePNG(ref, output, png);
+		} else {
+			TLG5Options tlg5;
+			tlg5.lowEffort = opt.lowEffort;
+			EncodeTLG5(ref, output, tlg5);
+		}
+	} catch (...) {
+		std::error_code ec;
+		fs::remove(temp, ec);
+		throw;
+	}
+	fs::rename(temp, target);
+	manifest.add(job.name, job.hash);
+	job.state = ConvertJob::DONE;
+
+	if (!opt.quiet) {
+		char buf[128];
+		const double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		const double ratio = (double)fs::file_size(target) * 100.0 / ((double)width * height * 4);
+		snprintf(buf, sizeof(buf), "%ux%u %.1f ms %.2f%%", width, height, ms, ratio);
+		message = buf;
+	}
+}
+
+/**
+ * 入力ファイルの列挙
+ * 出力名は入力ごとの相対パスなので，複数の入力で同じ出力名になる場合はエラーにする
+ */
+static void
+Collect(ConvertOptions const &opt, std::vector<fs::path> const &inputs, std::vector<ConvertJob> &jobs)
+{
+	const std::string ext = opt.png ? ".png" : ".tlg";
+	for (size_t i = 0; i < inputs.size(); i++) {
+		std::vector<std::pair<fs::path, fs::path> > files; // 入力，相対パス
+		if (fs::is_directory(inputs[i])) {
+			for (auto const &entry : fs::recursive_directory_iterator(inputs[i])) {
+				std::string e = entry.path().extension().string();
+				std::transform(e.begin(), e.end(), e.begin(), ::tolower);
+				if (entry.is_regular_file() && e == ".png") {
+					files.push_back(std::make_pair(entry.path(), entry.path().lexically_relative(inputs[i])));
+				}
+			}
+		} else {
+			files.push_back(std::make_pair(inputs[i], inputs[i].filename()));
+		}
+		for (size_t j = 0; j < files.size(); j++) {
+			ConvertJob job;
+			job.input = files[j].first;
+			job.name  = files[j].second.replace_extension(ext).generic_u8string();
+			jobs.push_back(job);
+		}
+	}
+	std::sort(jobs.begin(), jobs.end(), [](ConvertJob const &a, ConvertJob const &b) { return a.name < b.name; });
+	for (size_t i = 1; i < jobs.size(); i++) {
+		if (jobs[i].name == jobs[i-1].name) {
+			throw EncodeError("duplicate output " + jobs[i].name + ": " + jobs[i-1].input.string() + " and " + jobs[i].input.string());
+		}
+	}
+}
+
+static void
+Usage()
+{
+	fprintf(stderr,
+			"usage: layerExSave_convert [options] <file|dir>...\n"
+			"  -o DIR       output directory (default: current directory)\n"
+			"  -j N         parallel jobs (default: number of cores)\n"
+			"  -t FORMAT    output format: tlg5 (default) or png\n"
+			"  -f           low effort: faster TLG5/PNG with a lower ratio\n"
+			"  -l LEVEL     PNG compression level 0-9\n"
+			"  -s STRATEGY  PNG deflate strategy: default, filtered, huffman, rle\n"
+			"  -r           PNG without filter selection (streaming encoder)\n"
+			"  -a           convert all files, ignoring the previous run\n"
+			"  -q           quiet: print only errors and the summary\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	ConvertOptions opt;
+	std::vector<fs::path> inputs;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool more = i + 1 < argc;
+		if (arg == "-o" && more) {
+			opt.output = argv[++i];
+		} else if (arg == "-j" && more) {
+			opt.jobs = atoi(argv[++i]);
+		} else if (arg == "-t" && more) {
+			std::string t = argv[++i];
+			if (t != "tlg5" && t != "png") { Usage(); return 1; }
+			opt.png = t == "png";
+		} else if (arg == "-f") {
+			opt.lowEffort = true;
+		} else if (arg == "-l" && more) {
+			opt.level = atoi(argv[++i]);
+		} else if (arg == "-s" && more) {
+			static const char *names[] = { "default", "filtered", "huffman", "rle" };
+			std::string s = argv[++i];
+			opt.strategy = -1;
+			for (int n = 0; n < 4; n++) if (s == names[n]) opt.strategy = n;
+			if (opt.strategy < 0) { Usage(); return 1; }
+		} else if (arg == "-r") {
+			opt.raw = true;
+		} else if (arg == "-a") {
+			opt.force = true;
+		} else if (arg == "-q") {
+			opt.quiet = true;
+		} else if (!arg.empty() && arg[0] == '-') {
+			Usage();
+			return 1;
+		} else {
+			inputs.push_back(arg);
+		}
+	}
+	if (inputs.empty()) {
+		Usage();
+		return 1;
+	}
+	if (opt.jobs <= 0) opt.jobs = std::max(1, (int)std::thread::hardware_concurrency());
+
+	std::vector<ConvertJob> jobs;
+	try {
+		Collect(opt, inputs, jobs);
+		fs::create_directories(opt.output);
+	} catch (std::exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	Manifest manifest(opt.output / MANIFEST_NAME);
+
+	// ファイル単位で各スレッドが順に取り出して変換する
+	Clock::time_point start = Clock::now();
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> finished(0);
+	std::mutex output;
+	auto worker = [&]() {
+		for (size_t i; (i = next++) < jobs.size(); ) {
+			ConvertJob &job = jobs[i];
+			std::string message, error;
+			try {
+				Convert(opt, manifest, job, message);
+			} catch (std::exception &e) {
+				job.state = ConvertJob::FAILED;
+				error = e.what();
+			}
+			size_t n = ++finished;
+			std::lock_guard<std::mutex> lock(output);
+			if (job.state == ConvertJob::FAILED) {
+				fprintf(stderr, "[%zu/%zu] %s: %s\n", n, jobs.size(), job.input.string().c_str(), error.c_str());
+			} else if (job.state == ConvertJob::DONE && !opt.quiet) {
+				printf("[%zu/%zu] %s %s\n", n, jobs.size(), job.name.c_str(), message.c_str());
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	const int count = std::min(opt.jobs, (int)std::max<size_t>(1, jobs.size()));
+	for (int i = 1; i < count; i++) threads.push_back(std::thread(worker));
+	worker();
+	for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+	manifest.save();
+
+	size_t done = 0, skipped = 0, failed = 0;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		if (jobs[i].state == ConvertJob::DONE)    done++;
+		if (jobs[i].state == ConvertJob::SKIPPED) skipped++;
+		if (jobs[i].state == ConvertJob::FAILED)  failed++;
+	}
+	printf("%zu converted, %zu unchanged, %zu failed (%d jobs, %.1f s)\n", done, skipped, failed, count,
+		   std::chrono::duration<double>(Clock::now() - start).count());
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,270 @@
+#ifndef _layerexsave_encoder_hpp_
+#define _layerexsave_encoder_hpp_
+
+/**
+ * エンコーダ（layerExSave_core）の公開定義
+ * 吉里吉里に依存せず，画像を (width, height, pitch, buffer) で受け取って ByteSink に書き出す。
+ * プラグイン側（saveimage.cpp）はレイヤとタグ辞書をここの型に変換するだけの薄い層になっている
+ */
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <chrono>
+#include <cstring>
+
+// バッファ参照用の型
+typedef unsigned char const *BufRefT;
+typedef unsigned char       *WrtRefT;
+
+/**
+ * 進捗通知
+ * @param percent パーセント
+ * @param userdata 登録時のデータ
+ * @return true ならキャンセル
+ */
+typedef bool ProgressFunc(int percent, void *userdata);
+
+/**
+ * 圧縮・書き出しの失敗
+ */
+class EncodeError : public std::runtime_error {
+public:
+	EncodeError(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+/**
+ * 画像の参照
+ */
+struct ImageRef {
+	long width, height; //< 画像の大きさ
+	long pitch;         //< ラインごとのバイト数
+	BufRefT buffer;     //< 先頭ライン（メイン画像は BGRA 32bit，領域画像は 8bit）
+
+	ImageRef() : width(0), height(0), pitch(0), buffer(NULL) {}
+	ImageRef(long width, long height, long pitch, BufRefT buffer)
+		: width(width), height(height), pitch(pitch), buffer(buffer) {}
+};
+
+/**
+ * 圧縮データの出力先
+ * 圧縮処理から push/patch で順に渡され，最後に finish（キャンセル・失敗時は abort）が呼ばれる
+ */
+class ByteSink {
+public:
+	typedef unsigned char BYTE;
+	typedef std::vector<BYTE> DATA;
+
+	virtual ~ByteSink() {}
+
+	/**
+	 * 出力先を開く（最初の push の前に呼ばれなければ push 時に開く）
+	 * 失敗したら例外を投げる
+	 */
+	virtual void open() {}
+
+	/**
+	 * 末尾へのデータ追加
+	 * @param chunk 書き出すデータ（中身は引き取られることがある）
+	 */
+	virtual void push(DATA &chunk) = 0;
+
+	/**
+	 * 書き出し済み位置へのデータ上書き
+	 * @param pos 先頭からの位置
+	 * @param buf データ
+	 * @param size バイト数
+	 */
+	virtual void patch(size_t pos, const void *buf, size_t size) = 0;
+
+	/**
+	 * 書き出しの完了（失敗していたら例外を投げる）
+	 */
+	virtual void finish() {}
+
+	/**
+	 * 書き出しの中止
+	 */
+	virtual void abort() {}
+};
+
+/**
+ * メモリ上に保持する出力先
+ */
+class MemorySink : public ByteSink {
+public:
+	DATA data; //< 書き出されたデータ
+
+	virtual void push(DATA &chunk);
+	virtual void patch(size_t pos, const void *buf, size_t size);
+};
+
+/**
+ * stdio のファイルへの出力先
+ * ファイルは最初のデータを受け取った時点で開く
+ */
+class FileSink : public ByteSink {
+public:
+	/**
+	 * @param filename ファイル名（fopen にそのまま渡す）
+	 */
+	FileSink(const std::string &filename);
+	virtual ~FileSink();
+
+	virtual void open();
+	virtual void push(DATA &chunk);
+	virtual void patch(size_t pos, const void *buf, size_t size);
+	virtual void finish();
+	virtual void abort();
+
+protected:
+	void close();
+	void fail(const char *what);
+
+	std::string filename;
+	FILE *fp;
+	size_t written; //< 末尾位置
+};
+
+//---------------------------------------------------------------------------
+// 保存設定
+
+/**
+ * TLG5 の保存設定
+ */
+struct TLG5Options {
+	typedef std::vector<std::pair<std::string, std::string> > TAGS;
+	TAGS tags;      //< タグ情報（名前と値をナロー文字列で格納。空なら生の TLG5 を出力する）
+	bool lowEffort; //< 圧縮率より速度を優先する
+
+	TLG5Options() : lowEffort(false) {}
+};
+
+/**
+ * PNG の保存設定
+ */
+struct PngOptions {
+	// 追加チャンク（pHYs/oFFs/vpAg）の値
+	struct Pair {
+		bool defined;
+		long x, y;
+		bool unit; //< 単位つき（pHYs は meter，oFFs/vpAg は micrometer）
+		Pair() : defined(false), x(0), y(0), unit(false) {}
+	};
+	Pair reso;      //< 解像度(pHYs)
+	Pair offs;      //< 表示位置(oFFs)
+	Pair vpag;      //< 仮想ページ(vpAg)
+	int  level;     //< zlib の圧縮レベル（-1 なら既定値）
+	int  strategy;  //< zlib の圧縮方針（0:既定 1:Z_FILTERED 2:Z_HUFFMAN_ONLY 3:Z_RLE。LodePNG 組み込みの deflate では無視）
+	bool optimize;  //< LodePNG で色形式とフィルタを選んで一括で圧縮する（level が -1 なら LodePNG 組み込みの deflate）
+	bool lowEffort; //< 圧縮率より速度を優先する（逐次圧縮時のみ）
+
+	PngOptions() : level(-1), strategy(0), optimize(false), lowEffort(false) {}
+};
+
+//---------------------------------------------------------------------------
+// 計測
+
+/**
+ * 保存処理の計測値
+ * エンコーダに渡すと各段階の所要時間と件数が加算される（clear しない限り累積）
+ */
+struct EncodeStats {
+	enum Stage {
+		STAGE_CLONE,   //< レイヤ画像の複製（非同期保存時にプラグイン側で計測）
+		STAGE_FILTER,  //< フィルタ・画素の並べ替え
+		STAGE_LZSS,    //< TLG5 の LZSS 圧縮
+		STAGE_DEFLATE, //< PNG の deflate 圧縮（LodePNG 使用時はフィルタ選択と CRC を含む）
+		STAGE_CRC,     //< PNG チャンクの CRC 計算
+		STAGE_WRITE,   //< 出力先への受け渡し（書き出し待ちを含む）
+		STAGE_TOTAL,   //< エンコーダ全体
+		STAGE_MAX
+	};
+	unsigned long long time[STAGE_MAX]; //< 所要時間(ns, steady_clock)
+	unsigned long long bytesIn;     //< 入力した画素のバイト数
+	unsigned long long bytesOut;    //< 出力先に渡したバイト数
+	unsigned long long rawBlocks;   //< 無圧縮で格納した TLG5 ブロック（色ごと）
+	unsigned long long lzssBlocks;  //< LZSS で格納した TLG5 ブロック（色ごと）
+	unsigned long long chainSteps;  //< LZSS の一致検索で辿ったチェインの数
+	unsigned long long allocations; //< 作業領域・出力バッファの確保回数
+
+	EncodeStats() { clear(); }
+	void clear() { memset(this, 0, sizeof(*this)); }
+
+	/**
+	 * 段階名（辞書のキーなどに使う）
+	 */
+	static const char *stageName(int stage) {
+		static const char *names[STAGE_MAX] = { "clone", "filter", "lzss", "deflate", "crc", "write", "total" };
+		return (stage >= 0 && stage < STAGE_MAX) ? names[stage] : "";
+	}
+};
+
+/**
+ * 段階の所要時間の計測（スコープを抜けるか stop で加算する。stats が NULL なら何もしない）
+ */
+class StageTimer {
+public:
+	typedef std::chrono::steady_clock CLOCK;
+
+	StageTimer(EncodeStats *stats, int stage) : stats(stats), stage(stage) {
+		if (stats) start = CLOCK::now();
+	}
+	~StageTimer() { stop(); }
+
+	void stop() {
+		if (stats) {
+			stats->time[stage] += (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(CLOCK::now() - start).count();
+			stats = NULL;
+		}
+	}
+
+protected:
+	EncodeStats *stats;
+	int stage;
+	CLOCK::time_point start;
+};
+
+//---------------------------------------------------------------------------
+// エンコーダ
+
+/**
+ * TLG5 形式での圧縮
+ * @param image 画像（BGRA 32bit）
+ * @param sink 出力先
+ * @param opt 保存設定
+ * @param progress 進捗通知（NULL なら通知しない）
+ * @param progressData 進捗通知に渡すデータ
+ * @param stats 計測値の加算先（NULL なら計測しない）
+ * @return キャンセルされたら true
+ */
+bool EncodeTLG5(ImageRef const &image, ByteSink &sink, TLG5Options const &opt = TLG5Options(),
+				ProgressFunc *progress = NULL, void *progressData = NULL, EncodeStats *stats = NULL);
+
+/**
+ * PNG 形式での圧縮
+ * opt.optimize が false なら RGBA・フィルタなしで1ラインずつ圧縮しながら出力先に渡す
+ * @param image 画像（BGRA 32bit）
+ * @param sink 出力先
+ * @param opt 保存設定
+ * @param progress 進捗通知（NULL なら通知しない）
+ * @param progressData 進捗通知に渡すデータ
+ * @param stats 計測値の加算先（NULL なら計測しない）
+ * @return キャンセルされたら true
+ */
+bool EncodePNG(ImageRef const &image, ByteSink &sink, PngOptions const &opt = PngOptions(),
+			   ProgressFunc *progress = NULL, void *progressData = NULL, EncodeStats *stats = NULL);
+
+/**
+ * 領域画像の 256色パレット PNG 形式での圧縮
+ * @param province 領域画像（8bit）
+ * @param sink 出力先
+ * @param stats 計測値の加算先（NULL なら計測しない）
+ * @return 対応していなければ（LAYEREXSAVE_DISABLE_LODEPNG 指定時）false
+ */
+bool EncodeProvincePNG(ImageRef const &province, ByteSink &sink, EncodeStats *stats = NULL);
+
+#endif
@@ -0,0 +1,167 @@
+#include "ncbind.hpp"
+#include "parallel.hpp"
+
+//---------------------------------------------------------------------------
+// 画素処理用の並列実行器
+
+// ワーカスレッド内かどうか（入れ子の並列処理は逐次実行する）
+static thread_local bool InsideWorker = false;
+
+ParallelExecutor &
+ParallelExecutor::instance()
+{
+	static ParallelExecutor executor;
+	return executor;
+}
+
+ParallelExecutor::ParallelExecutor()
+	: parallelism(0), generation(0), pending(0), closing(false), func(NULL), count(0), grain(1), next(0)
+{
+}
+
+ParallelExecutor::~ParallelExecutor()
+{
+	shutdown();
+}
+
+void
+ParallelExecutor::setParallelism(int count)
+{
+	std::lock_guard<std::mutex> lock(busy);
+	if (count < 0) count = 0;
+	if (count != parallelism) {
+		stop(); // 次の run で新しい数のワーカを起動する
+		parallelism = count;
+	}
+}
+
+int
+ParallelExecutor::workers() const
+{
+	int n = parallelism;
+	if (n <= 0) n = (int)std::thread::hardware_concurrency();
+	return n < 1 ? 1 : n;
+}
+
+void
+ParallelExecutor::shutdown()
+{
+	std::lock_guard<std::mutex> lock(busy);
+	stop();
+}
+
+/**
+ * ワーカの起動（呼び出し元の分を除いた count-1 本）
+ */
+void
+ParallelExecutor::start(int count)
+{
+	closing = false;
+	for (int i = 1; i < count; i++) {
+		threads.push_back(std::thread(&ParallelExecutor::worker, this, i, generation));
+	}
+}
+
+void
+ParallelExecutor::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closing = true;
+	}
+	wakeup.notify_all();
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+	threads.clear();
+}
+
+void
+ParallelExecutor::run(long count, long grain, FUNC const &func, int limit)
+{
+	if (count <= 0) return;
+	if (grain < 1) grain = 1;
+	std::unique_lock<std::mutex> running(busy, std::defer_lock);
+	if (count <= grain || InsideWorker || !running.try_lock()) {
+		func(0L, count, 0);
+		return;
+	}
+	// 設定は busy を取っている間は変わらない
+	int n = workers();
+	if (limit > 0 && n > limit) n = limit;
+	if (n <= 1) {
+		running.unlock();
+		func(0L, count, 0);
+		return;
+	}
+	if ((int)threads.size() != n - 1) {
+		stop();
+		start(n);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->func  = &func;
+		this->count = count;
+		this->grain = grain;
+		this->next  = 0;
+		this->error = std::exception_ptr();
+		pending = (int)threads.size();
+		generation++;
+	}
+	wakeup.notify_all();
+
+	// 呼び出し元も処理に参加する
+	InsideWorker = true;
+	process(0);
+	InsideWorker = false;
+
+	std::exception_ptr error;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]{ return pending == 0; });
+		this->func = NULL;
+		error = this->error;
+	}
+	if (error) std::rethrow_exception(error);
+}
+
+/**
+ * 残りの塊がなくなるまで処理する
+ */
+void
+ParallelExecutor::process(int index)
+{
+	for (;;) {
+		long begin = next.fetch_add(grain);
+		if (begin >= count) break;
+		long end = begin + grain < count ? begin + grain : count;
+		try {
+			(*func)(begin, end, index);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error) error = std::current_exception();
+			next = count; // 残りは打ち切る
+		}
+	}
+}
+
+/**
+ * ワーカスレッド本体
+ * @param seen 起動時点で処理済みの番号
+ */
+void
+ParallelExecutor::worker(int index, unsigned long seen)
+{
+	InsideWorker = true;
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		wakeup.wait(lock, [&]{ return generation != seen || closing; });
+		if (closing) break;
+		seen = generation;
+		lock.unlock();
+		process(index);
+		lock.lock();
+		if (--pending == 0) done.notify_one();
+	}
+}
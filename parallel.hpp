@@ -0,0 +1,126 @@
+#ifndef _layerexsave_parallel_hpp_
+#define _layerexsave_parallel_hpp_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+
+/**
+ * 画素処理用の並列実行器
+ * 範囲を一定の大きさの塊に分け，呼び出し元と常駐ワーカが一つの共有カウンタから塊を順に取っていく
+ * （スレッド別のキューは持たない。塊を小さくすることで処理の重さの偏りをならす）
+ */
+class ParallelExecutor {
+public:
+	typedef std::function<void(long begin, long end, int worker)> FUNC;
+
+	/**
+	 * プラグイン共通のインスタンス
+	 */
+	static ParallelExecutor &instance();
+
+	/**
+	 * 並列数の設定
+	 * @param count 使用するスレッド数（呼び出し元を含む。0 なら CPU 数，1 なら並列化しない）
+	 */
+	void setParallelism(int count);
+	int getParallelism() const { return parallelism; }
+
+	/**
+	 * 処理に使われるスレッド数（run に渡される worker 番号はこれ未満）
+	 * 他のスレッドが setParallelism すると変わるので，worker 別の集計に使う場合は
+	 * 取得した値を run の limit に渡すこと
+	 */
+	int workers() const;
+
+	/**
+	 * [0,count) を grain 個ずつに分けて並列に処理する（全て終わるまで戻らない）
+	 * ワーカ内から呼ばれた場合や他のスレッドが実行中の場合はその場で逐次処理する
+	 * @param func func(begin, end, worker) 形式の処理（同じ worker で複数回呼ばれることがある）
+	 * @param limit 使用するスレッド数の上限（worker 番号はこれ未満になる。0 なら制限しない）
+	 */
+	void run(long count, long grain, FUNC const &func, int limit=0);
+
+	/**
+	 * 全ワーカの終了
+	 */
+	void shutdown();
+
+protected:
+	ParallelExecutor();
+	~ParallelExecutor();
+
+	void start(int count);
+	void stop();
+	void worker(int index, unsigned long seen);
+	void process(int index);
+
+	std::atomic<int> parallelism;
+	std::vector<std::thread> threads;
+	std::mutex busy;  //< run の実行中
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable done;
+	unsigned long generation; //< 投入した処理の番号
+	int pending;              //< 処理中のワーカ数
+	bool closing;
+
+	// 実行中の処理
+	FUNC const *func;
+	long count, grain;
+	std::atomic<long> next;
+	std::exception_ptr error;
+};
+
+/**
+ * 並列処理（ParallelExecutor::run の省略形）
+ */
+inline void
+ParallelFor(long count, long grain, ParallelExecutor::FUNC const &func, int limit=0)
+{
+	ParallelExecutor::instance().run(count, grain, func, limit);
+}
+
+/**
+ * 並列集計（スレッドごとに集計値を持ち，最後にまとめる）
+ * @param init 初期値（combine の単位元であること）
+ * @param map map(begin, end) で範囲の集計値を返す
+ * @param combine combine(a, b) で集計値をまとめる
+ */
+template <typename T, typename MAP, typename COMBINE>
+T
+ParallelReduce(long count, long grain, T const &init, MAP const &map, COMBINE const &combine)
+{
+	const int n = ParallelExecutor::instance().workers();
+	std::vector<T> parts(n, init);
+	ParallelFor(count, grain, [&](long begin, long end, int worker) {
+		parts[worker] = combine(parts[worker], map(begin, end));
+	}, n);
+	T result = init;
+	for (size_t i = 0; i < parts.size(); i++) result = combine(result, parts[i]);
+	return result;
+}
+
+/**
+ * タイル単位の並列処理
+ * @param grain 一度に割り当てるタイル数（タイル総数以上なら逐次処理）
+ * @param func func(x, y, w, h, worker) 形式の処理（端のタイルは小さくなる）
+ */
+template <typename FUNC>
+void
+ParallelTiles(long width, long height, long tileW, long tileH, long grain, FUNC const &func)
+{
+	const long tw = (width + tileW - 1) / tileW, th = (height + tileH - 1) / tileH;
+	ParallelFor(tw * th, grain, [&](long begin, long end, int worker) {
+		for (long i = begin; i < end; i++) {
+			const long x = (i % tw) * tileW, y = (i / tw) * tileH;
+			func(x, y, (width - x) < tileW ? (width - x) : tileW, (height - y) < tileH ? (height - y) : tileH, worker);
+		}
+	});
+}
+
+#endif
@@ -0,0 +1,448 @@
+#include "ncbind.hpp"
+#include "saveimage.hpp"
+#include "streamwriter.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+#include <cstdio>
+
+//---------------------------------------------------------------------------
+// エンコーダ（layerExSave_core）との橋渡し
+
+static inline bool Failed(HRESULT hr) { return hr < 0; }
+
+/**
+ * ナロー文字列への変換
+ */
+static std::string
+Narrow(const ttstr &str)
+{
+	tjs_int len = str.GetNarrowStrLen();
+	if (len <= 0) return std::string();
+	std::vector<tjs_nchar> buf(len + 1);
+	str.ToNarrowStr(&buf[0], len);
+	return std::string(&buf[0], len);
+}
+
+/**
+ * エンコーダの例外を吉里吉里の例外として投げ直す
+ */
+static void
+ThrowEncodeError(EncodeError const &e)
+{
+	TVPThrowExceptionMessage(ttstr(e.what()).c_str());
+}
+
+/**
+ * ローカルファイルの置き換え（from を to に名前を変えて上書きする）
+ * @return 成功したら true
+ */
+static bool
+ReplaceLocalFile(const ttstr &from, const ttstr &to)
+{
+#if defined(_WIN32)
+	return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(Narrow(from).c_str(), Narrow(to).c_str()) == 0;
+#endif
+}
+
+/**
+ * ローカルファイルの削除
+ */
+static void
+RemoveLocalFile(const ttstr &name)
+{
+#if defined(_WIN32)
+	DeleteFileW(name.c_str());
+#else
+	remove(Narrow(name).c_str());
+#endif
+}
+
+/**
+ * 吉里吉里のストリームへの出力先
+ * ファイルは最初のデータを受け取った時点で開く。
+ * ローカルファイルへの保存は，キャンセル・失敗時に元のファイルを壊さないよう
+ * 同じフォルダの一時ファイル（ファイル名＋".tmp"）に書き出し，finish の時点で置き換える。
+ * 書き出しスレッドから呼ばれるので，失敗は EncodeError で通知する
+ */
+class IStreamSink : public ByteSink {
+public:
+	IStreamSink(const tjs_char *filename)
+		: filename(filename), name(Narrow(filename)), out(NULL), written(0) {
+		local = TVPGetLocallyAccessibleName(this->filename);
+		if (!local.IsEmpty()) {
+			target = this->filename + TJS_W(".tmp");
+			temp   = local + TJS_W(".tmp");
+		} else {
+			// アーカイブ内など置き換えられない場合は直接書き出す
+			target = this->filename;
+		}
+	}
+	virtual ~IStreamSink() { abort(); }
+
+	virtual void open() {
+		if (out) return;
+		out = TVPCreateIStream(target, TJS_BS_WRITE);
+		if (!out) throw EncodeError(name + ":can't open");
+		written = 0;
+	}
+	virtual void push(DATA &chunk) {
+		if (chunk.empty()) return;
+		if (!out) open();
+		ULONG s = 0;
+		if (Failed(out->Write(&chunk[0], (ULONG)chunk.size(), &s)) || s != chunk.size()) fail();
+		written += chunk.size();
+	}
+	virtual void patch(size_t pos, const void *buf, size_t size) {
+		if (!size || !out) return;
+		// 上書き後は末尾に戻す
+		LARGE_INTEGER move;
+		ULONG s = 0;
+		move.QuadPart = pos;
+		if (Failed(out->Seek(move, STREAM_SEEK_SET, NULL))) fail();
+		if (Failed(out->Write(buf, (ULONG)size, &s)) || s != size) fail();
+		move.QuadPart = written;
+		if (Failed(out->Seek(move, STREAM_SEEK_SET, NULL))) fail();
+	}
+	virtual void finish() {
+		if (!out) return;
+		close();
+		if (!temp.IsEmpty()) {
+			if (!ReplaceLocalFile(temp, local)) fail();
+			temp.Clear();
+		}
+	}
+	virtual void abort() {
+		close();
+		if (!temp.IsEmpty()) {
+			RemoveLocalFile(temp);
+			temp.Clear();
+		}
+	}
+
+protected:
+	void close() {
+		if (out) {
+			out->Release();
+			out = NULL;
+		}
+	}
+	void fail() {
+		abort();
+		throw EncodeError(name + ":write failed");
+	}
+
+	ttstr filename;
+	std::string name; //< エラー表示用
+	ttstr target;     //< 書き出し先のストレージ名（置き換える場合は一時ファイル）
+	ttstr local;      //< 保存先のローカルファイル名（置き換えできない場合は空）
+	ttstr temp;       //< 一時ファイルのローカルファイル名（置き換え済み・削除済みなら空）
+	IStream *out;
+	size_t written;   //< 末尾位置
+};
+
+/**
+ * レイヤのメイン画像の参照
+ */
+static bool
+GetLayerImage(iTJSDispatch2 *layer, ImageRef &image)
+{
+	return GetLayerBufferAndSize(layer, image.width, image.height, image.buffer, image.pitch);
+}
+
+/**
+ * タグ辞書から TLG5 のタグ情報を取り出す
+ */
+static void
+GetTLG5Tags(iTJSDispatch2 *tagsDict, TLG5Options::TAGS &tags)
+{
+	if (!tagsDict) return;
+	/**
+	 * タグ展開用
+	 */
+	class TagsCaller : public tTJSDispatch /** EnumMembers 用 */ {
+	protected:
+		TLG5Options::TAGS *store;
+	public:
+		TagsCaller(TLG5Options::TAGS *store) : store(store) {};
+		virtual tjs_error TJS_INTF_METHOD FuncCall( // function invocation
+													tjs_uint32 flag,			// calling flag
+													const tjs_char * membername,// member name ( NULL for a default member )
+													tjs_uint32 *hint,			// hint for the member name (in/out)
+													tTJSVariant *result,		// result
+													tjs_int numparams,			// number of parameters
+													tTJSVariant **param,		// parameters
+													iTJSDispatch2 *objthis		// object as "this"
+													) {
+			if (numparams > 1) {
+				tTVInteger flag = param[1]->AsInteger();
+				// 計測値の受け取り先（stats）はタグとして書き出さない
+				bool statsTag = param[2]->Type() == tvtObject && ttstr(*param[0]) == TJS_W("stats");
+				if (!(flag & TJS_HIDDENMEMBER) && !statsTag) {
+					ttstr name  = *param[0];
+					ttstr value = *param[2];
+					store->push_back(std::make_pair(Narrow(name), Narrow(value)));
+				}
+			}
+			if (result) {
+				*result = true;
+			}
+			return TJS_S_OK;
+		}
+	} *caller = new TagsCaller(&tags);
+	tTJSVariantClosure closure(caller);
+	tagsDict->EnumMembers(TJS_IGNOREPROP, &closure, tagsDict);
+	caller->Release();
+}
+
+/**
+ * 追加チャンクの値を取り出す
+ * @param unit 単位のタグ名
+ * @param oneval 単位つきとみなす値
+ */
+static void
+GetPngPair(ncbPropAccessor &dic, const tjs_char *x, const tjs_char *y, const tjs_char *unit, const tjs_char *oneval, PngOptions::Pair &pair)
+{
+	if (dic.HasValue(x) || dic.HasValue(y)) {
+		pair.defined = true;
+		pair.x = (long)dic.getIntValue(x);
+		pair.y = (long)dic.getIntValue(y);
+		pair.unit = dic.getStrValue(unit) == ttstr(oneval);
+	}
+}
+
+/**
+ * タグ辞書から PNG の保存設定を取り出す
+ */
+static void
+GetPngTags(iTJSDispatch2 *tagsDict, PngOptions &opt)
+{
+	if (!tagsDict) return;
+	ncbPropAccessor dic(tagsDict);
+	GetPngPair(dic, TJS_W("reso_x"), TJS_W("reso_y"), TJS_W("reso_unit"), TJS_W("meter"),      opt.reso);
+	GetPngPair(dic, TJS_W("offs_x"), TJS_W("offs_y"), TJS_W("offs_unit"), TJS_W("micrometer"), opt.offs);
+	GetPngPair(dic, TJS_W("vpag_w"), TJS_W("vpag_h"), TJS_W("vpag_unit"), TJS_W("micrometer"), opt.vpag);
+
+	// compression level
+	if (dic.HasValue(TJS_W("comp_lv"))) {
+		opt.level = (int)dic.getIntValue(TJS_W("comp_lv"), -1);
+	}
+}
+
+/**
+ * タグ辞書から計測値の受け取り先（stats に指定した辞書）を取り出す
+ * @return 受け取り先（指定がなければ NULL）
+ */
+static iTJSDispatch2 *
+GetStatsTag(iTJSDispatch2 *tagsDict)
+{
+	if (!tagsDict) return NULL;
+	tTJSVariant stats;
+	if (TJS_FAILED(tagsDict->PropGet(0, TJS_W("stats"), NULL, &stats, tagsDict)) || stats.Type() != tvtObject) return NULL;
+	return stats.AsObjectNoAddRef(); // タグ辞書が保持している
+}
+
+/**
+ * PNG の保存設定を取り出す
+ * @param info タグ辞書，または圧縮レベルの数値
+ * @return 計測値の受け取り先（タグ辞書の stats。指定がなければ NULL）
+ */
+static iTJSDispatch2 *
+GetPngOptions(tTJSVariant const *info, PngOptions &opt)
+{
+	if (!info) return NULL;
+	if (info->Type() == tvtObject) {
+		GetPngTags(info->AsObjectNoAddRef(), opt);
+		return GetStatsTag(info->AsObjectNoAddRef());
+	}
+	opt.level = (int)info->AsInteger();
+	return NULL;
+}
+
+void
+StoreSaveStatistics(EncodeStats const &stats, iTJSDispatch2 *dict)
+{
+	ncbPropAccessor acc(dict);
+	for (int i = 0; i < EncodeStats::STAGE_MAX; i++) {
+		acc.SetValue(ttstr(EncodeStats::stageName(i)).c_str(), (tTVReal)(stats.time[i] / 1000000.0));
+	}
+	acc.SetValue(TJS_W("bytesIn"),     (tTVInteger)stats.bytesIn);
+	acc.SetValue(TJS_W("bytesOut"),    (tTVInteger)stats.bytesOut);
+	acc.SetValue(TJS_W("rawBlocks"),   (tTVInteger)stats.rawBlocks);
+	acc.SetValue(TJS_W("lzssBlocks"),  (tTVInteger)stats.lzssBlocks);
+	acc.SetValue(TJS_W("chainSteps"),  (tTVInteger)stats.chainSteps);
+	acc.SetValue(TJS_W("allocations"), (tTVInteger)stats.allocations);
+}
+
+size_t
+DumpSaveTrace(const tjs_char *filename)
+{
+	std::string json;
+	size_t count = TraceDump(json);
+	ByteSink::DATA data(json.begin(), json.end());
+	IStreamSink file(filename);
+	try {
+		file.push(data);
+		file.finish();
+	} catch (EncodeError &e) {
+		ThrowEncodeError(e);
+	}
+	return count;
+}
+
+bool
+SaveLayerImage(iTJSDispatch2 *layer, const tjs_char *filename, iTJSDispatch2 *info, bool png,
+			   ProgressFunc *progress, void *progressData, bool lowEffort, EncodeStats *stats)
+{
+	ImageRef image;
+	if (!GetLayerImage(layer, image)) {
+		ttstr msg = filename;
+		msg += L":invalid layer";
+		TVPThrowExceptionMessage(msg.c_str());
+	}
+	IStreamSink file(filename);
+	StreamWriter output(file);
+	try {
+		if (png) {
+			PngOptions opt;
+			GetPngTags(info, opt);
+			opt.lowEffort = lowEffort;
+			return EncodePNG(image, output, opt, progress, progressData, stats);
+		} else {
+			TLG5Options opt;
+			GetTLG5Tags(info, opt.tags);
+			opt.lowEffort = lowEffort;
+			return EncodeTLG5(image, output, opt, progress, progressData, stats);
+		}
+	} catch (EncodeError &e) {
+		ThrowEncodeError(e);
+	}
+	return true;
+}
+
+//---------------------------------------------------------------------------
+// レイヤ拡張
+//---------------------------------------------------------------------------
+
+/**
+ * TLG5 形式での画像の保存。注意点:データの保存が終わるまで処理が帰りません。
+ * @param filename ファイル名
+ * @param tags タグ情報（stats に辞書を指定すると計測値を格納する）
+ */
+static tjs_error TJS_INTF_METHOD saveLayerImageTlg5Func(tTJSVariant *result,
+														tjs_int numparams,
+														tTJSVariant **param,
+														iTJSDispatch2 *objthis) {
+	if (numparams < 1) return TJS_E_BADPARAMCOUNT;
+	iTJSDispatch2 *info  = numparams > 1 ? param[1]->AsObjectNoAddRef() : NULL;
+	iTJSDispatch2 *store = GetStatsTag(info);
+	EncodeStats stats;
+	SaveLayerImage(
+		objthis, // layer
+		param[0]->GetString(),  // filename
+		info,
+		false,
+		NULL, NULL, false,
+		store ? &stats : NULL
+		);
+	if (store) StoreSaveStatistics(stats, store);
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(saveLayerImageTlg5, Layer, saveLayerImageTlg5Func);
+
+/**
+ * PNG 形式での画像の保存。注意点:データの保存が終わるまで処理が帰りません。
+ * @param filename ファイル名
+ * @param tags タグ情報（stats に辞書を指定すると計測値を格納する）
+ */
+static tjs_error TJS_INTF_METHOD saveLayerImagePngFunc(tTJSVariant *result,
+														tjs_int numparams,
+														tTJSVariant **param,
+														iTJSDispatch2 *objthis) {
+	if (numparams < 1) return TJS_E_BADPARAMCOUNT;
+	ImageRef image;
+	if (GetLayerImage(objthis, image)) {
+		PngOptions opt;
+		opt.optimize = true;
+		iTJSDispatch2 *store = GetPngOptions(numparams > 1 ? param[1] : NULL, opt);
+		EncodeStats stats;
+		IStreamSink file(param[0]->GetString());
+		StreamWriter output(file);
+		try {
+			EncodePNG(image, output, opt, NULL, NULL, store ? &stats : NULL);
+		} catch (EncodeError &e) {
+			ThrowEncodeError(e);
+		}
+		if (store) StoreSaveStatistics(stats, store);
+	}
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(saveLayerImagePng,       Layer, saveLayerImagePngFunc);
+
+/**
+ * PNG 形式画像をoctetで返す。注意点:データの保存が終わるまで処理が帰りません。
+ * @param compression_level 圧縮率，またはタグ情報（stats に辞書を指定すると計測値を格納する）
+ */
+static tjs_error TJS_INTF_METHOD saveLayerImagePngOctet(tTJSVariant *result,
+														tjs_int numparams,
+														tTJSVariant **param,
+														iTJSDispatch2 *objthis)
+{
+	if (result) {
+		*result = TJS_W("");
+		ImageRef image;
+		if (GetLayerImage(objthis, image)) {
+			PngOptions opt;
+			opt.optimize = true;
+#if defined(LAYEREXSAVE_DISABLE_LODEPNG) && (LAYEREXSAVE_DISABLE_LODEPNG != 0)
+			opt.level = 1; // 旧版の既定値
+#endif
+			iTJSDispatch2 *store = GetPngOptions((numparams >= 1) ? param[0] : NULL, opt);
+			EncodeStats stats;
+			MemorySink png;
+			try {
+				EncodePNG(image, png, opt, NULL, NULL, store ? &stats : NULL);
+			} catch (EncodeError &e) {
+				ThrowEncodeError(e);
+			}
+			if (store) StoreSaveStatistics(stats, store);
+			if (!png.data.empty()) {
+				tTJSVariantOctet *oct = TJSAllocVariantOctet(&png.data[0], (tjs_uint)png.data.size());
+				*result = oct;
+				oct->Release();
+			}
+		}
+	}
+	return TJS_S_OK;
+}
+NCB_ATTACH_FUNCTION(saveLayerImagePngOctet, Layer, saveLayerImagePngOctet);
+
+/**
+ * Province画像を保存(フォーマット：256パレット式PNG固定)
+ * @param filename ファイル名
+ * @param palette パレット情報（※将来的予約／現在未実装）
+ */
+static tjs_error TJS_INTF_METHOD saveProvinceImageFunc(tTJSVariant *result,
+													   tjs_int numparams,
+													   tTJSVariant **param,
+													   iTJSDispatch2 *objthis)
+{
+	if (numparams < 1) return TJS_E_BADPARAMCOUNT;
+	ImageRef province;
+	if (!GetProvinceBufferAndSize(objthis, province.width, province.height, province.buffer, province.pitch)) {
+		TVPThrowExceptionMessage(TJS_W("no province image"));
+	}
+	IStreamSink file(param[0]->GetString());
+	bool done = false;
+	try {
+		done = EncodeProvincePNG(province, file);
+	} catch (EncodeError &e) {
+		ThrowEncodeError(e);
+	}
+	return done ? TJS_S_OK : TJS_E_NOTIMPL;
+}
+NCB_ATTACH_FUNCTION(saveProvinceImage, Layer, saveProvinceImageFunc);
@@ -0,0 +1,37 @@
+#ifndef _layerexsave_saveimage_hpp_
+#define _layerexsave_saveimage_hpp_
+
+#include "encoder.hpp"
+
+/**
+ * レイヤ画像をファイルに保存する（TLG5 または逐次圧縮の PNG）
+ * 圧縮しながら書き出しステージに順次渡す
+ * @param layer レイヤ
+ * @param filename ファイル名
+ * @param info タグ情報（NULL 可）
+ * @param png true なら PNG，false なら TLG5 で保存する
+ * @param progress 進捗通知
+ * @param progressData 進捗通知に渡すデータ
+ * @param lowEffort 圧縮率を落として高速に保存する
+ * @param stats 計測値の加算先（NULL なら計測しない）
+ * @return キャンセルされたら true
+ */
+bool SaveLayerImage(iTJSDispatch2 *layer, const tjs_char *filename, iTJSDispatch2 *info, bool png,
+					ProgressFunc *progress=NULL, void *progressData=NULL, bool lowEffort=false, EncodeStats *stats=NULL);
+
+/**
+ * 計測値を辞書に格納する
+ * 各段階の所要時間(ms)を段階名のキーで，件数を bytesIn などのキーで設定する
+ * @param stats 計測値
+ * @param dict 格納先の辞書
+ */
+void StoreSaveStatistics(EncodeStats const &stats, iTJSDispatch2 *dict);
+
+/**
+ * トレースの記録を Chrome の trace event 形式（JSON）でファイルに書き出す
+ * @param filename ファイル名
+ * @return 書き出した区間の数
+ */
+size_t DumpSaveTrace(const tjs_char *filename);
+
+#endif
@@ -1,10 +1,79 @@
-#include "ncbind.hpp"
 #include "savepng.hpp"
+#include "simd.hpp"
 
+#include <cstdlib>
+#include <cstring>
 #include "zlib.h"
 
 #define PNGTYPE_RGBA8888 (0x08060000L)
 
+//---------------------------------------------------------------------------
+// 画素の並べ替え用
+
+/**
+ * 1ライン分の BGRA を RGBA に並べ替える
+ */
+typedef void (*PngPackKernel)(BufRefT p, WrtRefT w, long width);
+
+static void
+PngPackLineScalar(BufRefT p, WrtRefT w, long width)
+{
+	for(long x = 0; x < width; x++, p+=4) {
+		*w++ = p[2];
+		*w++ = p[1];
+		*w++ = p[0];
+		*w++ = p[3];
+	}
+}
+
+#if LAYEREXSAVE_USE_SSE2
+// 4ピクセルずつ R と B を入れ替える
+static void
+PngPackLineSSE2(BufRefT p, WrtRefT w, long width)
+{
+	const __m128i ga = _mm_set1_epi32((int)0xFF00FF00);
+	long x = 0;
+	for (; x + 4 <= width; x += 4, p += 16, w += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i rb = _mm_andnot_si128(ga, v);
+		rb = _mm_shufflehi_epi16(_mm_shufflelo_epi16(rb, _MM_SHUFFLE(2,3,0,1)), _MM_SHUFFLE(2,3,0,1));
+		_mm_storeu_si128((__m128i*)w, _mm_or_si128(_mm_and_si128(v, ga), rb));
+	}
+	PngPackLineScalar(p, w, width - x);
+}
+#endif
+
+#if LAYEREXSAVE_USE_AVX2
+// 8ピクセルずつ vpshufb で並べ替える
+LAYEREXSAVE_TARGET_AVX2 static void
+PngPackLineAVX2(BufRefT p, WrtRefT w, long width)
+{
+	const __m256i ctrl = _mm256_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15,
+										  2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+	long x = 0;
+	for (; x + 8 <= width; x += 8, p += 32, w += 32) {
+		_mm256_storeu_si256((__m256i*)w, _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)p), ctrl));
+	}
+	PngPackLineSSE2(p, w, width - x);
+}
+#endif
+
+static SimdKernel<PngPackKernel> PngPackLine(PngPackLineScalar);
+
+// 実行環境に合わせた並べ替えカーネルの選択
+static void
+BindPngPackKernel(uint32_t features)
+{
+	PngPackLine = PngPackLineScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) PngPackLine = PngPackLineSSE2;
+#endif
+#if LAYEREXSAVE_USE_AVX2
+	if (features & SIMD_AVX2) PngPackLine = PngPackLineAVX2;
+#endif
+}
+static SimdBinder PngPackBinder(BindPngPackKernel);
+
 //---------------------------------------------------------------------------
 // 圧縮処理用
 
@@ -28,18 +97,20 @@ public:
 	void setCompressionLevel(int lv) {
 		level = lv;
 	}
+	int getCompressionLevel() const {
+		return level;
+	}
 	void writeChunk(CompressBase *target, const char *chunk) {
-		writeInt32(*(DWORD*)chunk, 0);
+		writeBuffer(chunk, 4, 0);
+		StageTimer timer(stats, EncodeStats::STAGE_CRC);
 		unsigned long crc = crc32(0, &data[0], size);
+		timer.stop();
 
 		target->writeBigInt32(size-4);
 		target->writeBuffer(&data[0], size);
 		target->writeBigInt32(crc);
 		init();
 	}
-	void writeUnitType(ncbPropAccessor &dic, const tjs_char *tag, const tjs_char *oneval) {
-		writeInt8(dic.getStrValue(tag) == ttstr(oneval) ? 1 : 0);
-	}
 	inline void writePixel(BufRefT p) {
 		resize(cur + 4);
 		data[cur++] = p[2];
@@ -51,12 +122,13 @@ public:
 						unsigned char const * in,
 						unsigned long         all,
 						int level = Z_DEFAULT_COMPRESSION,
-						PngChunk *self = 0)
+						PngChunk *self = 0,
+						int strategy = Z_DEFAULT_STRATEGY)
 	{
 		z_stream zs;
-		ZeroMemory(&zs, sizeof(zs));
-		if (::deflateInit(&zs, level) != Z_OK)
-			TVPThrowExceptionMessage(L"deflate initialize");
+		memset(&zs, 0, sizeof(zs));
+		if (::deflateInit2(&zs, level, Z_DEFLATED, MAX_WBITS, 8, strategy) != Z_OK)
+			throw EncodeError("deflate initialize");
 
 		int s = Z_OK, f = Z_NO_FLUSH;
 		bool canceled = false;
@@ -101,7 +173,7 @@ public:
 		}
 		return cnt < 0;
 	}
-	virtual bool compress(long width, long height, BufRefT buffer, long pitch, iTJSDispatch2 *tagsDict) {
+	virtual bool compress(long /*width*/, long /*height*/, BufRefT /*buffer*/, long /*pitch*/) {
 		return false;
 	}
 
@@ -117,14 +189,13 @@ public:
  * @param height 画像縦幅
  * @param buffer 画像バッファ
  * @param pitch 画像データのピッチ
- * @param tagsDict タグ情報
  * @return キャンセルされたら true
  */
-bool CompressPNG::compress(long width, long height, BufRefT buffer, long pitch, iTJSDispatch2 *tagsDict)
+bool CompressPNG::compress(long width, long height, BufRefT buffer, long pitch)
 {
 	PngChunk chunk(this);
 	/**/   compress_first (chunk, width, height, PNGTYPE_RGBA8888);
-	/**/   compress_second(chunk, tagsDict);
+	/**/   compress_second(chunk);
 	return compress_third (chunk, width, height, buffer, pitch);
 }
 
@@ -140,144 +211,126 @@ void CompressPNG::compress_first (PngChunk &chunk, long width, long height, long
 	chunk.writeInt8(0); // non interlace
 	chunk.writeChunk(this, "IHDR");
 }
-static const char* ChunkSetResoXY(ncbPropAccessor &dic, PngChunk &chunk, CompressPNG *self=NULL) {
-	// pHYs chunk
-	if (dic.HasValue(TJS_W("reso_x")) || dic.HasValue(TJS_W("reso_y"))) {
-		tjs_int x = dic.getIntValue(TJS_W("reso_x"));
-		tjs_int y = dic.getIntValue(TJS_W("reso_y"));
-		chunk.writeBigInt32((long)x);
-		chunk.writeBigInt32((long)y);
-		chunk.writeUnitType(dic, TJS_W("reso_unit"), TJS_W("meter"));
-		const char *tag = "pHYs";
-		if (self) chunk.writeChunk(self, tag);
-		return tag;
-	}
-	return 0;
-}
-static const char* ChunkSetOffsXY(ncbPropAccessor &dic, PngChunk &chunk, CompressPNG *self=NULL) {
-	// oFFs chunk
-	if (dic.HasValue(TJS_W("offs_x")) || dic.HasValue(TJS_W("offs_y"))) {
-		tjs_int x = dic.getIntValue(TJS_W("offs_x"));
-		tjs_int y = dic.getIntValue(TJS_W("offs_y"));
-		chunk.writeBigInt32((long)x);
-		chunk.writeBigInt32((long)y);
-		chunk.writeUnitType(dic, TJS_W("offs_unit"), TJS_W("micrometer"));
-		const char *tag = "oFFs";
-		if (self) chunk.writeChunk(self, tag);
-		return tag;
-	}
-	return 0;
-}
-static const char* ChunkSetVpagWH(ncbPropAccessor &dic, PngChunk &chunk, CompressPNG *self=NULL) {
-	// vpAg chunk
-	if (dic.HasValue(TJS_W("vpag_w")) || dic.HasValue(TJS_W("vpag_h"))) {
-		tjs_int w = dic.getIntValue(TJS_W("vpag_w"));
-		tjs_int h = dic.getIntValue(TJS_W("vpag_h"));
-		chunk.writeBigInt32((long)w);
-		chunk.writeBigInt32((long)h);
-		chunk.writeUnitType(dic, TJS_W("vpag_unit"), TJS_W("micrometer"));
-		const char *tag = "vpAg";
-		if (self) chunk.writeChunk(self, tag);
-		return tag;
-	}
-	return 0;
+/**
+ * 追加チャンク（pHYs/oFFs/vpAg）の書き出し
+ * @param pair チャンクの値
+ * @param tag チャンク名
+ * @param self 書き出し先（NULL ならチャンクのデータを作るだけ）
+ * @return 作成したチャンク名（値が指定されていなければ NULL）
+ */
+static const char* ChunkSetPair(PngOptions::Pair const &pair, const char *tag, PngChunk &chunk, CompressPNG *self=NULL) {
+	if (!pair.defined) return 0;
+	chunk.writeBigInt32(pair.x);
+	chunk.writeBigInt32(pair.y);
+	chunk.writeInt8(pair.unit ? 1 : 0);
+	if (self) chunk.writeChunk(self, tag);
+	return tag;
 }
-void CompressPNG::compress_second(PngChunk &chunk, iTJSDispatch2 *tagsDict)
+void CompressPNG::compress_second(PngChunk &chunk)
 {
 	// additional chunks
-	if (tagsDict == NULL) return;
-	ncbPropAccessor dic(tagsDict);
-
-	ChunkSetResoXY(dic, chunk, this);
-	ChunkSetOffsXY(dic, chunk, this);
-	ChunkSetVpagWH(dic, chunk, this);
+	ChunkSetPair(options.reso, "pHYs", chunk, this);
+	ChunkSetPair(options.offs, "oFFs", chunk, this);
+	ChunkSetPair(options.vpag, "vpAg", chunk, this);
 
 	// compression level
-	chunk.setCompressionLevel((int)dic.getIntValue(TJS_W("comp_lv"), Z_DEFAULT_COMPRESSION));
+	chunk.setCompressionLevel(options.level < 0 ? Z_DEFAULT_COMPRESSION : options.level);
+}
+/**
+ * 保存処理に必要なメモリ量の見積もり
+ * 1ラインずつ圧縮するので縦幅にはよらない
+ * @param width 画像横幅
+ */
+size_t CompressPNG::estimateMemory(long width, long /*height*/)
+{
+	return (size_t)width * 4 + 1 // ライン
+		+ IDAT_SIZE * 2           // deflate 出力/チャンク
+		+ (1 << 17) * 2           // zlib 作業領域(windowBits=15,memLevel=8)
+		+ estimateOutputMemory();
 }
+
 bool CompressPNG::compress_third (PngChunk &chunk, long width, long height, BufRefT buffer, long pitch)
 {
 	// IDAT chunk
-	for(long y = 0; y < height; y++) {
-		BufRefT p = buffer + pitch * y;
-		chunk.writeInt8(0);
-		for(long x = 0; x < width; x++, p+=4)
-			chunk.writePixel(p);
-	}
-	bool r = chunk.deflate();
-	if (!r) {
-		chunk.writeChunk(this, "IDAT");
-		chunk.writeChunk(this, "IEND");
+	// 1ラインずつ deflate し，出力がたまるごとに IDAT チャンクとして書き出しステージに渡す
+	int level = chunk.getCompressionLevel();
+	if (lowEffort && (level < 0 || level > Z_BEST_SPEED)) level = Z_BEST_SPEED;
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (::deflateInit2(&zs, level, Z_DEFLATED, MAX_WBITS, 8, options.strategy) != Z_OK)
+		throw EncodeError("deflate initialize");
+
+	DATA line(1 + width * 4), out(IDAT_SIZE);
+	if (stats) stats->allocations += 3; // line/out/zlib
+	zs.next_out  = (Bytef*)&out[0];
+	zs.avail_out = IDAT_SIZE;
+
+	bool canceled = false;
+	int s = Z_OK;
+	long segment = 0;
+	TraceSpan span("deflate", segment); // IDAT チャンク1つ分ごとに記録する
+	for (long y = 0; y < height && s != Z_STREAM_END; y++) {
+		if (doProgress(y * 100 / height)) {
+			canceled = true;
+			break;
+		}
+		line[0] = 0; // filter type
+		{
+			StageTimer timer(stats, EncodeStats::STAGE_FILTER);
+			PngPackLine(buffer + pitch * y, &line[1], width);
+		}
+		zs.next_in  = (Bytef*)&line[0];
+		zs.avail_in = (uInt)line.size();
+		int f = (y == height - 1) ? Z_FINISH : Z_NO_FLUSH;
+		do {
+			{
+				StageTimer timer(stats, EncodeStats::STAGE_DEFLATE);
+				s = ::deflate(&zs, f);
+			}
+			if (s != Z_OK && s != Z_STREAM_END && s != Z_BUF_ERROR) break;
+			if (!zs.avail_out || s == Z_STREAM_END) {
+				span.end();
+				chunk.writeBuffer(&out[0], IDAT_SIZE - zs.avail_out);
+				chunk.writeChunk(this, "IDAT");
+				flush();
+				span.begin("deflate", ++segment);
+				zs.next_out  = (Bytef*)&out[0];
+				zs.avail_out = IDAT_SIZE;
+			}
+		} while (s != Z_STREAM_END && (zs.avail_in || (f == Z_FINISH)));
+		if (s != Z_OK && s != Z_STREAM_END && s != Z_BUF_ERROR) break;
 	}
-	return r;
+	::deflateEnd(&zs);
+	span.end();
+	if (canceled) return true;
+	if (s != Z_STREAM_END)
+		throw EncodeError("deflate failed");
+
+	doProgress(100);
+	chunk.writeChunk(this, "IEND");
+	return false;
 }
 
-static void b64e(tjs_char *p, unsigned char const *r, long len) {
-	tjs_char *b64 = TJS_W("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=");
-	long i, stop = len - 3;
-	for (i = 0; i <= stop; i+=3) {
-		*p++ = b64[ (r[i  ] >> 2) & 0x3F ];
-		*p++ = b64[((r[i  ] << 4) & 0x30) | ((r[i+1] >> 4) & 0x0F)];
-		*p++ = b64[((r[i+1] << 2) & 0x3C) | ((r[i+2] >> 6) & 0x03)];
-		*p++ = b64[ (r[i+2]     ) & 0x3F ];
-	}
-	switch (len - i) {
-	case 2:
-		*p++ = b64[ (r[i  ] >> 2) & 0x3F ];
-		*p++ = b64[((r[i  ] << 4) & 0x30) | ((r[i+1] >> 4) & 0x0F)];
-		*p++ = b64[ (r[i+1] << 2) & 0x3C ];
-		*p++ = b64[64];
-		*p++ = 0;
-		break;
-	case 1:
-		*p++ = b64[ (r[i  ] >> 2) & 0x3F ];
-		*p++ = b64[ (r[i  ] << 4) & 0x30 ];
-		*p++ = b64[64];
-		*p++ = b64[64];
-		*p++ = 0;
-		break;
-	case 0:
-		*p++ = 0;
-	}
-}
 
 //---------------------------------------------------------------------------
-// ダイレクト保存処理
+// 一括圧縮処理
 //---------------------------------------------------------------------------
 #if defined(LAYEREXSAVE_DISABLE_LODEPNG) && (LAYEREXSAVE_DISABLE_LODEPNG != 0)
 
 #pragma message( ": LodePNG *not* used." )
 
-void CompressPNG::encodeToFile(iTJSDispatch2 *layer, const tjs_char *filename, tTJSVariant *info)
+bool EncodePNG(ImageRef const &image, ByteSink &sink, PngOptions const &opt, ProgressFunc *progress, void *progressData, EncodeStats *stats)
 {
-	save(layer, filename, info ? info->AsObjectNoAddRef() : NULL);
+	// optimize 指定でも逐次圧縮で保存する（旧版と同じ仕様です）
+	CompressPNG work(progress, progressData);
+	work.setStats(stats);
+	work.setLowEffort(opt.lowEffort);
+	work.setOptions(opt);
+	return work.encode(image, sink);
 }
 
-void CompressPNG::encodeToOctet(iTJSDispatch2 *layer, tTJSVariant *vclv, tTJSVariant &ret)
-{
-	BufRefT buffer;
-	long width, height, pitch;
-
-	ret = TJS_W("");
-	if (GetLayerBufferAndSize(layer, width, height, buffer, pitch)) {
-		PngChunk chunk(this);
-
-		compress_first (chunk, width, height, PNGTYPE_RGBA8888);
-		if (vclv && vclv->Type() == tvtObject) {
-			compress_second(chunk, vclv->AsObjectNoAddRef());
-		} else {
-			int comp_lv = vclv ? (int)vclv->AsInteger() : 1;
-			chunk.setCompressionLevel(comp_lv);
-		}
-		compress_third (chunk, width, height, buffer, pitch);
-
-		tTJSVariantOctet *oct = TJSAllocVariantOctet(&data[0], size);
-		ret = oct;
-		oct->Release();
-	}
-}
-
-bool CompressPNG::encodeProvinceImage(iTJSDispatch2 *layer, const tjs_char *filename)
+bool EncodeProvincePNG(ImageRef const &province, ByteSink &sink, EncodeStats *stats)
 {
 	// Not Implemented
 	return false;
@@ -289,41 +342,33 @@ bool CompressPNG::encodeProvinceImage(iTJSDispatch2 *layer, const tjs_char *file
 
 #include "LodePNG/lodepng.h"
 
-static bool MakeVectorImage(iTJSDispatch2 *layer, std::vector<unsigned char> &image, long &width, long &height, bool &alpha)
-{
-	BufRefT buffer;
-	long pitch;
-	if (!GetLayerBufferAndSize(layer, width, height, buffer, pitch)) return false;
+typedef std::vector<unsigned char> DATA;
 
+static void MakeVectorImage(ImageRef const &src, DATA &image, bool &alpha)
+{
+	BufRefT buffer = src.buffer;
 	alpha = false;
-	size_t len = width * 4;
-	image.resize(len * height);
-	for(long y=0, ofs=0; y < height; y++, ofs+=len, buffer+=pitch) {
+	size_t len = src.width * 4;
+	image.resize(len * src.height);
+	for(long y=0, ofs=0; y < src.height; y++, ofs+=len, buffer+=src.pitch) {
 		BufRefT p = buffer;
 		WrtRefT w = &image[ofs];
-		for(long x = 0; x < width; x++, p+=4) {
+		for(long x = 0; x < src.width; x++, p+=4) {
 			*w++ = p[2];
 			*w++ = p[1];
 			*w++ = p[0];
 			if ((*w++ = p[3]) != 255) alpha = true;
 		}
 	}
-	return true;
 }
-static bool MakeVectorProvinceImage(iTJSDispatch2 *layer, std::vector<unsigned char> &image, long &width, long &height)
+static void MakeVectorProvinceImage(ImageRef const &src, DATA &image)
 {
-	BufRefT buffer;
-	long pitch;
-	if (!GetProvinceBufferAndSize(layer, width, height, buffer, pitch)) return false;
-
-	size_t len = width;
-	image.resize(len * height);
-	for(long y=0, ofs=0; y < height; y++, ofs+=len, buffer+=pitch) {
-		BufRefT p = buffer;
-		WrtRefT w = &image[ofs];
-		for(long x = 0; x < width; x++) *w++ = *p++;
+	BufRefT buffer = src.buffer;
+	size_t len = src.width;
+	image.resize(len * src.height);
+	for(long y=0, ofs=0; y < src.height; y++, ofs+=len, buffer+=src.pitch) {
+		memcpy(&image[ofs], buffer, len);
 	}
-	return true;
 }
 static void MakeDefaultPalette(WrtRefT table) {
 	WrtRefT w = table;
@@ -342,10 +387,12 @@ static unsigned CustomDeflate(unsigned char** out, size_t* outsize,
 							  const unsigned char* in, size_t insize,
 							  const LodePNGCompressSettings* settings)
 {
-	int comp_lv = settings ? (int)(tjs_intptr_t)settings->custom_context : 1; //Z_DEFAULT_COMPRESSION;
+	const PngOptions *opt = settings ? (const PngOptions*)settings->custom_context : NULL;
+	int comp_lv  = opt ? opt->level    : 1; //Z_DEFAULT_COMPRESSION;
+	int strategy = opt ? opt->strategy : Z_DEFAULT_STRATEGY;
 
-	std::vector<BYTE> data;
-	long size = PngChunk::Deflate(data, in, insize, comp_lv);
+	DATA data;
+	long size = PngChunk::Deflate(data, in, insize, comp_lv, NULL, strategy);
 	if (size > 0) {
 		*out = (unsigned char*)malloc((size_t)size);
 		if (*out) {
@@ -382,188 +429,125 @@ static bool SetCustomChunk(lodepng::State &state, PngChunk &chunk, const char *t
 	return r;
 }
 
-static bool EncodeLodePNGCommon(std::vector<unsigned char> &image,
-								std::vector<unsigned char> &png,
+static bool EncodeLodePNGCommon(DATA &image,
+								DATA &png,
 								long width, long height, bool alpha,
-								tTJSVariant *info)
+								PngOptions const &opt)
 {
 	lodepng::State state;
 	SetInitialState(state, alpha);
 
-	if (info) {
-		int comp_lv = -1;
-		if (info->Type() == tvtObject) {
-			PngChunk chunk;
-			ncbPropAccessor dic(info->AsObjectNoAddRef());
+	PngChunk chunk;
+	SetCustomChunk(state, chunk, ChunkSetPair(opt.reso, "pHYs", chunk));
+	SetCustomChunk(state, chunk, ChunkSetPair(opt.offs, "oFFs", chunk));
+	SetCustomChunk(state, chunk, ChunkSetPair(opt.vpag, "vpAg", chunk));
 
-			SetCustomChunk(state, chunk, ChunkSetResoXY(dic, chunk));
-			SetCustomChunk(state, chunk, ChunkSetOffsXY(dic, chunk));
-			SetCustomChunk(state, chunk, ChunkSetVpagWH(dic, chunk));
-
-			// compression level
-			if (dic.HasValue(TJS_W("comp_lv"))) {
-				comp_lv = (int)dic.getIntValue(TJS_W("comp_lv"), Z_DEFAULT_COMPRESSION);
-			}
-		} else {
-			comp_lv = (int)info->AsInteger();
-		}
-		if (comp_lv >= 0) {
-			state.encoder.zlibsettings.custom_zlib = &CustomDeflate;
-			state.encoder.zlibsettings.custom_context = (void*)(tjs_intptr_t)comp_lv;
-			if (!comp_lv) state.encoder.filter_strategy = LFS_ZERO;
-		}
+	// compression level（指定がなければ LodePNG 組み込みの deflate）
+	if (opt.level >= 0) {
+		state.encoder.zlibsettings.custom_zlib = &CustomDeflate;
+		state.encoder.zlibsettings.custom_context = &opt;
+		if (!opt.level) state.encoder.filter_strategy = LFS_ZERO;
 	}
 	return (lodepng::encode(png, image, width, height, state) == 0);
 }
 
-void CompressPNG::encodeToFile(iTJSDispatch2 *layer, const tjs_char *filename, tTJSVariant *info)
+/**
+ * 一括圧縮したデータを出力先に渡す
+ */
+static void PushEncoded(DATA &png, ByteSink &sink, EncodeStats *stats)
 {
-	long width, height;
-	bool alpha;
-
-	if (MakeVectorImage(layer, data, width, height, alpha)) {
-		DATA png;
-		if (EncodeLodePNGCommon(data, png, width, height, alpha, info)) {
-			IStream *out = TVPCreateIStream(filename, TJS_BS_WRITE);
-			if (!out) {
-				TVPThrowExceptionMessage(L"%1:can't open", filename);
-			}
-			try {
-				ULONG s;
-				out->Write(&png[0], png.size(), &s);
-			} catch (...) {
-				out->Release();
-				throw;
-			}
-			out->Release();
-		}
+	StageTimer timer(stats, EncodeStats::STAGE_WRITE);
+	TraceSpan span("write", (long long)png.size());
+	const size_t size = png.size();
+	try {
+		sink.push(png);
+		sink.finish();
+	} catch (...) {
+		sink.abort();
+		throw;
 	}
+	if (stats) stats->bytesOut += size;
 }
 
-void CompressPNG::encodeToOctet(iTJSDispatch2 *layer, tTJSVariant *vclv, tTJSVariant &ret)
+bool EncodePNG(ImageRef const &image, ByteSink &sink, PngOptions const &opt, ProgressFunc *progress, void *progressData, EncodeStats *stats)
 {
-	long width, height;
-	bool alpha;
+	if (!opt.optimize) {
+		CompressPNG work(progress, progressData);
+		work.setStats(stats);
+		work.setLowEffort(opt.lowEffort);
+		work.setOptions(opt);
+		return work.encode(image, sink);
+	}
 
-	ret = TJS_W("");
-	if (MakeVectorImage(layer, data, width, height, alpha)) {
-		DATA png;
-		if (EncodeLodePNGCommon(data, png, width, height, alpha, vclv)) {
-			tTJSVariantOctet *oct = TJSAllocVariantOctet(&png[0], png.size());
-			ret = oct;
-			oct->Release();
-		}
+	StageTimer total(stats, EncodeStats::STAGE_TOTAL);
+	DATA rgba, png;
+	bool alpha;
+	{
+		StageTimer timer(stats, EncodeStats::STAGE_FILTER);
+		TraceSpan span("filter");
+		MakeVectorImage(image, rgba, alpha);
+	}
+	bool encoded;
+	{
+		StageTimer timer(stats, EncodeStats::STAGE_DEFLATE);
+		TraceSpan span("deflate");
+		encoded = EncodeLodePNGCommon(rgba, png, image.width, image.height, alpha, opt);
+	}
+	if (!encoded) {
+		sink.abort();
+		throw EncodeError("png encode failed");
 	}
-	// [XXX] reset data
-	data.resize(dataSize);
-	cur = size = 0;
+	if (stats) {
+		stats->bytesIn     += (unsigned long long)image.width * image.height * 4;
+		stats->allocations += 2; // rgba/png
+	}
+	PushEncoded(png, sink, stats);
+	return false;
 }
 
-bool CompressPNG::encodeProvinceImage(iTJSDispatch2 *layer, const tjs_char *filename)
+bool EncodeProvincePNG(ImageRef const &province, ByteSink &sink, EncodeStats *stats)
 {
-	long width, height;
-	if (MakeVectorProvinceImage(layer, data, width, height)) {
-		lodepng::State state;
-		state.info_png.color.colortype   = state.info_raw.colortype   = LCT_PALETTE;
-		state.info_png.color.bitdepth    = state.info_raw.bitdepth    = 8;
-		state.info_png.color.key_defined = state.info_raw.key_defined = 0;
-		{
-			DATA palette;
-			palette.resize(256 * 4);
-			MakeDefaultPalette(&palette[0]);
-			for (int idx = 0; idx < 256; idx++) {
-				unsigned char r = palette[idx*4 + 0],
-				/**/          g = palette[idx*4 + 1],
-				/**/          b = palette[idx*4 + 2],
-				/**/          a = palette[idx*4 + 3];
-				lodepng_palette_add(&state.info_png.color, r, g, b, a);
-				lodepng_palette_add(&state.info_raw,       r, g, b, a);
-			}
-		}
-		DATA png;
-		if (lodepng::encode(png, data, width, height, state) == 0) {
-			IStream *out = TVPCreateIStream(filename, TJS_BS_WRITE);
-			if (!out) {
-				ttstr msg = filename;
-				msg += L":can't open";
-				TVPThrowExceptionMessage(msg.c_str());
-			}
-			try {
-				ULONG s;
-				out->Write(&png[0], png.size(), &s);
-			} catch (...) {
-				out->Release();
-				throw;
-			}
-			out->Release();
+	StageTimer total(stats, EncodeStats::STAGE_TOTAL);
+	DATA image;
+	{
+		StageTimer timer(stats, EncodeStats::STAGE_FILTER);
+		TraceSpan span("filter");
+		MakeVectorProvinceImage(province, image);
+	}
+
+	lodepng::State state;
+	state.info_png.color.colortype   = state.info_raw.colortype   = LCT_PALETTE;
+	state.info_png.color.bitdepth    = state.info_raw.bitdepth    = 8;
+	state.info_png.color.key_defined = state.info_raw.key_defined = 0;
+	{
+		DATA palette;
+		palette.resize(256 * 4);
+		MakeDefaultPalette(&palette[0]);
+		for (int idx = 0; idx < 256; idx++) {
+			unsigned char r = palette[idx*4 + 0],
+			/**/          g = palette[idx*4 + 1],
+			/**/          b = palette[idx*4 + 2],
+			/**/          a = palette[idx*4 + 3];
+			lodepng_palette_add(&state.info_png.color, r, g, b, a);
+			lodepng_palette_add(&state.info_raw,       r, g, b, a);
 		}
-	} else {
-		TVPThrowExceptionMessage(TJS_W("no province image"));
 	}
+	DATA png;
+	unsigned error;
+	{
+		StageTimer timer(stats, EncodeStats::STAGE_DEFLATE);
+		TraceSpan span("deflate");
+		error = lodepng::encode(png, image, province.width, province.height, state);
+	}
+	if (error != 0) {
+		sink.abort();
+		throw EncodeError("png encode failed");
+	}
+	if (stats) {
+		stats->bytesIn     += (unsigned long long)province.width * province.height;
+		stats->allocations += 2; // image/png
+	}
+	PushEncoded(png, sink, stats);
 	return true;
 }
 #endif
-
-
-//---------------------------------------------------------------------------
-// レイヤ拡張
-//---------------------------------------------------------------------------
-
-/**
- * PNG 形式での画像の保存。注意点:データの保存が終わるまで処理が帰りません。
- * @param filename ファイル名
- * @param tags タグ情報
- */
-static tjs_error TJS_INTF_METHOD saveLayerImagePngFunc(tTJSVariant *result,
-														tjs_int numparams,
-														tTJSVariant **param,
-														iTJSDispatch2 *objthis) {
-	if (numparams < 1) return TJS_E_BADPARAMCOUNT;
-	CompressPNG png;
-	png.encodeToFile(
-		objthis, // layer
-		param[0]->GetString(),  // filename
-		numparams > 1 ? param[1] : NULL // info
-		);
-	return TJS_S_OK;
-}
-
-NCB_ATTACH_FUNCTION(saveLayerImagePng,       Layer, saveLayerImagePngFunc);
-
-/**
- * PNG 形式画像をoctetで返す。注意点:データの保存が終わるまで処理が帰りません。
- * @param compression_level 圧縮率
- */
-static tjs_error TJS_INTF_METHOD saveLayerImagePngOctet(tTJSVariant *result,
-														tjs_int numparams,
-														tTJSVariant **param,
-														iTJSDispatch2 *objthis)
-{
-	if (result) {
-		CompressPNG png;
-		png.encodeToOctet(objthis, (numparams >= 1) ? param[0] : NULL, *result);
-	}
-	return TJS_S_OK;
-}
-NCB_ATTACH_FUNCTION(saveLayerImagePngOctet, Layer, saveLayerImagePngOctet);
-
-/**
- * Province画像を保存(フォーマット：256パレット式PNG固定)
- * @param filename ファイル名
- * @param palette パレット情報（※将来的予約／現在未実装）
- */
-static tjs_error TJS_INTF_METHOD saveProvinceImageFunc(tTJSVariant *result,
-													   tjs_int numparams,
-													   tTJSVariant **param,
-													   iTJSDispatch2 *objthis)
-{
-	if (numparams < 1) return TJS_E_BADPARAMCOUNT;
-	CompressPNG png;
-	if (!png.encodeProvinceImage(
-		objthis, // layer
-		param[0]->GetString()  // filename
-		)) return TJS_E_NOTIMPL;
-	return TJS_S_OK;
-}
-NCB_ATTACH_FUNCTION(saveProvinceImage, Layer, saveProvinceImageFunc);
-
@@ -5,24 +5,27 @@
 
 class PngChunk;
 class CompressPNG : public CompressBase {
+	enum { IDAT_SIZE = 1024*64 }; //< IDAT チャンク1つあたりの最大サイズ
+
 public:
 	CompressPNG()                               : CompressBase()           {}
 	CompressPNG(ProgressFunc *prog, void *data) : CompressBase(prog, data) {}
 	virtual ~CompressPNG() {}
 
-	virtual bool compress(long width, long height, BufRefT buffer, long pitch, iTJSDispatch2 *tagsDict);
+	virtual bool compress(long width, long height, BufRefT buffer, long pitch);
 
-	// for Layer.saveLayerImage{Png,PngOctet}
-	void encodeToFile (iTJSDispatch2 *layer, const tjs_char *filename, tTJSVariant *info);
-	void encodeToOctet(iTJSDispatch2 *layer, tTJSVariant *comp_lv, tTJSVariant&);
+	// 追加チャンクと圧縮レベルの設定
+	void setOptions(PngOptions const &opt) { options = opt; }
 
-	// for Layer.saveProvinceImage
-	bool encodeProvinceImage(iTJSDispatch2 *layer, const tjs_char *filename);
+	// 保存処理に必要なメモリ量の見積もり
+	static size_t estimateMemory(long width, long height);
 
 protected:
 	void compress_first (PngChunk&, long width, long height, long flag);
-	void compress_second(PngChunk&, iTJSDispatch2 *tagsDict);
+	void compress_second(PngChunk&);
 	bool compress_third (PngChunk&, long width, long height, BufRefT buffer, long pitch);
+
+	PngOptions options;
 };
 
 #endif
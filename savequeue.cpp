@@ -0,0 +1,170 @@
+#include "ncbind.hpp"
+#include "savequeue.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+
+//---------------------------------------------------------------------------
+// 非同期保存スケジューラ
+
+#define INITIAL_USEC_PER_PIXEL (0.1)
+
+// 32bit ビルドではアドレス空間に余裕がないので控えめにする
+#define DEFAULT_MEMORY_BUDGET (sizeof(void*) > 4 ? (size_t)1024*1024*1024 : (size_t)256*1024*1024)
+
+SaveQueue &
+SaveQueue::instance()
+{
+	static SaveQueue queue;
+	return queue;
+}
+
+SaveQueue::SaveQueue()
+	: seq(0), closing(false), budget(DEFAULT_MEMORY_BUDGET), used(0), active(0), running(0), usecPerPixel(INITIAL_USEC_PER_PIXEL)
+{
+}
+
+SaveQueue::~SaveQueue()
+{
+	shutdown();
+}
+
+/**
+ * ヒープ用比較（a が b より後回しなら true）
+ */
+bool
+SaveQueue::higher(SaveJob const *a, SaveJob const *b)
+{
+	if (a->priority    != b->priority)    return a->priority < b->priority;
+	if (a->hasDeadline != b->hasDeadline) return !a->hasDeadline;
+	if (a->hasDeadline && a->deadline != b->deadline) return a->deadline > b->deadline;
+	return a->seq > b->seq;
+}
+
+void
+SaveQueue::push(SaveJob *job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closing = false;
+		if (workers.empty()) {
+			unsigned int count = std::thread::hardware_concurrency();
+			count = count > 1 ? count - 1 : 1; // メインスレッド分を残す
+			for (unsigned int i = 0; i < count; i++) {
+				workers.push_back(std::thread(&SaveQueue::worker, this));
+			}
+		}
+		job->seq = seq++;
+		used += job->reserved;
+		jobs.push_back(job);
+		std::push_heap(jobs.begin(), jobs.end(), higher);
+	}
+	wakeup.notify_one();
+}
+
+void
+SaveQueue::shutdown()
+{
+	std::vector<SaveJob*> rest;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closing = true;
+		rest.swap(jobs);
+		for (size_t i = 0; i < rest.size(); i++) {
+			used -= rest[i]->reserved;
+		}
+	}
+	wakeup.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	workers.clear();
+	for (size_t i = 0; i < rest.size(); i++) {
+		rest[i]->discard();
+	}
+}
+
+void
+SaveQueue::setMemoryBudget(size_t size)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		budget = size;
+	}
+	wakeup.notify_all();
+}
+
+size_t
+SaveQueue::getMemoryBudget()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return budget;
+}
+
+size_t
+SaveQueue::getMemoryUsage()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return used;
+}
+
+/**
+ * 先頭のジョブを開始してよいか
+ * 待機中のジョブの複製レイヤは投入時に確保済みなので，処理中の作業領域だけを予算と比べる
+ */
+bool
+SaveQueue::admissible() const
+{
+	if (jobs.empty()) return false;
+	return !running || active + jobs.front()->working <= budget;
+}
+
+/**
+ * 期限に間に合わない見込みか
+ */
+bool
+SaveQueue::atRisk(SaveJob const *job) const
+{
+	if (!job->hasDeadline) return false;
+	std::chrono::microseconds estimate((long long)(job->pixels * usecPerPixel));
+	return SaveJob::Clock::now() + estimate > job->deadline;
+}
+
+/**
+ * ワーカスレッド本体
+ */
+void
+SaveQueue::worker()
+{
+	TraceThreadName("save");
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		wakeup.wait(lock, [this]{ return admissible() || closing; });
+		if (closing) break;
+
+		std::pop_heap(jobs.begin(), jobs.end(), higher);
+		SaveJob *job = jobs.back();
+		jobs.pop_back();
+		bool lowEffort = atRisk(job);
+		double pixels = job->pixels;
+		size_t reserved = job->reserved, working = job->working;
+		used   += working;
+		active += working;
+		running++;
+		lock.unlock();
+
+		SaveJob::Clock::time_point start = SaveJob::Clock::now();
+		bool done = job->run(lowEffort); // job はここで破棄されている可能性がある
+		double elapsed = (double)std::chrono::duration_cast<std::chrono::microseconds>(SaveJob::Clock::now() - start).count();
+
+		lock.lock();
+		used   -= reserved + working;
+		active -= working;
+		running--;
+		wakeup.notify_all();
+		// 通常圧縮の実績で見積もりを更新
+		if (done && !lowEffort && pixels > 0) {
+			usecPerPixel = usecPerPixel * 0.75 + (elapsed / pixels) * 0.25;
+		}
+	}
+}
@@ -0,0 +1,116 @@
+#ifndef _layerexsave_savequeue_hpp_
+#define _layerexsave_savequeue_hpp_
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/**
+ * 非同期保存ジョブ
+ */
+class SaveJob {
+	friend class SaveQueue;
+
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/**
+	 * コンストラクタ
+	 * @param priority 優先度（大きいほど先に処理される）
+	 * @param deadline 期限(ms)（0以下なら期限なし）
+	 * @param pixels 画像のピクセル数（処理時間の見積もり用）
+	 * @param reserved 投入時点から保持しているメモリ量（複製レイヤなど）
+	 * @param working 処理中に必要となるメモリ量の見積もり
+	 */
+	SaveJob(int priority, int32_t deadline, double pixels, size_t reserved, size_t working)
+		: priority(priority), hasDeadline(deadline > 0), pixels(pixels), reserved(reserved), working(working), seq(0)
+	{
+		if (hasDeadline) this->deadline = Clock::now() + std::chrono::milliseconds(deadline);
+	}
+
+	virtual ~SaveJob() {}
+
+	/**
+	 * 処理実行（ワーカスレッドから呼ばれる）
+	 * @param lowEffort 期限に間に合わせるため圧縮率を落とす
+	 * @return 保存が完了したら true（キャンセル時は false）
+	 */
+	virtual bool run(bool lowEffort) = 0;
+
+	/**
+	 * 未実行のままキューから外されたときの処理
+	 */
+	virtual void discard() { delete this; }
+
+protected:
+	int priority;
+	bool hasDeadline;
+	Clock::time_point deadline;
+	double pixels;
+	size_t reserved;
+	size_t working;
+	unsigned long seq; //< 同一優先度内の投入順
+};
+
+/**
+ * 非同期保存スケジューラ
+ * 優先度・期限順にワーカスレッドにジョブを割り振る
+ */
+class SaveQueue {
+public:
+	/**
+	 * プラグイン共通のインスタンス
+	 */
+	static SaveQueue &instance();
+
+	/**
+	 * ジョブの投入（待たずに戻る）
+	 * @param job ジョブ（処理完了後の破棄はジョブ側で行う）
+	 */
+	void push(SaveJob *job);
+
+	/**
+	 * 全ワーカの終了（未実行ジョブは破棄される）
+	 */
+	void shutdown();
+
+	/**
+	 * メモリ予算の設定
+	 * 処理中のジョブの作業領域の見積もりの合計が予算を超える間は新しいジョブの処理開始を待たせる
+	 * （処理中のジョブがない場合は予算を超えても1件ずつ処理する）
+	 * @param budget 予算(byte)
+	 */
+	void setMemoryBudget(size_t budget);
+	size_t getMemoryBudget();
+
+	/**
+	 * 現在のメモリ使用量（待機中ジョブの保持分＋処理中ジョブの見積もり）
+	 */
+	size_t getMemoryUsage();
+
+protected:
+	SaveQueue();
+	~SaveQueue();
+
+	static bool higher(SaveJob const *a, SaveJob const *b);
+	void worker();
+	bool atRisk(SaveJob const *job) const;
+	bool admissible() const;
+
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::vector<std::thread> workers;
+	std::vector<SaveJob*> jobs; //< 優先度順ヒープ
+	unsigned long seq;
+	bool closing;
+	size_t budget;  //< メモリ予算
+	size_t used;    //< メモリ使用量
+	size_t active;  //< 処理中ジョブの作業領域の見積もり（予算と比べる）
+	int running;    //< 処理中ジョブ数
+	double usecPerPixel; //< 処理時間の見積もり(μs/pixel)
+};
+
+#endif
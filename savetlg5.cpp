@@ -1,8 +1,94 @@
-#include "ncbind.hpp"
 #include "savetlg5.hpp"
+#include "simd.hpp"
 
 #include <tlg5/slide.h>
 #define BLOCK_HEIGHT 4
+#define LOW_EFFORT_CHAIN 16 // 高速モード時に辿るチェインの上限
+
+//---------------------------------------------------------------------------
+// フィルタ処理用
+
+/**
+ * 1ライン分のフィルタ（上のラインとの差分→左のピクセルとの差分→G との色差）
+ * 結果を色ごとの出力先に書き出す（ARGB 4色固定）
+ * @param current 対象ライン
+ * @param upper 上のライン（先頭行は NULL）
+ * @param width ピクセル数
+ * @param out 色ごとの出力先
+ */
+typedef void (*TLG5FilterKernel)(const unsigned char *current, const unsigned char *upper, long width, unsigned char **out);
+
+// x から行末までを1ピクセルずつ処理する
+static inline void
+TLG5FilterPixels(const unsigned char *current, const unsigned char *upper, long x, long width, int *prevcl, unsigned char **out)
+{
+	int val[4];
+	for (; x < width; x++) {
+		for (int c = 0; c < 4; c++) {
+			int cl = upper ? current[x*4+c] - upper[x*4+c] : current[x*4+c];
+			val[c] = cl - prevcl[c];
+			prevcl[c] = cl;
+		}
+		out[0][x] = val[0] - val[1];
+		out[1][x] = val[1];
+		out[2][x] = val[2] - val[1];
+		out[3][x] = val[3];
+	}
+}
+
+static void
+TLG5FilterScalar(const unsigned char *current, const unsigned char *upper, long width, unsigned char **out)
+{
+	int prevcl[4] = { 0, 0, 0, 0 };
+	TLG5FilterPixels(current, upper, 0, width, prevcl, out);
+}
+
+#if LAYEREXSAVE_USE_AVX2
+// 4ピクセルずつ処理して pshufb で色ごとに並べ替える（差分は 8bit で折り返すのでスカラ版と同じ値になる）
+LAYEREXSAVE_TARGET_SSSE3 static void
+TLG5FilterSSSE3(const unsigned char *current, const unsigned char *upper, long width, unsigned char **out)
+{
+	const __m128i green  = _mm_setr_epi8(1,-1,1,-1, 5,-1,5,-1, 9,-1,9,-1, 13,-1,13,-1); // B,R の位置に G
+	const __m128i planar = _mm_setr_epi8(0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15);
+	__m128i prev = _mm_setzero_si128(); // 前の4ピクセル分の上下差分
+	long x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i cl = _mm_loadu_si128((const __m128i*)(current + x*4));
+		if (upper) cl = _mm_sub_epi8(cl, _mm_loadu_si128((const __m128i*)(upper + x*4)));
+		__m128i val = _mm_sub_epi8(cl, _mm_or_si128(_mm_slli_si128(cl, 4), _mm_srli_si128(prev, 12)));
+		prev = cl;
+		val = _mm_shuffle_epi8(_mm_sub_epi8(val, _mm_shuffle_epi8(val, green)), planar);
+		// 出力先は境界が揃っていない byte 列なので memcpy で書き込む
+		int plane[4];
+		plane[0] = _mm_cvtsi128_si32(val);
+		plane[1] = _mm_cvtsi128_si32(_mm_srli_si128(val, 4));
+		plane[2] = _mm_cvtsi128_si32(_mm_srli_si128(val, 8));
+		plane[3] = _mm_cvtsi128_si32(_mm_srli_si128(val, 12));
+		for (int c = 0; c < 4; c++) memcpy(out[c] + x, &plane[c], 4);
+	}
+	int prevcl[4] = { 0, 0, 0, 0 };
+	if (x > 0) {
+		unsigned char last[16];
+		_mm_storeu_si128((__m128i*)last, prev);
+		for (int c = 0; c < 4; c++) prevcl[c] = (signed char)last[12 + c];
+	}
+	TLG5FilterPixels(current, upper, x, width, prevcl, out);
+}
+#endif
+
+static SimdKernel<TLG5FilterKernel> TLG5Filter(TLG5FilterScalar);
+
+// 実行環境に合わせたフィルタの選択
+static void
+BindTLG5FilterKernel(uint32_t features)
+{
+	TLG5Filter = TLG5FilterScalar;
+#if LAYEREXSAVE_USE_AVX2
+	if (features & SIMD_SSSE3) TLG5Filter = TLG5FilterSSSE3;
+#endif
+}
+static SimdBinder TLG5FilterBinder(BindTLG5FilterKernel);
+
 //---------------------------------------------------------------------------
 // 圧縮処理用
 
@@ -39,21 +125,24 @@ bool CompressTLG5::main(long width, long height, BufRefT buffer, long pitch) {
 		cmpinbuf[i] = cmpoutbuf[i] = NULL;
 	}
 	long written[4];
-	int *blocksizes;
+	int *blocksizes = NULL;
 
 	// allocate buffers/compressors
 	try	{
 		compressor = new SlideCompressor();
+		if (lowEffort) compressor->SetMaxChain(LOW_EFFORT_CHAIN);
 		for(int i = 0; i < colors; i++)	{
 			cmpinbuf[i] = new unsigned char [width * BLOCK_HEIGHT];
 			cmpoutbuf[i] = new unsigned char [width * BLOCK_HEIGHT * 9 / 4];
 			written[i] = 0;
 		}
 		blocksizes = new int[blockcount];
+		if (stats) stats->allocations += 1 + colors * 2 + 1;
 
 		// ブロックサイズの位置を記録
-		ULONG blocksizepos = cur;
+		size_t blocksizepos = tell();
 
+		resize(cur + blockcount * 4);
 		cur += blockcount * 4;
 
 		//
@@ -68,6 +157,8 @@ bool CompressTLG5::main(long width, long height, BufRefT buffer, long pitch) {
 			
 			int inp = 0;
 			
+			StageTimer filterTimer(stats, EncodeStats::STAGE_FILTER);
+			TraceSpan span("filter", block);
 			for(int y = blk_y; y < ylim; y++) {
 				// retrieve scan lines
 				const unsigned char * upper;
@@ -80,46 +171,19 @@ bool CompressTLG5::main(long width, long height, BufRefT buffer, long pitch) {
 				const unsigned char * current;
 				current = (const unsigned char *)buffer;
 				
-				// prepare buffer
-				int prevcl[4];
-				int val[4];
-				
-				for(int c = 0; c < colors; c++) prevcl[c] = 0;
-				
-				for(int x = 0; x < width; x++) {
-					for(int c = 0; c < colors; c++) {
-						int cl;
-						if(upper)
-							cl = 0[current++] - 0[upper++];
-						else
-							cl = 0[current++];
-						val[c] = cl - prevcl[c];
-						prevcl[c] = cl;
-					}
-					// composite colors
-					switch(colors){
-					case 1:
-						cmpinbuf[0][inp] = val[0];
-						break;
-					case 3:
-						cmpinbuf[0][inp] = val[0] - val[1];
-						cmpinbuf[1][inp] = val[1];
-						cmpinbuf[2][inp] = val[2] - val[1];
-						break;
-					case 4:
-						cmpinbuf[0][inp] = val[0] - val[1];
-						cmpinbuf[1][inp] = val[1];
-						cmpinbuf[2][inp] = val[2] - val[1];
-						cmpinbuf[3][inp] = val[3];
-						break;
-					}
-					inp++;
-				}
+				// prepare buffer（composite colors まで含めて色ごとに書き出す）
+				unsigned char *out[4];
+				for(int c = 0; c < colors; c++) out[c] = cmpinbuf[c] + inp;
+				TLG5Filter(current, upper, width, out);
+				inp += width;
 			}
+			filterTimer.stop();
+			span.begin("lzss", block);
 			
 			// compress buffer and write to the file
 			
 			// LZSS
+			StageTimer lzssTimer(stats, EncodeStats::STAGE_LZSS);
 			int blocksize = 0;
 			for(int c = 0; c < colors; c++) {
 				long wrote = 0;
@@ -131,28 +195,41 @@ bool CompressTLG5::main(long width, long height, BufRefT buffer, long pitch) {
 					writeInt32(wrote);
 					writeBuffer((const char *)cmpoutbuf[c], wrote);
 					blocksize += wrote + 4 + 1;
+					if (stats) stats->lzssBlocks++;
 				} else {
 					compressor->Restore();
 					writeInt8(0x01);
 					writeInt32(inp);
 					writeBuffer((const char *)cmpinbuf[c], inp);
 					blocksize += inp + 4 + 1;
+					if (stats) stats->rawBlocks++;
 				}
 				written[c] += wrote;
 			}
 			
 			blocksizes[block] = blocksize;
+			lzssTimer.stop();
+			span.end();
+
+			// 書き出しステージへ渡す
+			flush();
 		}
 		
 		if (!canceled) {
 			// ブロックサイズ格納
+			std::vector<BYTE> table(blockcount * 4);
+			if (stats) stats->allocations++;
 			for (int i = 0; i < blockcount; i++) {
-				writeInt32(blocksizes[i], blocksizepos);
-				blocksizepos += 4;
+				table[i*4+0] =  blocksizes[i]        & 0xff;
+				table[i*4+1] = (blocksizes[i] >> 8)  & 0xff;
+				table[i*4+2] = (blocksizes[i] >> 16) & 0xff;
+				table[i*4+3] = (blocksizes[i] >> 24) & 0xff;
 			}
+			writeBuffer(&table[0], blockcount * 4, blocksizepos);
 		}
 		
 	} catch(...) {
+		if (stats && compressor) stats->chainSteps += compressor->GetChainSteps();
 		for(int i = 0; i < colors; i++) {
 			if(cmpinbuf[i]) delete [] cmpinbuf[i];
 			if(cmpoutbuf[i]) delete [] cmpoutbuf[i];
@@ -161,6 +238,7 @@ bool CompressTLG5::main(long width, long height, BufRefT buffer, long pitch) {
 		if(blocksizes) delete [] blocksizes;
 		throw;
 	}
+	if (stats) stats->chainSteps += compressor->GetChainSteps();
 	for(int i = 0; i < colors; i++) {
 		if(cmpinbuf[i]) delete [] cmpinbuf[i];
 		if(cmpoutbuf[i]) delete [] cmpoutbuf[i];
@@ -173,76 +251,56 @@ bool CompressTLG5::main(long width, long height, BufRefT buffer, long pitch) {
 	return canceled;
 }
 
+/**
+ * 保存処理に必要なメモリ量の見積もり
+ * @param width 画像横幅
+ * @param height 画像縦幅
+ */
+size_t CompressTLG5::estimateMemory(long width, long height) {
+	size_t blockcount = (size_t)((height - 1) / BLOCK_HEIGHT) + 1;
+	return sizeof(SlideCompressor)
+		+ (size_t)width * BLOCK_HEIGHT * (4 + 9) // cmpinbuf/cmpoutbuf (4色分)
+		+ blockcount * 4 * 2                    // blocksizes/table
+		+ estimateOutputMemory();
+}
+
 /**
  * 画像情報の書き出し
  * @param width 画像横幅
  * @param height 画像縦幅
  * @param buffer 画像バッファ
  * @param pitch 画像データのピッチ
- * @param tagsDict タグ情報
  * @return キャンセルされたら true
  */
-bool CompressTLG5::compress(long width, long height, BufRefT buffer, long pitch, iTJSDispatch2 *tagsDict) {
+bool CompressTLG5::compress(long width, long height, BufRefT buffer, long pitch) {
 	
 	bool canceled = false;
 	
-	// 取得
-	ttstr tags;
-	if (tagsDict) {
-		/**
-		 * タグ展開用
-		 */
-		class TagsCaller : public tTJSDispatch /** EnumMembers 用 */ {
-		protected:
-			ttstr *store;
-		public:
-			TagsCaller(ttstr *store) : store(store) {};
-			virtual tjs_error TJS_INTF_METHOD FuncCall( // function invocation
-														tjs_uint32 flag,			// calling flag
-														const tjs_char * membername,// member name ( NULL for a default member )
-														tjs_uint32 *hint,			// hint for the member name (in/out)
-														tTJSVariant *result,		// result
-														tjs_int numparams,			// number of parameters
-														tTJSVariant **param,		// parameters
-														iTJSDispatch2 *objthis		// object as "this"
-														) {
-				if (numparams > 1) {
-					tTVInteger flag = param[1]->AsInteger();
-					if (!(flag & TJS_HIDDENMEMBER)) {
-						ttstr name  = *param[0];
-						ttstr value = *param[2];
-						*store += ttstr(name.GetNarrowStrLen()) + ":" + name + "=" +	ttstr(value.GetNarrowStrLen()) + ":" + value + ",";
-					}
-				}
-				if (result) {
-					*result = true;
-				}
-				return TJS_S_OK;
-			}
-		} *caller = new TagsCaller(&tags);
-		tTJSVariantClosure closure(caller);
-		tagsDict->EnumMembers(TJS_IGNOREPROP, &closure, tagsDict);
-		caller->Release();
+	// タグ情報を "名前長:名前=値長:値," の形式で連結する
+	std::string tagsdata;
+	for (size_t i = 0; i < tags.size(); i++) {
+		std::string const &name  = tags[i].first;
+		std::string const &value = tags[i].second;
+		tagsdata += std::to_string(name.size()) + ":" + name + "=" + std::to_string(value.size()) + ":" + value + ",";
 	}
 
-	ULONG tagslen = tags.GetNarrowStrLen(); 
+	size_t tagslen = tagsdata.size();
 	if (tagslen > 0) {
 		// write TLG0.0 Structured Data Stream header
 		writeBuffer("TLG0.0\x00sds\x1a\x00", 11);
-		ULONG rawlenpos = cur;
+		size_t rawlenpos = tell();
+		resize(cur + 4);
 		cur += 4;
 		// write raw TLG stream
 		if (!(canceled = main(width, height, buffer, pitch))) {
 			// write raw data size
-			writeInt32(cur - rawlenpos - 4, rawlenpos);
+			writeInt32(tell() - rawlenpos - 4, rawlenpos);
 			// write "tags" chunk name
 			writeBuffer("tags", 4);
 			// write chunk size
 			writeInt32(tagslen);
 			// write chunk data
-			resize(cur + tagslen);
-			tags.ToNarrowStr((tjs_nchar*)&data[cur], tagslen);
-			cur += tagslen;
+			writeBuffer(tagsdata.data(), (int)tagslen);
 		}
 	} else {
 		// write raw TLG stream
@@ -251,28 +309,12 @@ bool CompressTLG5::compress(long width, long height, BufRefT buffer, long pitch,
 	return canceled;
 }
 
-
-//---------------------------------------------------------------------------
-// レイヤ拡張
-//---------------------------------------------------------------------------
-
-/**
- * TLG5 形式での画像の保存。注意点:データの保存が終わるまで処理が帰りません。
- * @param filename ファイル名
- * @param tags タグ情報
- */
-static tjs_error TJS_INTF_METHOD saveLayerImageTlg5Func(tTJSVariant *result,
-														tjs_int numparams,
-														tTJSVariant **param,
-														iTJSDispatch2 *objthis) {
-	if (numparams < 1) return TJS_E_BADPARAMCOUNT;
-	CompressAndSave<CompressTLG5>::saveLayerImage(
-		objthis, // layer
-		param[0]->GetString(),  // filename
-		numparams > 1 ? param[1]->AsObjectNoAddRef() : NULL // info
-		);
-	return TJS_S_OK;
+bool
+EncodeTLG5(ImageRef const &image, ByteSink &sink, TLG5Options const &opt, ProgressFunc *progress, void *progressData, EncodeStats *stats)
+{
+	CompressTLG5 work(progress, progressData);
+	work.setStats(stats);
+	work.setLowEffort(opt.lowEffort);
+	work.setTags(opt.tags);
+	return work.encode(image, sink);
 }
-
-NCB_ATTACH_FUNCTION(saveLayerImageTlg5, Layer, saveLayerImageTlg5Func);
-
@@ -9,8 +9,17 @@ public:
 	CompressTLG5(ProgressFunc *prog, void *data) : CompressBase(prog, data) {}
 	virtual ~CompressTLG5() {}
 
-	virtual bool compress(long width, long height, BufRefT buffer, long pitch, iTJSDispatch2 *tagsDict);
+	virtual bool compress(long width, long height, BufRefT buffer, long pitch);
 	bool             main(long width, long height, BufRefT buffer, long pitch);
+
+	// タグ情報の設定（空なら生の TLG5 を出力する）
+	void setTags(TLG5Options::TAGS const &t) { tags = t; }
+
+	// 保存処理に必要なメモリ量の見積もり
+	static size_t estimateMemory(long width, long height);
+
+protected:
+	TLG5Options::TAGS tags;
 };
 
 #endif
@@ -0,0 +1,119 @@
+#include "simd.hpp"
+
+#include <vector>
+#include <mutex>
+#include <cstdlib>
+#include <cstring>
+
+//---------------------------------------------------------------------------
+// CPU 機能の検出とカーネルの切り替え
+
+/**
+ * CPU/OS の対応機能を調べる
+ */
+static uint32_t
+DetectFeatures()
+{
+	uint32_t features = 0;
+#if LAYEREXSAVE_USE_AVX2
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+	__cpuid(info, 1);
+	if (info[3] & (1<<26)) features |= SIMD_SSE2;
+	if (info[2] & (1<< 9)) features |= SIMD_SSSE3;
+	if (info[2] & (1<<19)) features |= SIMD_SSE41;
+	// OSXSAVE と AVX，および OS が YMM レジスタを保存するか
+	if (maxLeaf >= 7 && (info[2] & ((1<<27)|(1<<28))) == ((1<<27)|(1<<28)) && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1<<5)) features |= SIMD_AVX2;
+	}
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))   features |= SIMD_SSE2;
+	if (__builtin_cpu_supports("ssse3"))  features |= SIMD_SSSE3;
+	if (__builtin_cpu_supports("sse4.1")) features |= SIMD_SSE41;
+	if (__builtin_cpu_supports("avx2"))   features |= SIMD_AVX2;
+#endif
+#endif
+#if LAYEREXSAVE_USE_SSE2
+	features |= SIMD_SSE2; // コンパイル時に有効なら常に使える
+#endif
+	return features;
+}
+
+/**
+ * 環境変数 LAYEREXSAVE_SIMD による制限（指定された機能まで使う）
+ */
+static uint32_t
+EnvironmentMask()
+{
+	static const struct { const char *name; uint32_t mask; } levels[] = {
+		{ "scalar", 0 },
+		{ "none",   0 },
+		{ "sse2",   SIMD_SSE2 },
+		{ "ssse3",  SIMD_SSE2 | SIMD_SSSE3 },
+		{ "sse41",  SIMD_SSE2 | SIMD_SSSE3 | SIMD_SSE41 },
+		{ "avx2",   SIMD_ALL },
+	};
+	const char *env = getenv("LAYEREXSAVE_SIMD");
+	if (env) {
+		for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+			if (!strcmp(env, levels[i].name)) return levels[i].mask;
+		}
+	}
+	return SIMD_ALL;
+}
+
+// 登録済みのカーネル選択関数と現在の設定
+struct SimdState {
+	uint32_t detected;
+	std::atomic<uint32_t> mask; //< SimdFeatures はロックなしで読む
+	std::vector<SimdBinder::BIND> binders;
+	std::mutex mutex;
+	SimdState() : detected(DetectFeatures()), mask(EnvironmentMask()) {}
+	static SimdState &instance() {
+		static SimdState state;
+		return state;
+	}
+};
+
+uint32_t
+SimdDetect()
+{
+	return SimdState::instance().detected;
+}
+
+uint32_t
+SimdFeatures()
+{
+	SimdState &state = SimdState::instance();
+	return state.detected & state.mask;
+}
+
+uint32_t
+SimdGetMask()
+{
+	return SimdState::instance().mask;
+}
+
+void
+SimdSetMask(uint32_t mask)
+{
+	SimdState &state = SimdState::instance();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	state.mask = mask & SIMD_ALL;
+	const uint32_t features = state.detected & state.mask;
+	for (size_t i = 0; i < state.binders.size(); i++) {
+		state.binders[i](features);
+	}
+}
+
+SimdBinder::SimdBinder(BIND bind)
+{
+	SimdState &state = SimdState::instance();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	state.binders.push_back(bind);
+	bind(state.detected & state.mask);
+}
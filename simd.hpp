@@ -0,0 +1,93 @@
+#ifndef _layerexsave_simd_hpp_
+#define _layerexsave_simd_hpp_
+
+#include <stdint.h>
+#include <atomic>
+
+// SSE2 が使えるかどうか（x64 では常に有効）
+// LAYEREXSAVE_DISABLE_SIMD を指定してコンパイルするとスカラ実装のみになる
+#if !(defined(LAYEREXSAVE_DISABLE_SIMD) && (LAYEREXSAVE_DISABLE_SIMD != 0))
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define LAYEREXSAVE_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+#endif
+
+#ifndef LAYEREXSAVE_USE_SSE2
+#define LAYEREXSAVE_USE_SSE2 0
+#endif
+
+// SSSE3/AVX2 版カーネルをビルドするかどうか（LAYEREXSAVE_USE_AVX2 で両方を判定する）
+// コンパイラオプションでは有効にせず，関数単位でターゲットを指定して実行時に切り替える
+#if LAYEREXSAVE_USE_SSE2 && (defined(_MSC_VER) || defined(__GNUC__))
+#define LAYEREXSAVE_USE_AVX2 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define LAYEREXSAVE_TARGET_SSSE3
+#define LAYEREXSAVE_TARGET_AVX2
+#else
+#define LAYEREXSAVE_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define LAYEREXSAVE_TARGET_AVX2  __attribute__((target("avx2")))
+#endif
+#else
+#define LAYEREXSAVE_USE_AVX2 0
+#endif
+
+// 実行時に検出する CPU 機能
+enum {
+	SIMD_SSE2  = 1<<0,
+	SIMD_SSSE3 = 1<<1,
+	SIMD_SSE41 = 1<<2,
+	SIMD_AVX2  = 1<<3,
+	SIMD_ALL   = SIMD_SSE2 | SIMD_SSSE3 | SIMD_SSE41 | SIMD_AVX2
+};
+
+/**
+ * 実行中の CPU/OS で使える機能（ビルドで無効にした機能は含まない）
+ */
+extern uint32_t SimdDetect();
+
+/**
+ * カーネルの選択に使う機能（SimdDetect() を SimdSetMask の指定で制限したもの）
+ */
+extern uint32_t SimdFeatures();
+
+/**
+ * 使う機能を制限してカーネルを選び直す（検証用。0 ならスカラ実装のみ）
+ * 起動時の制限は環境変数 LAYEREXSAVE_SIMD（scalar/sse2/ssse3/sse41/avx2）で指定できる
+ * カーネルは SimdKernel で保持するので，他のスレッドが処理中に呼んでもよい
+ * （処理中の呼び出しが途中で別の実装に切り替わることがあるが，どの実装でも結果は同じ）
+ * @param mask 使ってよい機能（SIMD_* の組み合わせ）
+ */
+extern void SimdSetMask(uint32_t mask);
+extern uint32_t SimdGetMask();
+
+/**
+ * カーネル選択関数の登録
+ * 登録時と SimdSetMask のたびに bind(SimdFeatures()) が呼ばれるので，
+ * 各ファイルで関数ポインタを選ぶ関数を static な SimdBinder で登録する
+ */
+struct SimdBinder {
+	typedef void (*BIND)(uint32_t features);
+	SimdBinder(BIND bind);
+};
+
+/**
+ * 実行時に選ぶカーネルの関数ポインタ
+ * SimdSetMask による差し替えと他のスレッドからの呼び出しが重なるので atomic で保持する
+ * （関数ポインタと同じように呼び出せる）
+ */
+template <typename KERNEL>
+class SimdKernel {
+public:
+	SimdKernel(KERNEL kernel) : kernel(kernel) {}
+	void operator=(KERNEL k) { kernel.store(k, std::memory_order_relaxed); }
+	operator KERNEL() const  { return kernel.load(std::memory_order_relaxed); }
+
+private:
+	SimdKernel(SimdKernel const&);
+	std::atomic<KERNEL> kernel;
+};
+
+#endif
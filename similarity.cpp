@@ -0,0 +1,449 @@
+#include "ncbind.hpp"
+#include "utils.hpp"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <unordered_map>
+
+//---------------------------------------------------------------------------
+// 画像類似検索用インデックス
+
+#define INDEX_FILE_MAGIC   "LESI"
+#define INDEX_FILE_VERSION 1
+
+/**
+ * 画像の同一判定・類似検索用インデックス
+ * ハッシュ値（getFingerPrintValue）の完全一致をハッシュ表で，
+ * 縮小ベクトル（getShrinkVectorOctet）の近傍を VP-tree で検索する
+ * （ツリー構築後に追加したベクトルは末尾にためて線形に調べ，ツリーの 1/8 を超えたら作り直す）
+ */
+class ImageSimilarityIndex {
+
+protected:
+	struct Entry {
+		ttstr id;
+		tjs_uint64 hash;
+		bool hasVector;
+	};
+
+	// VP-tree のノード（inside は vantage から radius 未満の部分木）
+	struct Node {
+		tjs_int entry;
+		double radius;
+		tjs_int inside, outside;
+	};
+
+	// 検索結果候補
+	struct Match {
+		double distance;
+		tjs_int entry;
+		bool operator<(Match const &o) const { return distance != o.distance ? distance < o.distance : entry < o.entry; }
+	};
+
+	std::vector<Entry> entries;
+	std::vector<tjs_uint8> vectors; //< entries と同じ順に dim byte ずつ（ベクトルなしは 0 埋め）
+	tjs_uint dim;
+	std::unordered_multimap<tjs_uint64, tjs_int> hashes;
+
+	std::vector<Node> tree;
+	tjs_int root;
+	std::vector<tjs_int> tail; //< ツリーに入っていないベクトル付きエントリ
+
+	const tjs_uint8 *vectorOf(tjs_int entry) const { return &vectors[(size_t)entry * dim]; }
+	double distance(const tjs_uint8 *v, tjs_int entry) const { return OctetDistance(v, vectorOf(entry), dim, VECTOR_METRIC_L2); }
+
+	/**
+	 * 部分木の構築
+	 * @param items [begin,end) の範囲のエントリ番号（距離計算用の作業領域付き）
+	 * @return ノード番号（空なら -1）
+	 */
+	tjs_int buildNode(std::vector< std::pair<double, tjs_int> > &items, size_t begin, size_t end) {
+		if (begin >= end) return -1;
+		// 中央の要素を vantage point にする
+		std::swap(items[begin], items[begin + (end - begin) / 2]);
+		tjs_int vp = items[begin].second;
+		tjs_int index = (tjs_int)tree.size();
+		tree.push_back(Node());
+		tree[index].entry  = vp;
+		tree[index].radius = 0;
+		tree[index].inside = tree[index].outside = -1;
+		if (end - begin == 1) return index;
+
+		const tjs_uint8 *v = vectorOf(vp);
+		for (size_t i = begin + 1; i < end; i++) items[i].first = distance(v, items[i].second);
+		size_t mid = begin + 1 + (end - begin - 1) / 2;
+		std::nth_element(items.begin() + begin + 1, items.begin() + mid, items.begin() + end);
+		tree[index].radius = items[mid].first;
+		tjs_int inside  = buildNode(items, begin + 1, mid);
+		tjs_int outside = buildNode(items, mid, end);
+		tree[index].inside  = inside;
+		tree[index].outside = outside;
+		return index;
+	}
+
+	// 未登録分がツリーの 1/8 を超えたらツリーを作り直す
+	void build() {
+		if (tail.empty() || tail.size() * 8 <= tree.size()) return;
+		std::vector< std::pair<double, tjs_int> > items;
+		for (tjs_int i = 0; i < (tjs_int)entries.size(); i++) {
+			if (entries[i].hasVector) items.push_back(std::make_pair(0.0, i));
+		}
+		tree.clear();
+		tree.reserve(items.size());
+		root = buildNode(items, 0, items.size());
+		tail.clear();
+	}
+
+	/**
+	 * 検索結果候補の追加（heap は距離の大きい順の最大ヒープ）
+	 * @param tau 探索半径（k 件揃った後は k 番目の距離に縮む）
+	 */
+	static void pushMatch(std::vector<Match> &heap, size_t k, double &tau, double d, tjs_int entry) {
+		if (d > tau) return;
+		Match m;
+		m.distance = d;
+		m.entry    = entry;
+		heap.push_back(m);
+		std::push_heap(heap.begin(), heap.end());
+		if (heap.size() > k) {
+			std::pop_heap(heap.begin(), heap.end());
+			heap.pop_back();
+		}
+		if (heap.size() == k) tau = heap.front().distance;
+	}
+
+	/**
+	 * k 近傍探索（heap は距離の大きい順の最大ヒープ）
+	 * @param tau 探索半径（k 件揃った後は k 番目の距離に縮む）
+	 */
+	void searchNode(tjs_int node, const tjs_uint8 *v, size_t k, double &tau, std::vector<Match> &heap) const {
+		while (node >= 0) {
+			Node const &n = tree[node];
+			double d = distance(v, n.entry);
+			pushMatch(heap, k, tau, d, n.entry);
+			if (n.inside < 0 && n.outside < 0) break;
+			// 近い側を先に調べ，遠い側は範囲が重なる場合のみ調べる
+			if (d < n.radius) {
+				if (d - tau <= n.radius) searchNode(n.inside, v, k, tau, heap);
+				if (d + tau >= n.radius) node = n.outside; else break;
+			} else {
+				if (d + tau >= n.radius) searchNode(n.outside, v, k, tau, heap);
+				if (d - tau <= n.radius) node = n.inside; else break;
+			}
+		}
+	}
+
+	/**
+	 * k 近傍探索（必要ならツリーを作り直し，ツリーと未登録分を調べる）
+	 */
+	void search(const tjs_uint8 *v, size_t k, double &tau, std::vector<Match> &heap) {
+		build();
+		searchNode(root, v, k, tau, heap);
+		for (size_t i = 0; i < tail.size(); i++) pushMatch(heap, k, tau, distance(v, tail[i]), tail[i]);
+	}
+
+	// ファイル入出力用
+	static void putU32(std::vector<tjs_uint8> &buf, tjs_uint32 n) {
+		for (int i = 0; i < 4; i++) buf.push_back((tjs_uint8)(n >> (i * 8)));
+	}
+	static void putU64(std::vector<tjs_uint8> &buf, tjs_uint64 n) {
+		for (int i = 0; i < 8; i++) buf.push_back((tjs_uint8)(n >> (i * 8)));
+	}
+	static tjs_uint64 getBytes(std::vector<tjs_uint8> const &buf, size_t &pos, int size) {
+		if (pos + size > buf.size()) TVPThrowExceptionMessage(TJS_W("Broken index file."));
+		tjs_uint64 n = 0;
+		for (int i = 0; i < size; i++) n |= (tjs_uint64)buf[pos + i] << (i * 8);
+		pos += size;
+		return n;
+	}
+
+	/**
+	 * 文字列を UTF-8 で格納（バイト数＋本体）
+	 * tjs_char が16bitの環境ではサロゲートペアを1文字にまとめる
+	 */
+	static void putString(std::vector<tjs_uint8> &buf, ttstr const &str) {
+		const tjs_char *s = str.c_str();
+		const tjs_uint len = (tjs_uint)str.length();
+		std::vector<tjs_uint8> utf8;
+		for (tjs_uint i = 0; i < len; i++) {
+			tjs_uint32 c = (tjs_uint32)s[i];
+			if (c >= 0xd800 && c < 0xdc00 && i + 1 < len && (tjs_uint32)s[i+1] >= 0xdc00 && (tjs_uint32)s[i+1] < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) + ((tjs_uint32)s[++i] - 0xdc00);
+			}
+			if (c < 0x80) {
+				utf8.push_back((tjs_uint8)c);
+			} else if (c < 0x800) {
+				utf8.push_back((tjs_uint8)(0xc0 | (c >> 6)));
+				utf8.push_back((tjs_uint8)(0x80 | (c & 0x3f)));
+			} else if (c < 0x10000) {
+				utf8.push_back((tjs_uint8)(0xe0 | (c >> 12)));
+				utf8.push_back((tjs_uint8)(0x80 | ((c >> 6) & 0x3f)));
+				utf8.push_back((tjs_uint8)(0x80 | (c & 0x3f)));
+			} else {
+				utf8.push_back((tjs_uint8)(0xf0 | ((c >> 18) & 0x07)));
+				utf8.push_back((tjs_uint8)(0x80 | ((c >> 12) & 0x3f)));
+				utf8.push_back((tjs_uint8)(0x80 | ((c >> 6) & 0x3f)));
+				utf8.push_back((tjs_uint8)(0x80 | (c & 0x3f)));
+			}
+		}
+		putU32(buf, (tjs_uint32)utf8.size());
+		buf.insert(buf.end(), utf8.begin(), utf8.end());
+	}
+
+	/**
+	 * putString で格納した文字列の取り出し
+	 * tjs_char が16bitの環境では BMP 外の文字をサロゲートペアにする
+	 */
+	static ttstr getString(std::vector<tjs_uint8> const &buf, size_t &pos) {
+		const size_t size = (size_t)getBytes(buf, pos, 4);
+		if (pos + size > buf.size()) TVPThrowExceptionMessage(TJS_W("Broken index file."));
+		const size_t end = pos + size;
+		std::vector<tjs_char> str;
+		while (pos < end) {
+			tjs_uint32 c = buf[pos++];
+			int follow = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+			if (follow) c &= 0x3f >> follow;
+			for (; follow > 0; follow--) {
+				if (pos >= end || (buf[pos] & 0xc0) != 0x80) TVPThrowExceptionMessage(TJS_W("Broken index file."));
+				c = (c << 6) | (buf[pos++] & 0x3f);
+			}
+			if (sizeof(tjs_char) == 2 && c >= 0x10000) {
+				str.push_back((tjs_char)(0xd800 + ((c - 0x10000) >> 10)));
+				str.push_back((tjs_char)(0xdc00 + ((c - 0x10000) & 0x3ff)));
+			} else {
+				str.push_back((tjs_char)c);
+			}
+		}
+		str.push_back(0);
+		return ttstr(&str[0]);
+	}
+
+	static ImageSimilarityIndex *getInstance(iTJSDispatch2 *objthis) {
+		ImageSimilarityIndex *obj = ncbInstanceAdaptor<ImageSimilarityIndex>::GetNativeInstance(objthis, true);
+		if (!obj) TVPThrowExceptionMessage(TJS_W("Invalid object."));
+		return obj;
+	}
+
+	/**
+	 * エントリの追加
+	 * @param vector ベクトル（NULL ならハッシュのみ登録）
+	 */
+	void addEntry(ttstr const &id, tjs_uint64 hash, const tjs_uint8 *vector, tjs_uint length) {
+		if (vector) {
+			if (!dim) dim = length;
+			if (!length || length != dim) TVPThrowExceptionMessage(TJS_W("Different vector size."));
+		}
+		tjs_int index = (tjs_int)entries.size();
+		Entry entry;
+		entry.id        = id;
+		entry.hash      = hash;
+		entry.hasVector = vector != NULL;
+		entries.push_back(entry);
+		if (dim) {
+			vectors.resize(entries.size() * dim, 0);
+			if (vector) std::copy(vector, vector + dim, vectors.begin() + (size_t)index * dim);
+		}
+		hashes.insert(std::make_pair(hash, index));
+		if (vector) tail.push_back(index);
+	}
+
+public:
+	ImageSimilarityIndex() : dim(0), root(-1) {}
+
+	/**
+	 * 登録
+	 * ImageSimilarityIndex.add = function(id, hash, vector=void);
+	 * @param id 識別子（文字列）
+	 * @param hash getFingerPrintValue の値
+	 * @param vector getShrinkVectorOctet の値（全エントリで同じ長さであること）
+	 */
+	static tjs_error TJS_INTF_METHOD addFunc(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis) {
+		if (numparams < 2) return TJS_E_BADPARAMCOUNT;
+		ImageSimilarityIndex *self = getInstance(objthis);
+		const tjs_uint8 *vector = NULL;
+		tjs_uint length = 0;
+		if (numparams > 2 && param[2]->Type() != tvtVoid) {
+			if (param[2]->Type() != tvtOctet) return TJS_E_INVALIDPARAM;
+			tTJSVariantOctet *oct = param[2]->AsOctetNoAddRef();
+			if (!oct || !(vector = oct->GetData())) return TJS_E_INVALIDPARAM;
+			length = oct->GetLength();
+		}
+		self->addEntry(ttstr(*param[0]), (tjs_uint64)param[1]->AsInteger(), vector, length);
+		return TJS_S_OK;
+	}
+
+	/**
+	 * ハッシュ値の完全一致検索
+	 * ImageSimilarityIndex.findHash = function(hash);
+	 * @return 一致したエントリの id の配列（登録順）
+	 */
+	static tjs_error TJS_INTF_METHOD findHashFunc(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis) {
+		if (numparams < 1) return TJS_E_BADPARAMCOUNT;
+		ImageSimilarityIndex *self = getInstance(objthis);
+		std::vector<tjs_int> found;
+		typedef std::unordered_multimap<tjs_uint64, tjs_int>::const_iterator Iter;
+		std::pair<Iter, Iter> range = self->hashes.equal_range((tjs_uint64)param[0]->AsInteger());
+		for (Iter it = range.first; it != range.second; ++it) found.push_back(it->second);
+		std::sort(found.begin(), found.end());
+		if (result) {
+			iTJSDispatch2 *arr = TJSCreateArrayObject();
+			if (!arr) return TJS_E_FAIL;
+			for (size_t i = 0; i < found.size(); i++) {
+				tTJSVariant v(self->entries[found[i]].id);
+				arr->PropSetByNum(TJS_MEMBERENSURE, (tjs_int)i, &v, arr);
+			}
+			*result = tTJSVariant(arr, arr);
+			arr->Release();
+		}
+		return TJS_S_OK;
+	}
+
+	/**
+	 * ベクトルの近傍検索（ユークリッド距離）
+	 * ImageSimilarityIndex.search = function(vector, k=1, maxDistance=void);
+	 * @return [ %[ id, hash, distance ], ... ] 形式の距離の近い順の配列
+	 */
+	static tjs_error TJS_INTF_METHOD searchFunc(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis) {
+		if (numparams < 1) return TJS_E_BADPARAMCOUNT;
+		ImageSimilarityIndex *self = getInstance(objthis);
+		if (param[0]->Type() != tvtOctet) return TJS_E_INVALIDPARAM;
+		tTJSVariantOctet *oct = param[0]->AsOctetNoAddRef();
+		const tjs_int k = (numparams > 1 && param[1]->Type() != tvtVoid) ? (tjs_int)param[1]->AsInteger() : 1;
+		double tau      = (numparams > 2 && param[2]->Type() != tvtVoid) ? param[2]->AsReal() : HUGE_VAL;
+		if (!oct || k <= 0) return TJS_E_INVALIDPARAM;
+
+		std::vector<Match> heap;
+		if (self->dim) {
+			if (oct->GetLength() != self->dim) TVPThrowExceptionMessage(TJS_W("Different vector size."));
+			self->search(oct->GetData(), (size_t)k, tau, heap);
+		}
+		std::sort(heap.begin(), heap.end());
+
+		if (result) {
+			iTJSDispatch2 *arr = TJSCreateArrayObject();
+			if (!arr) return TJS_E_FAIL;
+			for (size_t i = 0; i < heap.size(); i++) {
+				Entry const &e = self->entries[heap[i].entry];
+				ncbDictionaryAccessor dict;
+				dict.SetValue(TJS_W("id"),       e.id);
+				dict.SetValue(TJS_W("hash"),     (tTVInteger)e.hash);
+				dict.SetValue(TJS_W("distance"), heap[i].distance);
+				tTJSVariant v = dict;
+				arr->PropSetByNum(TJS_MEMBERENSURE, (tjs_int)i, &v, arr);
+			}
+			*result = tTJSVariant(arr, arr);
+			arr->Release();
+		}
+		return TJS_S_OK;
+	}
+
+	/**
+	 * 全エントリの削除
+	 */
+	void clear() {
+		entries.clear();
+		std::vector<tjs_uint8>().swap(vectors);
+		hashes.clear();
+		tree.clear();
+		tail.clear();
+		dim  = 0;
+		root = -1;
+	}
+
+	/**
+	 * ファイルへの保存
+	 * @param filename ファイル名
+	 */
+	void save(const tjs_char *filename) {
+		std::vector<tjs_uint8> buf(INDEX_FILE_MAGIC, INDEX_FILE_MAGIC + 4);
+		putU32(buf, INDEX_FILE_VERSION);
+		putU32(buf, dim);
+		putU32(buf, (tjs_uint32)entries.size());
+		for (size_t i = 0; i < entries.size(); i++) {
+			Entry const &e = entries[i];
+			putU64(buf, e.hash);
+			putString(buf, e.id);
+			buf.push_back(e.hasVector ? 1 : 0);
+			if (e.hasVector) buf.insert(buf.end(), vectors.begin() + i * dim, vectors.begin() + (i + 1) * dim);
+		}
+
+		IStream *out = TVPCreateIStream(filename, TJS_BS_WRITE);
+		if (!out) {
+			ttstr msg = filename;
+			msg += L":can't open";
+			TVPThrowExceptionMessage(msg.c_str());
+		}
+		ULONG size = (ULONG)buf.size(), s = 0;
+		HRESULT hr = out->Write(&buf[0], size, &s);
+		out->Release();
+		if (hr < 0 || s != size) {
+			ttstr msg = filename;
+			msg += L":write failed";
+			TVPThrowExceptionMessage(msg.c_str());
+		}
+	}
+
+	/**
+	 * ファイルからの読み込み（現在の内容は破棄される）
+	 * @param filename ファイル名
+	 */
+	void load(const tjs_char *filename) {
+		IStream *in = TVPCreateIStream(filename, TJS_BS_READ);
+		if (!in) {
+			ttstr msg = filename;
+			msg += L":can't open";
+			TVPThrowExceptionMessage(msg.c_str());
+		}
+		std::vector<tjs_uint8> buf;
+		for (;;) {
+			tjs_uint8 chunk[1024*64];
+			ULONG s = 0;
+			if (in->Read(chunk, sizeof chunk, &s) < 0 || !s) break;
+			buf.insert(buf.end(), chunk, chunk + s);
+		}
+		in->Release();
+
+		if (buf.size() < 4 || !std::equal(buf.begin(), buf.begin() + 4, INDEX_FILE_MAGIC))
+			TVPThrowExceptionMessage(TJS_W("Not an index file."));
+		size_t pos = 4;
+		if (getBytes(buf, pos, 4) != INDEX_FILE_VERSION)
+			TVPThrowExceptionMessage(TJS_W("Unsupported index file version."));
+
+		ImageSimilarityIndex work;
+		tjs_uint filedim = (tjs_uint)getBytes(buf, pos, 4);
+		tjs_uint32 count = (tjs_uint32)getBytes(buf, pos, 4);
+		for (tjs_uint32 i = 0; i < count; i++) {
+			tjs_uint64 hash = getBytes(buf, pos, 8);
+			ttstr name = getString(buf, pos);
+			const tjs_uint8 *vector = NULL;
+			if (getBytes(buf, pos, 1)) {
+				if (pos + filedim > buf.size()) TVPThrowExceptionMessage(TJS_W("Broken index file."));
+				vector = &buf[pos];
+				pos += filedim;
+			}
+			work.addEntry(name, hash, vector, filedim);
+		}
+		clear();
+		entries.swap(work.entries);
+		vectors.swap(work.vectors);
+		hashes.swap(work.hashes);
+		tail.swap(work.tail);
+		dim = work.dim;
+	}
+
+	tjs_int getCount() const { return (tjs_int)entries.size(); }
+	tjs_int getDim() const { return (tjs_int)dim; }
+};
+
+NCB_REGISTER_CLASS(ImageSimilarityIndex) {
+	Constructor();
+	NCB_METHOD_RAW_CALLBACK(add,      ImageSimilarityIndex::addFunc,      0);
+	NCB_METHOD_RAW_CALLBACK(findHash, ImageSimilarityIndex::findHashFunc, 0);
+	NCB_METHOD_RAW_CALLBACK(search,   ImageSimilarityIndex::searchFunc,   0);
+	NCB_METHOD(clear);
+	NCB_METHOD(save);
+	NCB_METHOD(load);
+	NCB_PROPERTY_RO(count, getCount);
+	NCB_PROPERTY_RO(dim, getDim);
+};
@@ -0,0 +1,262 @@
+#include "streamwriter.hpp"
+#include "trace.hpp"
+
+#include <cstring>
+
+//---------------------------------------------------------------------------
+// ファイル書き出しステージ
+
+StreamWriter::StreamWriter(ByteSink &target)
+	: target(target), started(false), queued(0), closing(false), failed(false)
+{
+}
+
+StreamWriter::~StreamWriter()
+{
+	stop(true);
+}
+
+void
+StreamWriter::open()
+{
+	if (started) return;
+	target.open();
+	start();
+	started = true;
+}
+
+void
+StreamWriter::start()
+{
+	closing = false;
+	thread = std::thread(&StreamWriter::run, this);
+}
+
+/**
+ * 書き出しスレッドの終了
+ * @param discard 未書き出しデータを破棄する
+ */
+void
+StreamWriter::stop(bool discard)
+{
+	if (thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (discard) {
+				queue.clear();
+				queued = 0;
+			}
+			closing = true;
+		}
+		wakeup.notify_one();
+		drained.notify_all();
+		thread.join();
+	}
+}
+
+void
+StreamWriter::push(DATA &chunk)
+{
+	if (chunk.empty()) return;
+	if (!started) open();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	// 書き出しが追いつくまで待つ
+	drained.wait(lock, [this]{ return queued < MAX_QUEUED_SIZE || failed || closing; });
+	if (failed) return;
+
+	queued += chunk.size();
+	queue.push_back(Item());
+	Item &item = queue.back();
+	item.pos    = 0;
+	item.append = true;
+	item.data.swap(chunk);
+	lock.unlock();
+	wakeup.notify_one();
+}
+
+void
+StreamWriter::patch(size_t pos, const void *buf, size_t size)
+{
+	if (!size || !started) return;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	queue.push_back(Item());
+	Item &item = queue.back();
+	item.pos    = pos;
+	item.append = false;
+	item.data.assign((const BYTE*)buf, (const BYTE*)buf + size);
+	queued += size;
+	lock.unlock();
+	wakeup.notify_one();
+}
+
+void
+StreamWriter::finish()
+{
+	stop(false);
+	if (failed) {
+		target.abort();
+		if (error) std::rethrow_exception(error);
+		throw EncodeError("write failed");
+	}
+	if (started) target.finish();
+}
+
+void
+StreamWriter::abort()
+{
+	stop(true);
+	if (started) target.abort();
+}
+
+/**
+ * 書き出しスレッド本体
+ */
+void
+StreamWriter::run()
+{
+	TraceThreadName("writer");
+	for (;;) {
+		Item item;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeup.wait(lock, [this]{ return !queue.empty() || closing; });
+			if (queue.empty()) break;
+			item.pos    = queue.front().pos;
+			item.append = queue.front().append;
+			item.data.swap(queue.front().data);
+			queue.pop_front();
+		}
+		const size_t size = item.data.size();
+		bool ok = !failed;
+		std::exception_ptr e;
+		if (ok) {
+			TraceSpan span("write", (long long)size);
+			try {
+				writeItem(item);
+			} catch (...) {
+				e = std::current_exception();
+				ok = false;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queued -= size;
+			if (!ok && !failed) {
+				failed = true;
+				error = e;
+			}
+		}
+		drained.notify_all();
+	}
+}
+
+/**
+ * データ1件の書き出し（失敗したら出力先が例外を投げる）
+ */
+void
+StreamWriter::writeItem(Item &item)
+{
+	if (item.append) {
+		target.push(item.data);
+	} else {
+		target.patch(item.pos, &item.data[0], item.data.size());
+	}
+}
+
+//---------------------------------------------------------------------------
+// メモリ上の出力先
+
+void
+MemorySink::push(DATA &chunk)
+{
+	if (data.empty()) {
+		data.swap(chunk);
+	} else {
+		data.insert(data.end(), chunk.begin(), chunk.end());
+	}
+}
+
+void
+MemorySink::patch(size_t pos, const void *buf, size_t size)
+{
+	if (pos + size > data.size()) throw EncodeError("patch out of range");
+	memcpy(&data[pos], buf, size);
+}
+
+//---------------------------------------------------------------------------
+// ファイルの出力先
+
+FileSink::FileSink(const std::string &filename)
+	: filename(filename), fp(NULL), written(0)
+{
+}
+
+FileSink::~FileSink()
+{
+	close();
+}
+
+void
+FileSink::open()
+{
+	if (fp) return;
+	fp = fopen(filename.c_str(), "wb");
+	if (!fp) throw EncodeError(filename + ":can't open");
+	written = 0;
+}
+
+void
+FileSink::close()
+{
+	if (fp) {
+		fclose(fp);
+		fp = NULL;
+	}
+}
+
+/**
+ * 書き出し失敗（ファイルを閉じて例外を投げる）
+ */
+void
+FileSink::fail(const char *what)
+{
+	close();
+	throw EncodeError(filename + ":" + what);
+}
+
+void
+FileSink::push(DATA &chunk)
+{
+	if (chunk.empty()) return;
+	if (!fp) open();
+	if (fwrite(&chunk[0], 1, chunk.size(), fp) != chunk.size()) fail("write failed");
+	written += chunk.size();
+}
+
+void
+FileSink::patch(size_t pos, const void *buf, size_t size)
+{
+	if (!size || !fp) return;
+	// 上書き後は末尾に戻す
+	if (fseek(fp, (long)pos, SEEK_SET) ||
+		fwrite(buf, 1, size, fp) != size ||
+		fseek(fp, (long)written, SEEK_SET)) fail("write failed");
+}
+
+void
+FileSink::finish()
+{
+	if (fp) {
+		const bool failed = fflush(fp) != 0;
+		close();
+		if (failed) throw EncodeError(filename + ":write failed");
+	}
+}
+
+void
+FileSink::abort()
+{
+	close();
+}
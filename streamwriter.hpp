@@ -0,0 +1,98 @@
+#ifndef _layerexsave_streamwriter_hpp_
+#define _layerexsave_streamwriter_hpp_
+
+#include "encoder.hpp"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+/**
+ * ファイル書き出しステージ
+ * 圧縮済みのチャンクをキューで受け取り，別スレッドで出力先に書き出す。
+ * 圧縮処理と書き出し処理を重ねることで保存時間を短縮する。
+ */
+class StreamWriter : public ByteSink {
+public:
+	enum {
+		MAX_QUEUED_SIZE = 1024*1024*4 //< キューに溜める最大バイト数（超えたら書き出し待ち）
+	};
+
+	/**
+	 * コンストラクタ
+	 * 出力先は最初のデータを受け取った時点で（呼び出し元のスレッドで）開く
+	 * @param target 実際の出力先（書き出しスレッドから push/patch が呼ばれる）
+	 */
+	StreamWriter(ByteSink &target);
+
+	/**
+	 * デストラクタ
+	 * 書き出し途中の場合は残りを破棄して終了する
+	 */
+	virtual ~StreamWriter();
+
+	/**
+	 * 出力先を開いて書き出しスレッドを開始する
+	 */
+	virtual void open();
+
+	/**
+	 * 末尾へのデータ追加
+	 * @param chunk 書き出すデータ（中身は引き取られ空になる）
+	 */
+	virtual void push(DATA &chunk);
+
+	/**
+	 * 書き出し済み位置へのデータ上書き
+	 * @param pos ファイル先頭からの位置
+	 * @param buf データ
+	 * @param size バイト数
+	 */
+	virtual void patch(size_t pos, const void *buf, size_t size);
+
+	/**
+	 * 書き出しの完了待ち
+	 * 書き出しに失敗していた場合は出力先が投げた例外を投げ直す
+	 */
+	virtual void finish();
+
+	/**
+	 * 書き出しの中止（キュー内の未書き出しデータは破棄される）
+	 */
+	virtual void abort();
+
+	/**
+	 * 出力先が開かれたか（データが書き出されたか）
+	 */
+	bool opened() const { return started; }
+
+protected:
+	struct Item {
+		size_t pos;   //< 上書き位置（append のときは未使用）
+		bool  append; //< 末尾への追加か
+		DATA  data;
+	};
+
+	void start();
+	void stop(bool discard);
+	void run();
+	void writeItem(Item &item);
+
+	ByteSink &target;
+	bool started;   //< 出力先を開いて書き出しスレッドを開始したか
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wakeup;  //< ライタ起床用
+	std::condition_variable drained; //< キュー空き待ち用
+	std::deque<Item> queue;
+	size_t queued;  //< キュー内バイト数
+	bool closing;   //< 終了指示
+	bool failed;    //< 書き出しエラー
+	std::exception_ptr error; //< 出力先が投げた例外
+};
+
+#endif
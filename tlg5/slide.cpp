@@ -5,6 +5,8 @@
 SlideCompressor::SlideCompressor()
 {
 	S = 0;
+	MaxChain = 0;
+	ChainSteps = 0;
 	for(int i = 0; i < SLIDE_N + SLIDE_M; i++) Text[i] = 0;
 	for(int i = 0; i < 256*256; i++)
 		Map[i] = -1;
@@ -29,10 +31,13 @@ int SlideCompressor::GetMatch(const unsigned char*cur, int curlen, int &pos, int
 	if((place = Map[place]) != -1)
 	{
 		int place_org;
+		int chain = MaxChain;
+		int steps = 0;
 		curlen -= 1;
 		do
 		{
 			place_org = place;
+			steps++;
 			if(s == place || s == ((place + 1) & (SLIDE_N -1))) continue;
 			place += 2;
 			int lim = (SLIDE_M < curlen ? SLIDE_M : curlen) + place_org;
@@ -52,9 +57,11 @@ int SlideCompressor::GetMatch(const unsigned char*cur, int curlen, int &pos, int
 			while(Text[place] == *(c++) && place < lim) place++;
 			int matchlen = place - place_org;
 			if(matchlen > maxlen) pos = place_org, maxlen = matchlen;
-			if(matchlen == SLIDE_M) return maxlen;
+			if(matchlen == SLIDE_M) { ChainSteps += steps; return maxlen; }
+			if(chain && !--chain) break;
 
 		} while((place = Chains[place_org].Next) != -1);
+		ChainSteps += steps;
 	}
 	return maxlen;
 }
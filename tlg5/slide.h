@@ -26,6 +26,9 @@ class SlideCompressor
 	int S;
 	int S2;
 
+	int MaxChain; // 一致検索で辿るチェインの上限(0:無制限)
+	unsigned long long ChainSteps; // 一致検索で辿ったチェインの累計
+
 public:
 	SlideCompressor();
 	virtual ~SlideCompressor();
@@ -41,6 +44,9 @@ public:
 
 	void Store();
 	void Restore();
+
+	void SetMaxChain(int n) { MaxChain = n; }
+	unsigned long long GetChainSteps() const { return ChainSteps; }
 };
 //---------------------------------------------------------------------------
 #endif
@@ -0,0 +1,171 @@
+#include "trace.hpp"
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <cstdio>
+
+std::atomic<bool> TraceActive(false);
+
+//---------------------------------------------------------------------------
+// スレッドごとのリングバッファ
+
+/**
+ * 1スレッド分の記録
+ * 書き込みは持ち主のスレッドだけが行い，読み出し側とは区間ごとの通し番号で整合性を確かめる
+ */
+struct TraceBuffer {
+	enum { CAPACITY = 1<<13 }; //< 保持する区間の数（2のべき乗）
+
+	struct Slot {
+		std::atomic<unsigned long long> seq; //< 通し番号*2+2（書き込み中は奇数）
+		std::atomic<const char*> name;
+		std::atomic<long long> arg;
+		std::atomic<unsigned long long> begin, end;
+	};
+
+	Slot slots[CAPACITY];
+	std::atomic<unsigned long long> head; //< 次に書き込む通し番号
+	std::atomic<unsigned long long> base; //< これより前の通し番号は破棄済み
+	std::atomic<const char*> threadName;
+	std::atomic<bool> owned;              //< スレッドが使用中
+	int tid;                              //< 出力用のスレッド番号
+
+	TraceBuffer(int tid) : head(0), base(0), threadName(NULL), owned(true), tid(tid) {
+		for (int i = 0; i < CAPACITY; i++) slots[i].seq.store(0, std::memory_order_relaxed);
+	}
+
+	void push(const char *n, long long a, unsigned long long b, unsigned long long e) {
+		unsigned long long i = head.load(std::memory_order_relaxed);
+		Slot &s = slots[i & (CAPACITY - 1)];
+		s.seq.store(i * 2 + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		s.name .store(n, std::memory_order_relaxed);
+		s.arg  .store(a, std::memory_order_relaxed);
+		s.begin.store(b, std::memory_order_relaxed);
+		s.end  .store(e, std::memory_order_relaxed);
+		s.seq.store(i * 2 + 2, std::memory_order_release);
+		head.store(i + 1, std::memory_order_release);
+	}
+};
+
+// 確保したバッファ（終了したスレッドのバッファは次に記録を始めたスレッドが引き継ぐ）
+static std::mutex TraceMutex;
+static std::vector<TraceBuffer*> TraceBuffers;
+
+// 記録の時刻基準
+static const std::chrono::steady_clock::time_point TraceEpoch = std::chrono::steady_clock::now();
+
+/**
+ * スレッドごとの状態（スレッド終了時にバッファを手放す）
+ */
+struct TraceThread {
+	TraceBuffer *buffer;
+	const char *name;
+	TraceThread() : buffer(NULL), name(NULL) {}
+	~TraceThread() {
+		if (buffer) buffer->owned.store(false, std::memory_order_release);
+	}
+};
+static thread_local TraceThread CurrentThread;
+
+/**
+ * 呼び出したスレッドのバッファ（初回はロックを取って割り当てる）
+ */
+static TraceBuffer *
+GetTraceBuffer()
+{
+	TraceThread &self = CurrentThread;
+	if (!self.buffer) {
+		std::lock_guard<std::mutex> lock(TraceMutex);
+		for (size_t i = 0; i < TraceBuffers.size(); i++) {
+			bool owned = false;
+			if (TraceBuffers[i]->owned.compare_exchange_strong(owned, true)) {
+				self.buffer = TraceBuffers[i];
+				break;
+			}
+		}
+		if (!self.buffer) {
+			self.buffer = new TraceBuffer((int)TraceBuffers.size() + 1);
+			TraceBuffers.push_back(self.buffer);
+		}
+		self.buffer->threadName.store(self.name, std::memory_order_relaxed);
+	}
+	return self.buffer;
+}
+
+//---------------------------------------------------------------------------
+
+void
+TraceEnable(bool enable)
+{
+	if (enable && !TraceActive.load()) {
+		std::lock_guard<std::mutex> lock(TraceMutex);
+		for (size_t i = 0; i < TraceBuffers.size(); i++) {
+			TraceBuffers[i]->base.store(TraceBuffers[i]->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+		}
+	}
+	TraceActive.store(enable);
+}
+
+void
+TraceThreadName(const char *name)
+{
+	TraceThread &self = CurrentThread;
+	self.name = name;
+	if (self.buffer) self.buffer->threadName.store(name, std::memory_order_relaxed);
+}
+
+unsigned long long
+TraceNow()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - TraceEpoch).count();
+}
+
+void
+TraceRecord(const char *name, long long arg, unsigned long long begin, unsigned long long end)
+{
+	GetTraceBuffer()->push(name, arg, begin, end);
+}
+
+size_t
+TraceDump(std::string &json)
+{
+	std::lock_guard<std::mutex> lock(TraceMutex);
+	size_t count = 0;
+	char buf[256];
+	json = "{\"traceEvents\":[\n";
+	for (size_t b = 0; b < TraceBuffers.size(); b++) {
+		TraceBuffer &tb = *TraceBuffers[b];
+		const char *threadName = tb.threadName.load(std::memory_order_relaxed);
+		snprintf(buf, sizeof(buf), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+				 tb.tid, threadName ? threadName : "thread");
+		json += buf;
+
+		unsigned long long head = tb.head.load(std::memory_order_acquire);
+		unsigned long long i    = tb.base.load(std::memory_order_relaxed);
+		if (head - i > TraceBuffer::CAPACITY) i = head - TraceBuffer::CAPACITY;
+		for (; i < head; i++) {
+			TraceBuffer::Slot &s = tb.slots[i & (TraceBuffer::CAPACITY - 1)];
+			unsigned long long seq = s.seq.load(std::memory_order_acquire);
+			if (seq != i * 2 + 2) continue; // 上書き済み
+			const char *name        = s.name .load(std::memory_order_relaxed);
+			long long arg           = s.arg  .load(std::memory_order_relaxed);
+			unsigned long long from = s.begin.load(std::memory_order_relaxed);
+			unsigned long long to   = s.end  .load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (s.seq.load(std::memory_order_relaxed) != seq) continue; // 読み出し中に上書きされた
+
+			int len = snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"cat\":\"save\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+							   name, tb.tid, from / 1000.0, (to - from) / 1000.0);
+			if (arg >= 0) len += snprintf(buf + len, sizeof(buf) - len, ",\"args\":{\"arg\":%lld}", arg);
+			json.append(buf, len);
+			json += "},\n";
+			count++;
+		}
+	}
+	// 末尾のカンマを取り除く
+	if (json[json.size() - 2] == ',') json.erase(json.size() - 2, 1);
+	json += "],\"displayTimeUnit\":\"ms\"}\n";
+	return count;
+}
@@ -0,0 +1,94 @@
+#ifndef _layerexsave_trace_hpp_
+#define _layerexsave_trace_hpp_
+
+/**
+ * 保存処理のトレース記録（Chrome の trace event 形式で出力する）
+ * 記録はスレッドごとのリングバッファに行い，記録時にはロックを取らない。
+ * 有効にしていない間は区間ごとにフラグを1回読むだけで何も記録しない
+ */
+
+#include <atomic>
+#include <string>
+
+extern std::atomic<bool> TraceActive; //< 記録中（TraceEnable で切り替える）
+
+/**
+ * 記録の開始・停止
+ * 開始時はそれまでの記録を破棄する
+ * @param enable true なら記録を開始する
+ */
+extern void TraceEnable(bool enable);
+
+/**
+ * 記録中かどうか
+ */
+inline bool TraceEnabled() {
+	return TraceActive.load(std::memory_order_relaxed);
+}
+
+/**
+ * 呼び出したスレッドの表示名の設定
+ * @param name 表示名（文字列リテラルなど，破棄されないもの）
+ */
+extern void TraceThreadName(const char *name);
+
+/**
+ * 現在時刻（記録の時刻基準。ns）
+ */
+extern unsigned long long TraceNow();
+
+/**
+ * 区間の記録（呼び出したスレッドのバッファに追加する。古いものから上書きされる）
+ * @param name 区間名（文字列リテラルなど，破棄されないもの）
+ * @param arg 区間の付加情報（ブロック番号など。負なら出力しない）
+ * @param begin 開始時刻(TraceNow)
+ * @param end 終了時刻(TraceNow)
+ */
+extern void TraceRecord(const char *name, long long arg, unsigned long long begin, unsigned long long end);
+
+/**
+ * 記録済みの区間を Chrome の trace event 形式の JSON で取り出す
+ * 記録中でも取り出せる（取り出している間に上書きされた区間は含まない）
+ * @param json 出力先
+ * @return 出力した区間の数
+ */
+extern size_t TraceDump(std::string &json);
+
+/**
+ * 区間の記録（スコープを抜けるか end で記録する）
+ */
+class TraceSpan {
+public:
+	TraceSpan() : name(NULL) {}
+	TraceSpan(const char *name, long long arg=-1) : name(NULL) { begin(name, arg); }
+	~TraceSpan() { end(); }
+
+	/**
+	 * 区間の開始（記録中でなければ何もしない）
+	 */
+	void begin(const char *n, long long a=-1) {
+		end();
+		if (TraceEnabled()) {
+			name  = n;
+			arg   = a;
+			start = TraceNow();
+		}
+	}
+
+	/**
+	 * 区間の終了
+	 */
+	void end() {
+		if (name) {
+			TraceRecord(name, arg, start, TraceNow());
+			name = NULL;
+		}
+	}
+
+protected:
+	const char *name; //< 区間名（NULL なら記録しない）
+	long long arg;
+	unsigned long long start;
+};
+
+#endif
@@ -1,12 +1,30 @@
 #include "ncbind.hpp"
 #include "utils.hpp"
+#include "simd.hpp"
+#include "parallel.hpp"
 
 #include <vector>
 #include <cmath>
+#include <thread>
+#include <algorithm>
 
 //----------------------------------------------
 // レイヤイメージ操作ユーティリティ
 
+// PropGet 用のメンバ名ハッシュのヒント
+// エンジンが名前のハッシュ値をキャッシュするので，2回目以降は文字列のハッシュ計算が省かれる
+// （非同期保存ではワーカスレッドからもレイヤのプロパティを取得するので，ヒントはスレッドごとに持つ）
+static thread_local tjs_uint32 HintHasImage, HintImageWidth, HintImageHeight;
+static thread_local tjs_uint32 HintMainImageBuffer, HintMainImageBufferForWrite, HintMainImageBufferPitch;
+static thread_local tjs_uint32 HintProvinceImageBuffer, HintProvinceImageBufferPitch;
+
+// ヒント付きプロパティ取得
+static inline bool
+PropGetHint(iTJSDispatch2 *obj, const tjs_char *name, tjs_uint32 &hint, tTJSVariant &val)
+{
+	return TJS_SUCCEEDED(obj->PropGet(0, name, &hint, &val, obj));
+}
+
 /**
  * レイヤのサイズとバッファを取得する
  */
@@ -18,21 +36,21 @@ GetLayerSize(iTJSDispatch2 *lay, long &w, long &h, long *pitch)
 
 	// レイヤイメージは在るか？
 	tTJSVariant val;
-	if (TJS_FAILED(lay->PropGet(0, TJS_W("hasImage"), 0, &val, lay)) || (val.AsInteger() == 0)) return false;
+	if (!PropGetHint(lay, TJS_W("hasImage"), HintHasImage, val) || (val.AsInteger() == 0)) return false;
 
 	// レイヤサイズを取得
 	val.Clear();
-	if (TJS_FAILED(lay->PropGet(0, TJS_W("imageWidth"), 0, &val, lay))) return false;
+	if (!PropGetHint(lay, TJS_W("imageWidth"), HintImageWidth, val)) return false;
 	w = (long)val.AsInteger();
 
 	val.Clear();
-	if (TJS_FAILED(lay->PropGet(0, TJS_W("imageHeight"), 0, &val, lay))) return false;
+	if (!PropGetHint(lay, TJS_W("imageHeight"), HintImageHeight, val)) return false;
 	h = (long)val.AsInteger();
 
 	// ピッチ取得
 	if (pitch) {
 		val.Clear();
-		if (TJS_FAILED(lay->PropGet(0, TJS_W("mainImageBufferPitch"), 0, &val, lay))) return false;
+		if (!PropGetHint(lay, TJS_W("mainImageBufferPitch"), HintMainImageBufferPitch, val)) return false;
 		*pitch = (long)val.AsInteger();
 	}
 
@@ -48,7 +66,7 @@ GetLayerBufferAndSize(iTJSDispatch2 *lay, long &w, long &h, BufRefT &ptr, long &
 
 	// バッファ取得
 	tTJSVariant val;
-	if (TJS_FAILED(lay->PropGet(0, TJS_W("mainImageBuffer"), 0, &val, lay))) return false;
+	if (!PropGetHint(lay, TJS_W("mainImageBuffer"), HintMainImageBuffer, val)) return false;
 	ptr = reinterpret_cast<BufRefT>(val.AsInteger());
 	return  (ptr != 0);
 }
@@ -61,7 +79,7 @@ GetLayerBufferAndSize(iTJSDispatch2 *lay, long &w, long &h, WrtRefT &ptr, long &
 
 	// バッファ取得
 	tTJSVariant val;
-	if (TJS_FAILED(lay->PropGet(0, TJS_W("mainImageBufferForWrite"), 0, &val, lay))) return false;
+	if (!PropGetHint(lay, TJS_W("mainImageBufferForWrite"), HintMainImageBufferForWrite, val)) return false;
 	ptr = reinterpret_cast<WrtRefT>(val.AsInteger());
 	return  (ptr != 0);
 }
@@ -74,12 +92,12 @@ GetProvinceBufferAndSize(iTJSDispatch2 *lay, long &w, long &h, BufRefT &ptr, lon
 
 	// ピッチ取得
 	tTJSVariant val;
-	if (TJS_FAILED(lay->PropGet(0, TJS_W("provinceImageBufferPitch"), 0, &val, lay))) return false;
+	if (!PropGetHint(lay, TJS_W("provinceImageBufferPitch"), HintProvinceImageBufferPitch, val)) return false;
 	pitch = (long)val.AsInteger();
 
 	// バッファ取得
 	val.Clear();
-	if (TJS_FAILED(lay->PropGet(0, TJS_W("provinceImageBuffer"), 0, &val, lay))) return false;
+	if (!PropGetHint(lay, TJS_W("provinceImageBuffer"), HintProvinceImageBuffer, val)) return false;
 	ptr = reinterpret_cast<BufRefT>(val.AsInteger());
 	return  (ptr != 0);
 }
@@ -99,13 +117,116 @@ MakeResult(tTJSVariant *result, long x, long y, long w, long h)
 }
 
 /**
- * 不透明チェック関数
+ * mask のビットを持つピクセルの検索
+ * @param p 先頭ピクセル
+ * @param count ピクセル数
+ * @param mask 判定マスク(0xAARRGGBB)
+ * @return 見つかった位置（FindFirstPixel はなければ count，FindLastPixel はなければ -1）
+ */
+typedef long (*FindPixelKernel)(BufRefT p, long count, DWORD mask);
+
+// 範囲内で最初に mask のビットを持つピクセルを探す
+static long
+FindFirstPixelScalar(BufRefT p, long count, DWORD mask)
+{
+	for (long x = 0; x < count; x++) if (*(const DWORD*)(p + x*4) & mask) return x;
+	return count;
+}
+
+// 範囲内で最後に mask のビットを持つピクセルを探す
+static long
+FindLastPixelScalar(BufRefT p, long count, DWORD mask)
+{
+	for (long x = count; --x >= 0;) if (*(const DWORD*)(p + x*4) & mask) return x;
+	return -1;
+}
+
+#if LAYEREXSAVE_USE_SSE2
+static long
+FindFirstPixelSSE2(BufRefT p, long count, DWORD mask)
+{
+	long x = 0;
+	const __m128i m = _mm_set1_epi32((int)mask), z = _mm_setzero_si128();
+	for (; x + 4 <= count; x += 4) {
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + x*4)), m);
+		int bits = _mm_movemask_epi8(_mm_cmpeq_epi32(v, z)) ^ 0xFFFF;
+		if (bits) {
+			while (!(bits & 0xF)) bits >>= 4, x++;
+			return x;
+		}
+	}
+	return x + FindFirstPixelScalar(p + x*4, count - x, mask);
+}
+
+static long
+FindLastPixelSSE2(BufRefT p, long count, DWORD mask)
+{
+	long x = count;
+	const __m128i m = _mm_set1_epi32((int)mask), z = _mm_setzero_si128();
+	for (; x >= 4; x -= 4) {
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + (x-4)*4)), m);
+		int bits = _mm_movemask_epi8(_mm_cmpeq_epi32(v, z)) ^ 0xFFFF;
+		if (bits) {
+			x--;
+			while (!(bits & 0xF000)) bits <<= 4, x--;
+			return x;
+		}
+	}
+	return FindLastPixelScalar(p, x, mask);
+}
+#endif
+
+static SimdKernel<FindPixelKernel> FindFirstPixel(FindFirstPixelScalar);
+static SimdKernel<FindPixelKernel> FindLastPixel(FindLastPixelScalar);
+
+// 実行環境に合わせた検索カーネルの選択
+static void
+BindFindPixelKernel(uint32_t features)
+{
+	FindFirstPixel = FindFirstPixelScalar;
+	FindLastPixel  = FindLastPixelScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) {
+		FindFirstPixel = FindFirstPixelSSE2;
+		FindLastPixel  = FindLastPixelSSE2;
+	}
+#endif
+}
+static SimdBinder FindPixelBinder(BindFindPixelKernel);
+
+/**
+ * クロップ領域を求める
+ * 行単位で走査し，上下は見つかった時点で打ち切り，左右は各行で未確定の範囲だけを調べる
+ * @param mask 不透明判定マスク（アルファのみなら 0xFF000000，完全透明判定なら 0xFFFFFFFF）
+ * @return 全部透明なら false
  */
 static bool
-CheckTransp(BufRefT p, long next, long count)
+CalcCropRect(BufRefT r, long w, long h, long nl, DWORD mask, long &x1, long &y1, long &x2, long &y2)
 {
-	for (; count > 0; count--, p+=next) if (p[3] != 0) return true;
-	return false;
+	BufRefT p;
+	long x;
+
+	// 上から透明領域を調べる
+	for (y1 = 0, p = r; y1 < h; y1++, p += nl) if ((x1 = FindFirstPixel(p, w, mask)) < w) break;
+	if (y1 >= h) return false; // 全部透明
+	x2 = FindLastPixel(p, w, mask);
+
+	// 下から透明領域を調べる
+	for (y2 = h-1, p = r + y2*nl; y2 > y1; y2--, p -= nl) {
+		if ((x = FindFirstPixel(p, w, mask)) < w) {
+			if (x < x1) x1 = x;
+			if ((x = FindLastPixel(p, w, mask)) > x2) x2 = x;
+			break;
+		}
+	}
+
+	// 間の行で左右を広げる
+	for (long y = y1 + 1; y < y2 && (x1 > 0 || x2 < w-1); y++) {
+		p = r + y*nl;
+		if (x1 > 0) x1 = FindFirstPixel(p, x1, mask);
+		if (x2 < w-1 && (x = FindLastPixel(p + (x2+1)*4, w-x2-1, mask)) >= 0) x2 += x + 1;
+	}
+	return true;
 }
 
 /**
@@ -118,40 +239,24 @@ static tjs_error TJS_INTF_METHOD
 GetCropRect(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
 {
 	// レイヤバッファの取得
-	BufRefT p, r = 0;
-	long w, h, nl, nc = 4;
+	BufRefT r = 0;
+	long w, h, nl;
 	if (!GetLayerBufferAndSize(lay, w, h, r, nl))
 		TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
 
 	// 結果領域
-	long x1=0, y1=0, x2=w-1, y2=h-1;
+	long x1, y1, x2, y2;
 	result->Clear();
-
-	for (p=r;             x1 <  w; x1++,p+=nc) if (CheckTransp(p, nl,  h)) break; // 左から透明領域を調べる
-	/*                                      */ if (x1 >= w) return TJS_S_OK;      // 全部透明なら void を返す
-	for (p=r+x2*nc;       x2 >= 0; x2--,p-=nc) if (CheckTransp(p, nl,  h)) break; // 右から透明領域を調べる
-	/*                                      */ long rw = x2 - x1 + 1;             // 左右に挟まれた残りの幅
-	for (p=r+x1*nc;       y1 <  h; y1++,p+=nl) if (CheckTransp(p, nc, rw)) break; // 上から透明領域を調べる
-	for (p=r+x1*nc+y2*nl; y2 >= 0; y2--,p-=nl) if (CheckTransp(p, nc, rw)) break; // 下から透明領域を調べる
+	if (!CalcCropRect(r, w, h, nl, 0xFF000000, x1, y1, x2, y2)) return TJS_S_OK; // 全部透明なら void を返す
 
 	// 結果を辞書に返す
-	MakeResult(result, x1, y1, rw, y2 - y1 + 1);
+	MakeResult(result, x1, y1, x2 - x1 + 1, y2 - y1 + 1);
 
 	return TJS_S_OK;
 }
 
 NCB_ATTACH_FUNCTION(getCropRect, Layer, GetCropRect);
 
-/**
- * 不透明チェック関数
- */
-static bool
-CheckZerop(BufRefT p, long next, long count)
-{
-	for (; count > 0; count--, p+=next) if (p[3] != 0 || p[2] != 0 || p[1] != 0 || p[0] != 0) return true;
-	return false;
-}
-
 /**
  * レイヤイメージをクロップ（上下左右の完全透明部分を切り取る）したときのサイズを取得する
  *
@@ -162,24 +267,18 @@ static tjs_error TJS_INTF_METHOD
 GetCropRectZero(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
 {
 	// レイヤバッファの取得
-	BufRefT p, r = 0;
-	long w, h, nl, nc = 4;
+	BufRefT r = 0;
+	long w, h, nl;
 	if (!GetLayerBufferAndSize(lay, w, h, r, nl))
 		TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
 
 	// 結果領域
-	long x1=0, y1=0, x2=w-1, y2=h-1;
+	long x1, y1, x2, y2;
 	result->Clear();
-
-	for (p=r;             x1 <  w; x1++,p+=nc) if (CheckZerop(p, nl,  h)) break; // 左から透明領域を調べる
-	/*                                      */ if (x1 >= w) return TJS_S_OK;      // 全部透明なら void を返す
-	for (p=r+x2*nc;       x2 >= 0; x2--,p-=nc) if (CheckZerop(p, nl,  h)) break; // 右から透明領域を調べる
-	/*                                      */ long rw = x2 - x1 + 1;             // 左右に挟まれた残りの幅
-	for (p=r+x1*nc;       y1 <  h; y1++,p+=nl) if (CheckZerop(p, nc, rw)) break; // 上から透明領域を調べる
-	for (p=r+x1*nc+y2*nl; y2 >= 0; y2--,p-=nl) if (CheckZerop(p, nc, rw)) break; // 下から透明領域を調べる
+	if (!CalcCropRect(r, w, h, nl, 0xFFFFFFFF, x1, y1, x2, y2)) return TJS_S_OK; // 全部透明なら void を返す
 
 	// 結果を辞書に返す
-	MakeResult(result, x1, y1, rw, y2 - y1 + 1);
+	MakeResult(result, x1, y1, x2 - x1 + 1, y2 - y1 + 1);
 
 	return TJS_S_OK;
 }
@@ -249,6 +348,407 @@ GetDiffRect(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDis
 
 NCB_ATTACH_FUNCTION(getDiffRect, Layer, GetDiffRect);
 
+#if LAYEREXSAVE_USE_SSE2
+/**
+ * 4ピクセル分の色比較（IS_SAME_COLOR と同じ判定）
+ * @return 同じ色のピクセルは 0xFFFFFFFF，違う色は 0
+ */
+static inline __m128i
+SameColor4(__m128i a, __m128i b)
+{
+	const __m128i am = _mm_set1_epi32((int)0xFF000000);
+	__m128i eq = _mm_cmpeq_epi32(a, b);
+	__m128i az = _mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(a, b), am), _mm_setzero_si128()); // 両方とも完全透明
+	return _mm_or_si128(eq, az);
+}
+#endif
+
+/**
+ * 1ライン内の差分有無
+ */
+typedef bool (*CheckDiffKernel)(BufRefT p1, BufRefT p2, long count);
+
+static bool
+CheckDiffLineScalar(BufRefT p1, BufRefT p2, long count)
+{
+	for (long x = 0; x < count; x++, p1+=4, p2+=4)
+		if (!IS_SAME_COLOR( p1[3],p1[2],p1[1],p1[0],  p2[3],p2[2],p2[1],p2[0] )) return true;
+	return false;
+}
+
+#if LAYEREXSAVE_USE_SSE2
+static bool
+CheckDiffLineSSE2(BufRefT p1, BufRefT p2, long count)
+{
+	long x = 0;
+	for (; x + 4 <= count; x += 4) {
+		__m128i same = SameColor4(_mm_loadu_si128((const __m128i*)(p1 + x*4)),
+								  _mm_loadu_si128((const __m128i*)(p2 + x*4)));
+		if (_mm_movemask_epi8(same) != 0xFFFF) return true;
+	}
+	return CheckDiffLineScalar(p1 + x*4, p2 + x*4, count - x);
+}
+#endif
+
+static SimdKernel<CheckDiffKernel> CheckDiffLine(CheckDiffLineScalar);
+
+// 実行環境に合わせた差分判定カーネルの選択
+static void
+BindCheckDiffKernel(uint32_t features)
+{
+	CheckDiffLine = CheckDiffLineScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) CheckDiffLine = CheckDiffLineSSE2;
+#endif
+}
+static SimdBinder CheckDiffBinder(BindCheckDiffKernel);
+
+/**
+ * 差分矩形（タイル単位・右下は含まない）
+ */
+struct DiffRegion {
+	long x1, y1, x2, y2;
+	long area() const { return (x2 - x1) * (y2 - y1); }
+	DiffRegion merge(DiffRegion const &o) const {
+		DiffRegion r = { x1 < o.x1 ? x1 : o.x1, y1 < o.y1 ? y1 : o.y1, x2 > o.x2 ? x2 : o.x2, y2 > o.y2 ? y2 : o.y2 };
+		return r;
+	}
+};
+
+/**
+ * 差分タイルマップを矩形に変換する
+ * 横に連続する差分タイルをまとめ，同じ幅の矩形が縦に続く場合は連結する
+ * @param dirty 差分タイルマップ
+ * @param tw, th タイル数
+ * @param scale まとめるタイル数（scale x scale タイルを1セルとして扱う）
+ * @param regions 結果（タイル単位）
+ */
+static void
+MakeDiffRegions(std::vector<char> const &dirty, long tw, long th, long scale, std::vector<DiffRegion> &regions)
+{
+	long cw = (tw + scale - 1) / scale, ch = (th + scale - 1) / scale;
+	std::vector<char> cells(cw * ch, 0);
+	for (long ty = 0; ty < th; ty++)
+		for (long tx = 0; tx < tw; tx++)
+			if (dirty[ty*tw + tx]) cells[(ty/scale)*cw + tx/scale] = 1;
+
+	regions.clear();
+	std::vector<size_t> open, next; // 直前の行で伸ばせる矩形
+	for (long cy = 0; cy < ch; cy++) {
+		next.clear();
+		for (long cx = 0; cx < cw; ) {
+			if (!cells[cy*cw + cx]) { cx++; continue; }
+			long sx = cx;
+			while (cx < cw && cells[cy*cw + cx]) cx++;
+			long x1 = sx * scale, x2 = cx * scale < tw ? cx * scale : tw;
+			long y2 = (cy + 1) * scale < th ? (cy + 1) * scale : th;
+			size_t i;
+			for (i = 0; i < open.size(); i++) {
+				DiffRegion &r = regions[open[i]];
+				if (r.x1 == x1 && r.x2 == x2) { r.y2 = y2; break; }
+			}
+			if (i < open.size()) next.push_back(open[i]);
+			else {
+				DiffRegion r = { x1, cy * scale, x2, y2 };
+				next.push_back(regions.size());
+				regions.push_back(r);
+			}
+		}
+		open.swap(next);
+	}
+}
+
+/**
+ * 矩形数が上限以下になるまで，面積の増加が最も少ない組から統合する
+ */
+static void
+ReduceDiffRegions(std::vector<DiffRegion> &regions, size_t maxRects)
+{
+	while (regions.size() > maxRects) {
+		size_t bi = 0, bj = 1;
+		long best = -1;
+		for (size_t i = 0; i < regions.size(); i++) {
+			for (size_t j = i + 1; j < regions.size(); j++) {
+				long cost = regions[i].merge(regions[j]).area() - regions[i].area() - regions[j].area();
+				if (best < 0 || cost < best) best = cost, bi = i, bj = j;
+			}
+		}
+		regions[bi] = regions[bi].merge(regions[bj]);
+		regions.erase(regions.begin() + bj);
+	}
+}
+
+/**
+ * レイヤの差分領域を複数の矩形で取得する
+ *
+ * Layer.getDiffRegions = function(base, tileSize=32, maxRects=0, asOctet=false);
+ * @param base 差分元となるベース用の画像（インスタンス自身と同じ画像サイズであること）
+ * @param tileSize 比較単位となるタイルの大きさ(pixel)
+ * @param maxRects 返す矩形数の上限（0なら無制限）
+ * @param asOctet true なら差分タイルのビットマスク octet を返す
+ * @return [ %[ x, y, w, h ], ... ] 形式の配列（差分がなければ空配列），または octet
+ */
+static tjs_error TJS_INTF_METHOD
+GetDiffRegions(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	// 引数の数チェック
+	if (numparams < 1) return TJS_E_BADPARAMCOUNT;
+
+	iTJSDispatch2 *base = param[0]->AsObjectNoAddRef();
+	const long ts       = (numparams > 1 && param[1]->Type() != tvtVoid) ? (long)param[1]->AsInteger() : 32;
+	const long maxRects = (numparams > 2 && param[2]->Type() != tvtVoid) ? (long)param[2]->AsInteger() : 0;
+	const bool asOctet  = (numparams > 3 && param[3]->Type() != tvtVoid) ? param[3]->operator bool() : false;
+	if (ts <= 0 || maxRects < 0) return TJS_E_INVALIDPARAM;
+
+	// レイヤバッファの取得
+	BufRefT fr = 0, tr = 0;
+	long w, h, tnl, fw, fh, fnl;
+	if (!GetLayerBufferAndSize(lay,   w,  h, tr, tnl) || 
+		!GetLayerBufferAndSize(base, fw, fh, fr, fnl))
+		TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
+
+	// レイヤのサイズは同じか
+	if (w != fw || h != fh)
+		TVPThrowExceptionMessage(TJS_W("Different layer size."));
+
+	// 1パスで差分タイルを調べる（差分確定済みのタイルは飛ばす）
+	const long tw = (w + ts - 1) / ts, th = (h + ts - 1) / ts;
+	std::vector<char> dirty(tw * th, 0);
+	for (long y = 0; y < h; y++, fr += fnl, tr += tnl) {
+		char *row = &dirty[(y / ts) * tw];
+		for (long tx = 0, x = 0; tx < tw; tx++, x += ts) {
+			if (row[tx]) continue;
+			long cnt = (w - x) < ts ? (w - x) : ts;
+			if (CheckDiffLine(fr + x*4, tr + x*4, cnt)) row[tx] = 1;
+		}
+	}
+
+	if (asOctet) {
+		// ビットマスク（タイル番号 ty*タイル横数+tx のビットを LSB から詰める）
+		std::vector<tjs_uint8> bits((tw * th + 7) / 8, 0);
+		for (long i = 0; i < tw * th; i++) if (dirty[i]) bits[i >> 3] |= (tjs_uint8)(1 << (i & 7));
+		if (result) *result = tTJSVariant(&bits[0], (tjs_uint)bits.size());
+		return TJS_S_OK;
+	}
+
+	// 矩形化（上限が指定されていて大幅に超える場合はタイルを粗くしてからまとめる）
+	std::vector<DiffRegion> regions;
+	long scale = 1;
+	for (;;) {
+		MakeDiffRegions(dirty, tw, th, scale, regions);
+		size_t n = regions.size();
+		if (!maxRects || n <= (size_t)maxRects) break;
+		if ((n <= (size_t)maxRects * 4 && n <= 256) || (scale >= tw && scale >= th)) {
+			ReduceDiffRegions(regions, (size_t)maxRects);
+			break;
+		}
+		scale *= 2;
+	}
+
+	if (result) {
+		iTJSDispatch2 *arr = TJSCreateArrayObject();
+		if (!arr) return TJS_E_FAIL;
+		for (size_t i = 0; i < regions.size(); i++) {
+			DiffRegion const &r = regions[i];
+			long x1 = r.x1 * ts, y1 = r.y1 * ts;
+			long x2 = r.x2 * ts < w ? r.x2 * ts : w;
+			long y2 = r.y2 * ts < h ? r.y2 * ts : h;
+			tTJSVariant v;
+			MakeResult(&v, x1, y1, x2 - x1, y2 - y1);
+			arr->PropSetByNum(TJS_MEMBERENSURE, (tjs_int)i, &v, arr);
+		}
+		*result = tTJSVariant(arr, arr);
+		arr->Release();
+	}
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(getDiffRegions, Layer, GetDiffRegions);
+
+/**
+ * 行範囲を分割して共通の並列実行器で処理する
+ * スレッド数の4倍程度の塊に分けるので，行ごとの処理量に偏りがあってもならされる
+ * @param h 行数
+ * @param pixels 総ピクセル数（小さい場合は分割しない）
+ * @param func func(begin, end, index) 形式の処理（index はスレッド番号。同じ index で複数回呼ばれることがある）
+ */
+#define PARALLEL_MIN_PIXELS (1024*256)
+template <typename FUNC>
+static void
+ParallelRows(long h, long pixels, FUNC const &func)
+{
+	ParallelExecutor &executor = ParallelExecutor::instance();
+	const int n = executor.workers();
+	if (n <= 1 || pixels < PARALLEL_MIN_PIXELS) {
+		if (h > 0) func(0L, h, 0);
+		return;
+	}
+	const long grain = h / ((long)n * 4);
+	executor.run(h, grain > 0 ? grain : 1, [&](long begin, long end, int index) { func(begin, end, index); });
+}
+
+/**
+ * 行範囲を分割して集計する（ParallelRows と同じ分割で ParallelReduce を使う）
+ * @param init 初期値（combine の単位元であること）
+ * @param map map(begin, end) で行範囲の集計値を返す
+ * @param combine combine(a, b) で集計値をまとめる
+ */
+template <typename T, typename MAP, typename COMBINE>
+static T
+ParallelRowsReduce(long h, long pixels, T const &init, MAP const &map, COMBINE const &combine)
+{
+	const int n = ParallelExecutor::instance().workers();
+	if (n <= 1 || pixels < PARALLEL_MIN_PIXELS) {
+		return h > 0 ? combine(init, map(0L, h)) : init;
+	}
+	const long grain = h / ((long)n * 4);
+	return ParallelReduce(h, grain > 0 ? grain : 1, init, map, combine);
+}
+
+/**
+ * Layer.setParallelism = function(count=0);
+ * 画素処理に使うスレッド数を設定する（プラグイン全体で共通）
+ * @param count スレッド数（0:CPU数 1:並列化しない）
+ */
+static tjs_error TJS_INTF_METHOD
+SetParallelism(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	const tjs_int count = (numparams > 0 && param[0]->Type() != tvtVoid) ? (tjs_int)param[0]->AsInteger() : 0;
+	if (count < 0) return TJS_E_INVALIDPARAM;
+	ParallelExecutor::instance().setParallelism((int)count);
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(setParallelism, Layer, SetParallelism);
+
+/**
+ * Layer.getParallelism = function(actual=false);
+ * @param actual true なら実際に使われるスレッド数を返す（false なら設定値）
+ */
+static tjs_error TJS_INTF_METHOD
+GetParallelism(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	const bool actual = (numparams > 0 && param[0]->Type() != tvtVoid) ? param[0]->operator bool() : false;
+	ParallelExecutor &executor = ParallelExecutor::instance();
+	if (result) *result = (tjs_int)(actual ? executor.workers() : executor.getParallelism());
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(getParallelism, Layer, GetParallelism);
+
+/**
+ * Layer.getSimdFeatures = function(detected=false);
+ * @param detected true なら CPU が対応している機能，false なら実際に使っている機能を返す
+ * @return SIMD_* の組み合わせ（1:SSE2 2:SSSE3 4:SSE4.1 8:AVX2）
+ */
+static tjs_error TJS_INTF_METHOD
+GetSimdFeatures(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	const bool detected = (numparams > 0 && param[0]->Type() != tvtVoid) ? param[0]->operator bool() : false;
+	if (result) *result = (tjs_int)(detected ? SimdDetect() : SimdFeatures());
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(getSimdFeatures, Layer, GetSimdFeatures);
+
+/**
+ * Layer.setSimdFeatures = function(mask=void);
+ * 使う機能を制限する（検証用。0 でスカラ実装のみ，void で制限なし）
+ */
+static tjs_error TJS_INTF_METHOD
+SetSimdFeatures(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	const tjs_uint32 mask = (numparams > 0 && param[0]->Type() != tvtVoid) ? (tjs_uint32)param[0]->AsInteger() : (tjs_uint32)SIMD_ALL;
+	SimdSetMask(mask);
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(setSimdFeatures, Layer, SetSimdFeatures);
+
+/**
+ * 1ライン分のピクセル比較と塗りつぶし
+ * @return 違うピクセルの数
+ */
+typedef tTVInteger (*DiffPixelKernel)(BufRefT fp, WrtRefT tp, long w, DWORD scol, DWORD dcol, bool sfill, bool dfill);
+
+static tTVInteger
+DiffPixelLineScalar(BufRefT fp, WrtRefT tp, long w, DWORD scol, DWORD dcol, bool sfill, bool dfill)
+{
+	tTVInteger count = 0;
+	for (long x = 0; x < w; x++, fp+=4, tp+=4) {
+		bool same = IS_SAME_COLOR(fp[3],fp[2],fp[1],fp[0], tp[3],tp[2],tp[1],tp[0]);
+		if (      same &&     sfill) *(DWORD*)tp = scol;
+		else if (!same) { if (dfill) *(DWORD*)tp = dcol; count++; }
+	}
+	return count;
+}
+
+#if LAYEREXSAVE_USE_SSE2
+static tTVInteger
+DiffPixelLineSSE2(BufRefT fp, WrtRefT tp, long w, DWORD scol, DWORD dcol, bool sfill, bool dfill)
+{
+	tTVInteger count = 0;
+	long x = 0;
+	const __m128i sc = _mm_set1_epi32((int)scol), dc = _mm_set1_epi32((int)dcol);
+	for (; x + 4 <= w; x += 4, fp += 16, tp += 16) {
+		__m128i t = _mm_loadu_si128((const __m128i*)tp);
+		__m128i same = SameColor4(_mm_loadu_si128((const __m128i*)fp), t);
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(same));
+		count += 4 - ((mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1));
+		if ((sfill && mask) || (dfill && mask != 0xF)) {
+			if (sfill) t = _mm_or_si128(_mm_and_si128(same, sc), _mm_andnot_si128(same, t));
+			if (dfill) t = _mm_or_si128(_mm_andnot_si128(same, dc), _mm_and_si128(same, t));
+			_mm_storeu_si128((__m128i*)tp, t);
+		}
+	}
+	return count + DiffPixelLineScalar(fp, tp, w - x, scol, dcol, sfill, dfill);
+}
+#endif
+
+#if LAYEREXSAVE_USE_AVX2
+// 8ピクセルずつ比較（判定は SameColor4 と同じ）
+LAYEREXSAVE_TARGET_AVX2 static tTVInteger
+DiffPixelLineAVX2(BufRefT fp, WrtRefT tp, long w, DWORD scol, DWORD dcol, bool sfill, bool dfill)
+{
+	tTVInteger count = 0;
+	long x = 0;
+	const __m256i sc = _mm256_set1_epi32((int)scol), dc = _mm256_set1_epi32((int)dcol);
+	const __m256i am = _mm256_set1_epi32((int)0xFF000000), zero = _mm256_setzero_si256();
+	for (; x + 8 <= w; x += 8, fp += 32, tp += 32) {
+		__m256i f = _mm256_loadu_si256((const __m256i*)fp);
+		__m256i t = _mm256_loadu_si256((const __m256i*)tp);
+		__m256i same = _mm256_or_si256(_mm256_cmpeq_epi32(f, t),
+									   _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_or_si256(f, t), am), zero));
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(same));
+		int n = 0;
+		for (int m = mask; m; m &= m - 1) n++;
+		count += 8 - n;
+		if ((sfill && mask) || (dfill && mask != 0xFF)) {
+			if (sfill) t = _mm256_blendv_epi8(t, sc, same);
+			if (dfill) t = _mm256_blendv_epi8(dc, t, same);
+			_mm256_storeu_si256((__m256i*)tp, t);
+		}
+	}
+	return count + DiffPixelLineSSE2(fp, tp, w - x, scol, dcol, sfill, dfill);
+}
+#endif
+
+static SimdKernel<DiffPixelKernel> DiffPixelLine(DiffPixelLineScalar);
+
+// 実行環境に合わせた比較カーネルの選択
+static void
+BindDiffPixelKernel(uint32_t features)
+{
+	DiffPixelLine = DiffPixelLineScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) DiffPixelLine = DiffPixelLineSSE2;
+#endif
+#if LAYEREXSAVE_USE_AVX2
+	if (features & SIMD_AVX2) DiffPixelLine = DiffPixelLineAVX2;
+#endif
+}
+static SimdBinder DiffPixelBinder(BindDiffPixelKernel);
+
 /**
  * レイヤのピクセル比較を行う
  * 
@@ -282,9 +782,9 @@ GetDiffPixel(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDi
 	iTJSDispatch2 *base = param[0]->AsObjectNoAddRef();
 
 	// レイヤバッファの取得
-	BufRefT fp, fr = 0;
-	WrtRefT tp, tr = 0;
-	long w, h, tnl, fw, fh, fnl, nc = 4;
+	BufRefT fr = 0;
+	WrtRefT tr = 0;
+	long w, h, tnl, fw, fh, fnl;
 	if (!GetLayerBufferAndSize(lay,   w,  h, tr, tnl) || 
 		!GetLayerBufferAndSize(base, fw, fh, fr, fnl))
 		TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
@@ -293,14 +793,14 @@ GetDiffPixel(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDi
 	if (w != fw || h != fh)
 		TVPThrowExceptionMessage(TJS_W("Different layer size."));
 
-	// 塗りつぶし
-	for (long y = 0; (fp=fr, tp=tr, y < h); y++, fr+=fnl, tr+=tnl) {
-		for (long x = 0; x < w; x++, fp+=nc, tp+=nc) {
-			bool same = IS_SAME_COLOR(fp[3],fp[2],fp[1],fp[0], tp[3],tp[2],tp[1],tp[0]);
-			if (      same &&     sfill) *(DWORD*)tp = scol;
-			else if (!same) { if (dfill) *(DWORD*)tp = dcol; count++; }
+	// 塗りつぶし（行単位で分割して並列処理）
+	count = ParallelRowsReduce(h, w * h, (tTVInteger)0, [&](long begin, long end) {
+		tTVInteger cnt = 0;
+		for (long y = begin; y < end; y++) {
+			cnt += DiffPixelLine(fr + y*fnl, tr + y*tnl, w, scol, dcol, sfill, dfill);
 		}
-	}
+		return cnt;
+	}, [](tTVInteger a, tTVInteger b) { return a + b; });
 	if (result) *result = count;
 
 	return TJS_S_OK;
@@ -314,17 +814,149 @@ static inline void AddColor(DWORD &r, DWORD &g, DWORD &b, BufRefT p) {
 	r += p[2], g += p[1], b += p[0];
 }
 
+// oozeColor の処理モード
+enum {
+	OOZE_EXACT     = 0, //< 上下左右の処理済ピクセルの平均で1周ずつ引き伸ばす
+	OOZE_JUMPFLOOD = 1, //< 最寄りの不透明ピクセルの色をコピーする（近似）
+};
+
+/**
+ * 境界からの幅優先探索による引き伸ばし
+ * 前の周で処理したピクセルの隣だけを調べるので，1周ごとの全面走査が不要
+ * @param oozed 処理済マップ（-1:処理済 0:未処理 2:範囲外）
+ */
+static void
+OozeExact(WrtRefT r, long w, long h, long nl, char *oozed, int level)
+{
+	const long nc = 4, ow = w+2;
+	std::vector<long> frontier, next;
+
+	// 未処理領域に接している処理済ピクセルから開始
+	for (long y = 0; y < h; y++) {
+		long i = (y+1)*ow + 1;
+		for (long x = 0; x < w; x++, i++) {
+			if (oozed[i] < 0 && (!oozed[i-ow] || !oozed[i+ow] || !oozed[i-1] || !oozed[i+1]))
+				frontier.push_back(i);
+		}
+	}
+
+	for (int n = 0; n < level && !frontier.empty(); n++) {
+		// 次の周を集める
+		next.clear();
+		for (size_t k = 0; k < frontier.size(); k++) {
+			long i = frontier[k];
+			const long around[4] = { i-ow, i+ow, i-1, i+1 };
+			for (int j = 0; j < 4; j++) {
+				long a = around[j];
+				if (!oozed[a]) oozed[a] = 1, next.push_back(a);
+			}
+		}
+		// 処理済ピクセルの平均色で塗る（同じ周のピクセルは参照しない）
+		for (size_t k = 0; k < next.size(); k++) {
+			long i = next[k];
+			WrtRefT p = r + (i/ow - 1)*nl + (i%ow - 1)*nc;
+			DWORD cr = 0, cg = 0, cb = 0;
+			int cnt = 0;
+			if (oozed[i-ow] < 0) AddColor(cr, cg, cb, p-nl), cnt++;
+			if (oozed[i+ow] < 0) AddColor(cr, cg, cb, p+nl), cnt++;
+			if (oozed[i-1]  < 0) AddColor(cr, cg, cb, p-nc), cnt++;
+			if (oozed[i+1]  < 0) AddColor(cr, cg, cb, p+nc), cnt++;
+			p[2] = (unsigned char)(cr / cnt);
+			p[1] = (unsigned char)(cg / cnt);
+			p[0] = (unsigned char)(cb / cnt);
+		}
+		// 処理済マップの値を再設定
+		for (size_t k = 0; k < next.size(); k++) oozed[next[k]] = -1;
+		frontier.swap(next);
+	}
+}
+
+/**
+ * Jump Flooding による引き伸ばし
+ * 各ピクセルに最寄りの不透明ピクセルを O(w*h*log n) で求め，その色をコピーする
+ * @param oozed 処理済マップ（-1:処理済 0:未処理 2:範囲外）
+ * @param level 引き伸ばす最大距離(pixel)
+ */
+static void
+OozeJumpFlood(WrtRefT r, long w, long h, long nl, char *oozed, int level)
+{
+	// 最寄りの不透明ピクセルの位置（y*w+x。負なら未到達）
+	const long nc = 4, ow = w+2;
+	std::vector<tjs_int32> seed(w*h), work(w*h);
+	for (long y = 0; y < h; y++) {
+		for (long x = 0; x < w; x++) {
+			seed[y*w+x] = oozed[(y+1)*ow + x+1] < 0 ? (tjs_int32)(y*w+x) : -1;
+		}
+	}
+
+	// 最大距離をカバーできる最初の歩幅
+	long limit = w > h ? w : h;
+	if (level < limit) limit = level;
+	long step = 1;
+	while (step*2 <= limit) step *= 2;
+
+	// 歩幅を半分ずつにしながら伝搬（最後に歩幅1をもう一度行い精度を上げる）
+	for (bool extra = true; step > 0; ) {
+		const long s = step;
+		ParallelRows(h, w * h, [&](long begin, long end, int) {
+			for (long y = begin; y < end; y++) {
+				for (long x = 0; x < w; x++) {
+					tjs_int32 best = seed[y*w+x];
+					long long bd = -1;
+					if (best >= 0) {
+						long bx = best % w - x, by = best / w - y;
+						bd = (long long)bx*bx + (long long)by*by;
+					}
+					for (long ny = y-s; ny <= y+s; ny += s) {
+						if (ny < 0 || ny >= h) continue;
+						for (long nx = x-s; nx <= x+s; nx += s) {
+							if (nx < 0 || nx >= w) continue;
+							tjs_int32 c = seed[ny*w+nx];
+							if (c < 0 || c == best) continue;
+							long cx = c % w - x, cy = c / w - y;
+							long long d = (long long)cx*cx + (long long)cy*cy;
+							if (bd < 0 || d < bd) best = c, bd = d;
+						}
+					}
+					work[y*w+x] = best;
+				}
+			}
+		});
+		seed.swap(work);
+		if (step == 1 && extra) extra = false;
+		else step /= 2;
+	}
+
+	// 範囲内の未処理ピクセルに色をコピー
+	const long long maxd = (long long)level * level;
+	ParallelRows(h, w * h, [&](long begin, long end, int) {
+		for (long y = begin; y < end; y++) {
+			char   *o = oozed + (y+1)*ow + 1;
+			WrtRefT p = r + y*nl;
+			for (long x = 0; x < w; x++, o++, p+=nc) {
+				tjs_int32 c = seed[y*w+x];
+				if (*o || c < 0) continue;
+				long cx = c % w, cy = c / w;
+				if ((long long)(cx-x)*(cx-x) + (long long)(cy-y)*(cy-y) > maxd) continue;
+				BufRefT q = r + cy*nl + cx*nc;
+				p[2] = q[2], p[1] = q[1], p[0] = q[0];
+			}
+		}
+	});
+}
+
 /**
  * レイヤの淵の色を透明部分まで引き伸ばす（縮小時に偽色が出るのを防ぐ）
  * 
- * Layer.oozeColor = function(level, threshold=1);
- * @param level 処理を行う回数。大きいほど引き伸ばし領域が増える
+ * Layer.oozeColor = function(level, threshold=1, fillColor=0, mode=0);
+ * @param level 処理を行う回数。大きいほど引き伸ばし領域が増える（mode=1 では引き伸ばす最大距離）
 <<<<<<< HEAD
  * @param threshold アルファの閾値(1〜255)これより低いピクセルへ引き伸ばす
 =======
  * @param threshold アルファの閾値(1～255)これより低いピクセルへ引き伸ばす
 >>>>>>> work
  * @param fillColor 処理領域以外の塗りつぶし色
+ * @param mode 0:上下左右の平均で1周ずつ引き伸ばす 1:Jump Flooding で最寄りの色をコピーする（近似・高速）
  */
 static tjs_error TJS_INTF_METHOD
 OozeColor(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
@@ -336,6 +968,9 @@ OozeColor(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispa
 		TVPThrowExceptionMessage(TJS_W("Invalid level count."));
 	unsigned char threshold = (unsigned char)(numparams > 1 ? param[1]->AsInteger() : 1);
 	unsigned long fillColor = (unsigned long)(numparams > 2 ? param[2]->AsInteger() : 0);
+	int mode = (int)(numparams > 3 && param[3]->Type() != tvtVoid ? param[3]->AsInteger() : OOZE_EXACT);
+	if (mode != OOZE_EXACT && mode != OOZE_JUMPFLOOD)
+		TVPThrowExceptionMessage(TJS_W("Invalid ooze mode."));
 	unsigned char fillR = (unsigned char)((fillColor >> 16) & 0xff);
 	unsigned char fillG = (unsigned char)((fillColor >> 8) & 0xff);
 	unsigned char fillB = (unsigned char)((fillColor) & 0xff);
@@ -353,7 +988,7 @@ OozeColor(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispa
 	ow = w+2, oh = h+2; // oozed map のサイズ
 	char *o, *otop, *oozed = new char[ow*oh];
 	otop = oozed + ow + 1; // oozed map 左上
-	ZeroMemory(oozed, ow*oh); // クリア
+	memset(oozed, 2, ow*oh); // 範囲外で埋める
 	try {
 		// アルファマップを調べる
 		for (y = 0; y < h; y++) {
@@ -362,6 +997,7 @@ OozeColor(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispa
 			for (x = 0; x < w; x++, o++, p+=nc) {
 				if (p[3] >= threshold) *o = -1;
 				else {
+					*o = 0;
 					p[2] = fillR;
 					p[1] = fillG;
 					p[0] = fillB; // 閾値以下の不透明部分の色を指定色でクリア
@@ -370,37 +1006,8 @@ OozeColor(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispa
 		}
 
 		// 引き伸ばし処理
-		for (int i = 0; i < level; i++) {
-			bool L, R, U, D;
-			for (y = 0; y < h; y++) {
-				o = otop + y*ow;
-				p = r    + y*nl;
-				for (x = 0; x < w; x++, p+=nc, o++) {
-					// 未処理領域をチェック
-					if (!*o) {
-						DWORD cr = 0, cg = 0, cb = 0;
-						// 上下左右の領域をチェック
-						U=o[-ow]<0, D=o[ow]<0, L=o[-1]<0, R=o[1]<0;
-						if (U || D || L || R) {
-							int cnt = 0;
-							if (U) AddColor(cr, cg, cb, p-nl), cnt++;
-							if (D) AddColor(cr, cg, cb, p+nl), cnt++;
-							if (L) AddColor(cr, cg, cb, p-nc), cnt++;
-							if (R) AddColor(cr, cg, cb, p+nc), cnt++;
-							p[2] = (unsigned char)(cr / cnt);
-							p[1] = (unsigned char)(cg / cnt);
-							p[0] = (unsigned char)(cb / cnt);
-							*o = 1;
-						}
-					}
-				}
-			}
-			// 処理済マップの値を再設定
-			for (y = 0; y < h; y++) {
-				o = otop + y*ow;
-				for (x = 0; x < w; x++, o++) if (*o>0) *o=-1;
-			}
-		}
+		if (mode == OOZE_JUMPFLOOD) OozeJumpFlood(r, w, h, nl, oozed, level);
+		else                        OozeExact(r, w, h, nl, oozed, level);
 	} catch (...) {
 		delete[] oozed;
 		throw;
@@ -413,52 +1020,491 @@ OozeColor(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispa
 NCB_ATTACH_FUNCTION(oozeColor, Layer, OozeColor);
 
 /**
- * Layer.copyAlpha = function(src);
- * src の B値を α領域にコピーする
+ * チャネル入れ替え処理の指定
+ * 出力の各バイトについて，元ピクセルのどのバイトを使うかと，出力先の値を残すかを持つ
  */
-static tjs_error TJS_INTF_METHOD
-CopyBlueToAlpha(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
-{
-	if (numparams < 0) {
-		return TJS_E_BADPARAMCOUNT;
-	}
+struct SwizzleOp {
+	tjs_uint8 index[4]; //< 出力バイトごとの元バイト位置（SWIZZLE_ZERO なら 0）
+	DWORD full;         //< 0xFF で埋めるバイトのマスク
+	DWORD keep;         //< 出力先の値を残すバイトのマスク
+};
+#define SWIZZLE_ZERO (0x80)
 
-	// 読み込みもと
+typedef void (*SwizzleKernel)(BufRefT src, WrtRefT dst, long count, SwizzleOp const &op);
+
+// 1ピクセルずつ処理
+static void
+SwizzleLineScalar(BufRefT src, WrtRefT dst, long count, SwizzleOp const &op)
+{
+	for (long x = 0; x < count; x++, src += 4, dst += 4) {
+		DWORD out = 0;
+		for (int i = 0; i < 4; i++) {
+			if (!(op.index[i] & SWIZZLE_ZERO)) out |= (DWORD)src[op.index[i]] << (i * 8);
+		}
+		out |= op.full;
+		*(DWORD*)dst = (*(DWORD*)dst & op.keep) | (out & ~op.keep);
+	}
+}
+
+#if LAYEREXSAVE_USE_AVX2
+// pshufb 用の制御値（count ピクセル分）
+static inline void
+SwizzleControl(SwizzleOp const &op, tjs_uint8 *ctrl, int count)
+{
+	for (int k = 0; k < count; k++) {
+		for (int i = 0; i < 4; i++) {
+			tjs_uint8 n = op.index[i];
+			ctrl[k*4 + i] = (n & SWIZZLE_ZERO) ? SWIZZLE_ZERO : (tjs_uint8)((k & 3) * 4 + n);
+		}
+	}
+}
+
+// 4ピクセルずつ pshufb で入れ替え
+LAYEREXSAVE_TARGET_SSSE3 static void
+SwizzleLineSSSE3(BufRefT src, WrtRefT dst, long count, SwizzleOp const &op)
+{
+	tjs_uint8 c[16];
+	SwizzleControl(op, c, 4);
+	const __m128i ctrl = _mm_loadu_si128((const __m128i*)c);
+	const __m128i full = _mm_set1_epi32((int)op.full), keep = _mm_set1_epi32((int)op.keep);
+	long x = 0;
+	for (; x + 4 <= count; x += 4, src += 16, dst += 16) {
+		__m128i v = _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), ctrl), full);
+		__m128i d = _mm_loadu_si128((const __m128i*)dst);
+		_mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_and_si128(d, keep), _mm_andnot_si128(keep, v)));
+	}
+	SwizzleLineScalar(src, dst, count - x, op);
+}
+
+// 8ピクセルずつ vpshufb で入れ替え（128bit レーン内の入れ替えなのでピクセル単位の処理に使える）
+LAYEREXSAVE_TARGET_AVX2 static void
+SwizzleLineAVX2(BufRefT src, WrtRefT dst, long count, SwizzleOp const &op)
+{
+	tjs_uint8 c[32];
+	SwizzleControl(op, c, 8);
+	const __m256i ctrl = _mm256_loadu_si256((const __m256i*)c);
+	const __m256i full = _mm256_set1_epi32((int)op.full), keep = _mm256_set1_epi32((int)op.keep);
+	long x = 0;
+	for (; x + 8 <= count; x += 8, src += 32, dst += 32) {
+		__m256i v = _mm256_or_si256(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)src), ctrl), full);
+		__m256i d = _mm256_loadu_si256((const __m256i*)dst);
+		_mm256_storeu_si256((__m256i*)dst, _mm256_or_si256(_mm256_and_si256(d, keep), _mm256_andnot_si256(keep, v)));
+	}
+	SwizzleLineScalar(src, dst, count - x, op);
+}
+#endif
+
+static SimdKernel<SwizzleKernel> SwizzleLine(SwizzleLineScalar);
+
+// 実行環境に合わせた入れ替えカーネルの選択
+static void
+BindSwizzleKernel(uint32_t features)
+{
+	SwizzleLine = SwizzleLineScalar;
+#if LAYEREXSAVE_USE_AVX2
+	if (features & SIMD_SSSE3) SwizzleLine = SwizzleLineSSSE3;
+	if (features & SIMD_AVX2)  SwizzleLine = SwizzleLineAVX2;
+#endif
+}
+static SimdBinder SwizzleBinder(BindSwizzleKernel);
+
+/**
+ * 輝度を出力先のチャネルに書き込む（L = (77R + 150G + 29B + 128) >> 8）
+ */
+typedef void (*LuminanceKernel)(BufRefT src, WrtRefT dst, long count, DWORD keep);
+
+static void
+LuminanceLineScalar(BufRefT src, WrtRefT dst, long count, DWORD keep)
+{
+	for (long x = 0; x < count; x++, src += 4, dst += 4) {
+		DWORD l = (src[2] * 77 + src[1] * 150 + src[0] * 29 + 128) >> 8;
+		l *= 0x01010101;
+		*(DWORD*)dst = (*(DWORD*)dst & keep) | (l & ~keep);
+	}
+}
+
+#if LAYEREXSAVE_USE_SSE2
+static void
+LuminanceLineSSE2(BufRefT src, WrtRefT dst, long count, DWORD keep)
+{
+	long x = 0;
+	const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(128), k = _mm_set1_epi32((int)keep);
+	const __m128i weight = _mm_set_epi16(0, 77, 150, 29, 0, 77, 150, 29);
+	for (; x + 4 <= count; x += 4, src += 16, dst += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)src);
+		__m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weight));
+		__m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weight));
+		// (29B+150G) と 77R の組を足して 4ピクセル分の輝度にする
+		__m128i l = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2,0,2,0))),
+								  _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3,1,3,1))));
+		l = _mm_srli_epi32(_mm_add_epi32(l, round), 8);
+		l = _mm_or_si128(l, _mm_slli_epi32(l, 8));
+		l = _mm_or_si128(l, _mm_slli_epi32(l, 16));
+		__m128i d = _mm_loadu_si128((const __m128i*)dst);
+		_mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_and_si128(d, k), _mm_andnot_si128(k, l)));
+	}
+	LuminanceLineScalar(src, dst, count - x, keep);
+}
+#endif
+
+static SimdKernel<LuminanceKernel> LuminanceLine(LuminanceLineScalar);
+
+// 実行環境に合わせた輝度カーネルの選択
+static void
+BindLuminanceKernel(uint32_t features)
+{
+	LuminanceLine = LuminanceLineScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) LuminanceLine = LuminanceLineSSE2;
+#endif
+}
+static SimdBinder LuminanceBinder(BindLuminanceKernel);
+
+/**
+ * 矩形範囲のチャネル操作（行単位で並列処理）
+ * @param luminance true なら op の代わりに輝度を書き込む（op.keep のみ使用）
+ */
+static void
+SwizzleRect(iTJSDispatch2 *srclay, iTJSDispatch2 *dstlay, tjs_int numparams, tTJSVariant **param, int first, SwizzleOp const &op, bool luminance)
+{
+	// 読み込みもと
 	BufRefT sbuf = 0;
 	long sw, sh, spitch;
-	if (!GetLayerBufferAndSize(param[0]->AsObjectNoAddRef(), sw, sh, sbuf, spitch)) {
+	if (!GetLayerBufferAndSize(srclay, sw, sh, sbuf, spitch)) {
 		TVPThrowExceptionMessage(TJS_W("src must be Layer."));
 	}
 	// 書き込み先
 	WrtRefT dbuf = 0;
 	long dw, dh, dpitch;
-	if (!GetLayerBufferAndSize(lay, dw, dh, dbuf, dpitch)) {
+	if (!GetLayerBufferAndSize(dstlay, dw, dh, dbuf, dpitch)) {
 		TVPThrowExceptionMessage(TJS_W("dest must be Layer."));
 	}
 
-	// 小さい領域分
-	int w = (sw < dw ? sw : dw);
-	int h = sh < dh ? sh : dh;
-	// コピー
-	for (int i=0;i<h;i++) {
-		BufRefT p = sbuf;     // B領域
-		WrtRefT q = dbuf+3;   // A領域
-		for (int j=0;j<w;j++) {
-			*q = *p;
-			p += 4;
-			q += 4;
+	// 範囲（省略時は両レイヤの共通部分全体）
+	long w = sw < dw ? sw : dw;
+	long h = sh < dh ? sh : dh;
+	long left   = (numparams > first   && param[first  ]->Type() != tvtVoid) ? (long)param[first  ]->AsInteger() : 0;
+	long top    = (numparams > first+1 && param[first+1]->Type() != tvtVoid) ? (long)param[first+1]->AsInteger() : 0;
+	long width  = (numparams > first+2 && param[first+2]->Type() != tvtVoid) ? (long)param[first+2]->AsInteger() : w - left;
+	long height = (numparams > first+3 && param[first+3]->Type() != tvtVoid) ? (long)param[first+3]->AsInteger() : h - top;
+	if (left < 0) { width += left; left = 0; }
+	if (top  < 0) { height += top; top  = 0; }
+	long cut;
+	if ((cut = left + width  - w) > 0) width  -= cut;
+	if ((cut = top  + height - h) > 0) height -= cut;
+	if (width <= 0 || height <= 0) return;
+
+	sbuf += top * spitch + left * 4;
+	dbuf += top * dpitch + left * 4;
+	ParallelRows(height, width * height, [&](long begin, long end, int) {
+		for (long y = begin; y < end; y++) {
+			if (luminance) LuminanceLine(sbuf + y * spitch, dbuf + y * dpitch, width, op.keep);
+			else           SwizzleLine  (sbuf + y * spitch, dbuf + y * dpitch, width, op);
 		}
-		sbuf += spitch;
-		dbuf += dpitch;
+	});
+}
+
+// チャネル名からバイト位置を求める（不正なら -1）
+static int
+ChannelIndex(tjs_char ch)
+{
+	switch (ch) {
+	case 'b': case 'B': return 0;
+	case 'g': case 'G': return 1;
+	case 'r': case 'R': return 2;
+	case 'a': case 'A': return 3;
 	}
+	return -1;
+}
+
+/**
+ * Layer.copyBlueToAlpha = function(src);
+ * src の B値を α領域にコピーする
+ */
+static tjs_error TJS_INTF_METHOD
+CopyBlueToAlpha(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	if (numparams < 1) {
+		return TJS_E_BADPARAMCOUNT;
+	}
+	SwizzleOp op = { { 0, 1, 2, 0 }, 0, 0x00FFFFFF };
+	SwizzleRect(param[0]->AsObjectNoAddRef(), lay, 0, param, 0, op, false);
 	return TJS_S_OK;
 }
 
 NCB_ATTACH_FUNCTION(copyBlueToAlpha, Layer, CopyBlueToAlpha);
 
+/**
+ * Layer.copyChannel = function(src, srcChannel, dstChannel, left=0, top=0, width=void, height=void);
+ * src の指定チャネルを指定チャネル（複数可）にコピーする
+ * @param srcChannel "r" "g" "b" "a" のいずれか，または "l"（輝度）
+ * @param dstChannel コピー先チャネル名を並べた文字列（"a" や "rgb" など）
+ */
+static tjs_error TJS_INTF_METHOD
+CopyChannel(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	if (numparams < 3) {
+		return TJS_E_BADPARAMCOUNT;
+	}
+	ttstr schan = *param[1], dchan = *param[2];
+	if (schan.length() != 1 || dchan.length() == 0) return TJS_E_INVALIDPARAM;
+
+	const tjs_char sc = schan.c_str()[0];
+	const bool luminance = (sc == 'l' || sc == 'L');
+	const int from = luminance ? 0 : ChannelIndex(sc);
+	if (from < 0) return TJS_E_INVALIDPARAM;
+
+	// 指定外のチャネルは残す
+	SwizzleOp op = { { 0, 1, 2, 3 }, 0, 0xFFFFFFFF };
+	for (tjs_int i = 0; i < dchan.length(); i++) {
+		int to = ChannelIndex(dchan.c_str()[i]);
+		if (to < 0) return TJS_E_INVALIDPARAM;
+		op.index[to] = (tjs_uint8)from;
+		op.keep &= ~((DWORD)0xFF << (to * 8));
+	}
+	SwizzleRect(param[0]->AsObjectNoAddRef(), lay, numparams, param, 3, op, luminance);
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(copyChannel, Layer, CopyChannel);
+
+/**
+ * Layer.swizzle = function(src, map, left=0, top=0, width=void, height=void);
+ * src のチャネルを並べ替えて書き込む
+ * @param map 出力の r,g,b,a それぞれに使うチャネル名を並べた4文字の文字列
+ * （"r" "g" "b" "a" のほか "0" で 0，"1" で 255。例: "bgra" で R と B を入れ替え，"aaa1" でαを不透明なグレーに）
+ */
+static tjs_error TJS_INTF_METHOD
+Swizzle(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	if (numparams < 2) {
+		return TJS_E_BADPARAMCOUNT;
+	}
+	ttstr map = *param[1];
+	if (map.length() != 4) return TJS_E_INVALIDPARAM;
+
+	static const int order[4] = { 2, 1, 0, 3 }; // r,g,b,a の出力バイト位置
+	SwizzleOp op = { { 0, 1, 2, 3 }, 0, 0 };
+	for (int i = 0; i < 4; i++) {
+		const tjs_char ch = map.c_str()[i];
+		const int to = order[i];
+		if (ch == '0') {
+			op.index[to] = SWIZZLE_ZERO;
+		} else if (ch == '1') {
+			op.index[to] = SWIZZLE_ZERO;
+			op.full |= (DWORD)0xFF << (to * 8);
+		} else {
+			int from = ChannelIndex(ch);
+			if (from < 0) return TJS_E_INVALIDPARAM;
+			op.index[to] = (tjs_uint8)from;
+		}
+	}
+	SwizzleRect(param[0]->AsObjectNoAddRef(), lay, numparams, param, 2, op, false);
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(swizzle, Layer, Swizzle);
+
+/**
+ * ブランク判定（各ピクセルの先頭バイトが全て 0 か）
+ * @param p 先頭ピクセル
+ * @param count ピクセル数
+ */
+typedef bool (*BlankLineKernel)(BufRefT p, long count);
+
+static bool
+IsBlankLineScalar(BufRefT p, long count)
+{
+	for (long x = 0; x < count; x++, p += 4) {
+		if (*p) return false;
+	}
+	return true;
+}
+
+#if LAYEREXSAVE_USE_SSE2
+static bool
+IsBlankLineSSE2(BufRefT p, long count)
+{
+	long x = 0;
+	const __m128i mask = _mm_set1_epi32(0xFF), zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for (; x + 4 <= count; x += 4, p += 16) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)p));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(acc, mask), zero)) != 0xFFFF) return false;
+	return IsBlankLineScalar(p, count - x);
+}
+#endif
+
+static SimdKernel<BlankLineKernel> IsBlankLine(IsBlankLineScalar);
+
+// 実行環境に合わせたブランク判定カーネルの選択
+static void
+BindBlankLineKernel(uint32_t features)
+{
+	IsBlankLine = IsBlankLineScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) IsBlankLine = IsBlankLineSSE2;
+#endif
+}
+static SimdBinder BlankLineBinder(BindBlankLineKernel);
+
+/**
+ * isBlank 用の占有インデックス
+ * タイルごとの占有フラグと，その累積和を保持して矩形内の占有タイル数を O(1) で求める
+ */
+class LayerBlankIndex {
+
+protected:
+	long width, height, tile;
+	long tw, th;
+	std::vector<char> occupied;  //< タイルごとの占有フラグ
+	std::vector<tjs_int> counts; //< 占有タイル数の累積和 (tw+1)*(th+1)
+
+	// タイル範囲 [tx1,tx2)×[ty1,ty2) 内の占有タイル数
+	tjs_int countTiles(long tx1, long ty1, long tx2, long ty2) const {
+		if (tx1 >= tx2 || ty1 >= ty2) return 0;
+		const long stride = tw + 1;
+		return counts[ty2*stride + tx2] - counts[ty1*stride + tx2] - counts[ty2*stride + tx1] + counts[ty1*stride + tx1];
+	}
+
+public:
+	LayerBlankIndex(iTJSDispatch2 *objthis) : width(0), height(0), tile(0), tw(0), th(0) {}
+
+	// 既存インスタンスの取得（なければ NULL）
+	static LayerBlankIndex *findInstance(iTJSDispatch2 *objthis) {
+		return ncbInstanceAdaptor<LayerBlankIndex>::GetNativeInstance(objthis);
+	}
+
+	// インスタンス取得
+	static LayerBlankIndex *getInstance(iTJSDispatch2 *objthis) {
+		LayerBlankIndex *obj = findInstance(objthis);
+		if (!obj) {
+			obj = new LayerBlankIndex(objthis);
+			ncbInstanceAdaptor<LayerBlankIndex>::SetNativeInstance(objthis, obj);
+		}
+		return obj;
+	}
+
+	/**
+	 * インデックスが指定サイズの画像に対して有効か
+	 */
+	bool valid(long w, long h) const { return tile > 0 && w == width && h == height; }
+
+	/**
+	 * インデックスの作成
+	 * Layer.buildBlankIndex = function(tileSize=32);
+	 * 画像を書き換えた後は再度呼び出すか clearBlankIndex で破棄すること
+	 */
+	static tjs_error TJS_INTF_METHOD buildBlankIndexFunc(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis) {
+		const long ts = (numparams > 0 && param[0]->Type() != tvtVoid) ? (long)param[0]->AsInteger() : 32;
+		if (ts <= 0) return TJS_E_INVALIDPARAM;
+
+		BufRefT src = 0;
+		long w, h, nl;
+		if (!GetLayerBufferAndSize(objthis, w, h, src, nl))
+			TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
+
+		LayerBlankIndex *self = getInstance(objthis);
+		const long tw = (w + ts - 1) / ts, th = (h + ts - 1) / ts;
+		std::vector<char> occupied(tw * th, 0);
+		// タイル行単位で並列に走査（占有確定済みのタイルは飛ばす）
+		ParallelRows(th, w * h, [&](long begin, long end, int) {
+			for (long ty = begin; ty < end; ty++) {
+				char *row = &occupied[ty * tw];
+				const long y2 = (ty + 1) * ts < h ? (ty + 1) * ts : h;
+				for (long y = ty * ts; y < y2; y++) {
+					BufRefT p = src + y * nl;
+					for (long tx = 0, x = 0; tx < tw; tx++, x += ts) {
+						if (row[tx]) continue;
+						if (!IsBlankLine(p + x*4, (w - x) < ts ? (w - x) : ts)) row[tx] = 1;
+					}
+				}
+			}
+		});
+
+		const long stride = tw + 1;
+		std::vector<tjs_int> counts(stride * (th + 1), 0);
+		for (long ty = 0; ty < th; ty++) {
+			tjs_int run = 0;
+			for (long tx = 0; tx < tw; tx++) {
+				run += occupied[ty * tw + tx];
+				counts[(ty+1)*stride + tx+1] = counts[ty*stride + tx+1] + run;
+			}
+		}
+
+		self->width  = w;
+		self->height = h;
+		self->tile   = ts;
+		self->tw     = tw;
+		self->th     = th;
+		self->occupied.swap(occupied);
+		self->counts.swap(counts);
+		return TJS_S_OK;
+	}
+
+	/**
+	 * インデックスの破棄
+	 */
+	void clearBlankIndex() {
+		width = height = tile = tw = th = 0;
+		std::vector<char>().swap(occupied);
+		std::vector<tjs_int>().swap(counts);
+	}
+
+	/**
+	 * インデックスを使ったブランク判定（クリッピング済みの範囲を渡すこと）
+	 */
+	bool isBlank(BufRefT sbuf, long spitch, long left, long top, long width, long height) const {
+		const long right = left + width, bottom = top + height;
+		// 範囲にかかるタイルに占有タイルがなければブランク
+		const long tx1 = left / tile, ty1 = top / tile;
+		const long tx2 = (right + tile - 1) / tile, ty2 = (bottom + tile - 1) / tile;
+		if (!countTiles(tx1, ty1, tx2, ty2)) return true;
+		// 範囲に完全に含まれるタイルに占有タイルがあればブランクではない
+		const long ix1 = (left + tile - 1) / tile, iy1 = (top + tile - 1) / tile;
+		const long ix2 = (right  == this->width  ? tw : right  / tile);
+		const long iy2 = (bottom == this->height ? th : bottom / tile);
+		if (countTiles(ix1, iy1, ix2, iy2)) return false;
+		// 境界にかかる占有タイルだけ実際に調べる
+		for (long ty = ty1; ty < ty2; ty++) {
+			for (long tx = tx1; tx < tx2; tx++) {
+				if (!occupied[ty * tw + tx]) continue;
+				const long x1 = tx * tile > left   ? tx * tile : left;
+				const long y1 = ty * tile > top    ? ty * tile : top;
+				const long x2 = (tx + 1) * tile < right  ? (tx + 1) * tile : right;
+				const long y2 = (ty + 1) * tile < bottom ? (ty + 1) * tile : bottom;
+				for (long y = y1; y < y2; y++) {
+					if (!IsBlankLine(sbuf + y * spitch + x1 * 4, x2 - x1)) return false;
+				}
+			}
+		}
+		return true;
+	}
+};
+
+// インスタンスゲッタ
+NCB_GET_INSTANCE_HOOK(LayerBlankIndex)
+{
+	NCB_INSTANCE_GETTER(objthis) {
+		ClassT* obj = GetNativeInstance(objthis);
+		if (!obj) {
+			obj = new ClassT(objthis);
+			SetNativeInstance(objthis, obj);
+		}
+		return obj;
+	}
+};
+
+NCB_ATTACH_CLASS_WITH_HOOK(LayerBlankIndex, Layer) {
+	NCB_METHOD_RAW_CALLBACK(buildBlankIndex, LayerBlankIndex::buildBlankIndexFunc, 0);
+	NCB_METHOD(clearBlankIndex);
+};
+
 /**
  * Layer.isBlank = function(x,y,w,h);
  * 指定領域がブランクデータかどうか確認する
+ * buildBlankIndex でインデックスを作成済みならそれを使って判定する
  */
 static tjs_error TJS_INTF_METHOD
 isBlank(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis)
@@ -487,23 +1533,21 @@ isBlank(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatc
 	if ((cut = top  + height - sh) > 0) height -= cut;
 
 	// 範囲チェック
-	if (width >= 0 && height >= 0) {
-		// 判定処理
-		for (tjs_int y = top; y < top + height; y++) {
-			BufRefT buffer = sbuf + left * 4 + spitch * y;
-			for (tjs_int x = left; x < left + width; x++, buffer += 4) {
-				if (*buffer) {
-					if (result) {
-						*result = 0;
-					}
-					return TJS_S_OK;
-				}
+	bool blank = true;
+	if (width > 0 && height > 0) {
+		LayerBlankIndex *index = LayerBlankIndex::findInstance(objthis);
+		if (index && index->valid(sw, sh)) {
+			blank = index->isBlank(sbuf, spitch, left, top, width, height);
+		} else {
+			// 判定処理
+			for (tjs_int y = top; y < top + height && blank; y++) {
+				blank = IsBlankLine(sbuf + left * 4 + spitch * y, width);
 			}
 		}
 	}
 	
 	if (result) {
-		*result = 1;
+		*result = blank ? 1 : 0;
 	}
 	return TJS_S_OK;
 }
@@ -527,22 +1571,50 @@ clearAlpha(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDisp
 		TVPThrowExceptionMessage(TJS_W("dest must be Layer."));
 	}
 
-	// コピー
-	for (int i=0;i<h;i++) {
-		WrtRefT q = dbuf;   // A領域
-		for (int j=0;j<w;j++) {
-			if (q[3] <= threthold) {
-				*((unsigned long*)q) = fillColor;
+	// コピー（行単位で分割して並列処理）
+	ParallelRows(h, w * h, [&](long begin, long end, int) {
+		for (long i = begin; i < end; i++) {
+			WrtRefT q = dbuf + i * pitch;   // A領域
+			for (int j=0;j<w;j++) {
+				if (q[3] <= threthold) {
+					*((tjs_uint32*)q) = (tjs_uint32)fillColor;
+				}
+				q += 4;
 			}
-			q += 4;
 		}
-		dbuf += pitch;
-	}
+	});
 	return TJS_S_OK;
 }
 
 NCB_ATTACH_FUNCTION(clearAlpha, Layer, clearAlpha);
 
+/**
+ * チャンネル別の画素値の合計（メモリ上の並び順）
+ */
+struct ColorSum {
+	tTVInteger v[4];
+	ColorSum() { v[0] = v[1] = v[2] = v[3] = 0; }
+	ColorSum operator+(ColorSum const &o) const {
+		ColorSum r;
+		for (int i = 0; i < 4; i++) r.v[i] = v[i] + o.v[i];
+		return r;
+	}
+};
+
+/**
+ * 合計から平均色を求める（getAverageColor / getRegionStats 共通）
+ * 各チャンネルの平均を切り捨て，メモリ上の先頭のチャンネルから上位バイトに詰める
+ * @param sum チャンネル別の合計
+ * @param count 画素数
+ */
+static DWORD
+AverageColor(ColorSum const &sum, double count)
+{
+	DWORD color = 0;
+	for (int i = 0; i < 4; i++) color |= ((DWORD)((double)sum.v[i] / count) & 0xff) << ((3 - i) * 8);
+	return color;
+}
+
 /**
  * Layer.getAverageColor = function(x,y,w,h);
  * 指定領域の平均色を返す
@@ -577,30 +1649,23 @@ getAverageColor(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJ
 	if (width <= 0 || height <= 0) 
 		TVPThrowExceptionMessage(L"invalid layer range");
 
-	double a = 0;
-	double r = 0;
-	double g = 0;
-	double b = 0;
 	double size = width * height;
-	
-	// 値取得
-	for (tjs_int y = top; y < top + height; y++) {
-		BufRefT buffer = sbuf + left * 4 + spitch * y;
-		for (tjs_int x = left; x < left + width; x++, buffer += 4) {
-			a += buffer[0];
-			r += buffer[1];
-			g += buffer[2];
-			b += buffer[3];
-		}
-	}
-	a /= size;
-	r /= size;
-	g /= size;
-	b /= size;
-	DWORD color = (((DWORD)a & 0xff) << 24 |
-								 ((DWORD)r & 0xff) << 16 |
-								 ((DWORD)g & 0xff) << 8 |
-								 ((DWORD)b & 0xff) << 0);
+
+	// 値取得（行単位で分割して整数で集計するので，分割数によらず結果は同じ）
+	const ColorSum sum = ParallelRowsReduce(height, width * height, ColorSum(), [&](long begin, long end) {
+		ColorSum s;
+		for (long y = top + begin; y < top + end; y++) {
+			BufRefT buffer = sbuf + left * 4 + spitch * y;
+			for (tjs_int x = left; x < left + width; x++, buffer += 4) {
+				s.v[0] += buffer[0];
+				s.v[1] += buffer[1];
+				s.v[2] += buffer[2];
+				s.v[3] += buffer[3];
+			}
+		}
+		return s;
+	}, [](ColorSum const &a, ColorSum const &b) { return a + b; });
+	DWORD color = AverageColor(sum, size);
   if (result) {
 	  *result = (tjs_int)color;
 	}
@@ -610,12 +1675,363 @@ getAverageColor(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJ
 NCB_ATTACH_FUNCTION(getAverageColor, Layer, getAverageColor);
 
 /**
- * Layer.getFingerPrintValue = function(ignore_transparent=true);
+ * 積分画像の1ライン作成
+ * @param p 元ピクセル
+ * @param above 上のラインの累積和
+ * @param out 出力先（先頭の1点分は 0 のまま）
+ * @param sqabove 上のラインの二乗累積和（NULLなら二乗は作らない）
+ * @param sqout 二乗の出力先
+ */
+typedef void (*StatsLineKernel)(BufRefT p, long w, tjs_uint64 const *above, tjs_uint64 *out, tjs_uint64 const *sqabove, tjs_uint64 *sqout);
+
+static void
+BuildStatsLineScalar(BufRefT p, long w, tjs_uint64 const *above, tjs_uint64 *out, tjs_uint64 const *sqabove, tjs_uint64 *sqout)
+{
+	above += 4, out += 4;
+	if (sqabove) sqabove += 4, sqout += 4;
+	tjs_uint64 run[4] = {0,0,0,0}, sq[4] = {0,0,0,0};
+	for (long x = 0; x < w; x++, p += 4, above += 4, out += 4) {
+		for (int c = 0; c < 4; c++) {
+			run[c] += p[c];
+			out[c] = above[c] + run[c];
+			if (sqabove) {
+				sq[c] += (tjs_uint64)p[c] * p[c];
+				sqout[c] = sqabove[c] + sq[c];
+			}
+		}
+		if (sqabove) sqabove += 4, sqout += 4;
+	}
+}
+
+#if LAYEREXSAVE_USE_SSE2
+static void
+BuildStatsLineSSE2(BufRefT p, long w, tjs_uint64 const *above, tjs_uint64 *out, tjs_uint64 const *sqabove, tjs_uint64 *sqout)
+{
+	above += 4, out += 4;
+	if (sqabove) sqabove += 4, sqout += 4;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i run0 = zero, run1 = zero, sq0 = zero, sq1 = zero; // BG / RA の行内累積
+	for (long x = 0; x < w; x++, p += 4, above += 4, out += 4) {
+		int pixel;
+		memcpy(&pixel, p, 4);
+		__m128i v16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero);
+		__m128i v32 = _mm_unpacklo_epi16(v16, zero);
+		run0 = _mm_add_epi64(run0, _mm_unpacklo_epi32(v32, zero));
+		run1 = _mm_add_epi64(run1, _mm_unpackhi_epi32(v32, zero));
+		_mm_storeu_si128((__m128i*)(out  ), _mm_add_epi64(run0, _mm_loadu_si128((const __m128i*)(above  ))));
+		_mm_storeu_si128((__m128i*)(out+2), _mm_add_epi64(run1, _mm_loadu_si128((const __m128i*)(above+2))));
+		if (sqabove) {
+			__m128i s32 = _mm_madd_epi16(v32, v32); // 各32bitに c*c
+			sq0 = _mm_add_epi64(sq0, _mm_unpacklo_epi32(s32, zero));
+			sq1 = _mm_add_epi64(sq1, _mm_unpackhi_epi32(s32, zero));
+			_mm_storeu_si128((__m128i*)(sqout  ), _mm_add_epi64(sq0, _mm_loadu_si128((const __m128i*)(sqabove  ))));
+			_mm_storeu_si128((__m128i*)(sqout+2), _mm_add_epi64(sq1, _mm_loadu_si128((const __m128i*)(sqabove+2))));
+			sqabove += 4, sqout += 4;
+		}
+	}
+}
+#endif
+
+static SimdKernel<StatsLineKernel> BuildStatsLine(BuildStatsLineScalar);
+
+// 実行環境に合わせた積分画像カーネルの選択
+static void
+BindStatsLineKernel(uint32_t features)
+{
+	BuildStatsLine = BuildStatsLineScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) BuildStatsLine = BuildStatsLineSSE2;
+#endif
+}
+static SimdBinder StatsLineBinder(BindStatsLineKernel);
+
+/**
+ * 領域統計用キャッシュ
+ * チャネルごとの積分画像（左上からの累積和）を保持し，任意矩形の合計を O(1) で返す
+ */
+class LayerStatsCache {
+
+protected:
+	long width, height;
+	std::vector<tjs_uint64> sums;    //< (width+1)*(height+1) 点 × BGRA の累積和
+	std::vector<tjs_uint64> squares; //< 同じく二乗の累積和（分散用。未作成なら空）
+
+	// 矩形の合計（BGRA順）
+	static void regionSum(std::vector<tjs_uint64> const &table, long stride, long x1, long y1, long x2, long y2, tjs_uint64 *sum) {
+		tjs_uint64 const *t = &table[0];
+		tjs_uint64 const *a = t + (y1 * stride + x1) * 4, *b = t + (y1 * stride + x2) * 4;
+		tjs_uint64 const *c = t + (y2 * stride + x1) * 4, *d = t + (y2 * stride + x2) * 4;
+		for (int i = 0; i < 4; i++) sum[i] = d[i] - b[i] - c[i] + a[i];
+	}
+
+public:
+	LayerStatsCache(iTJSDispatch2 *objthis) : width(0), height(0) {}
+
+	/**
+	 * キャッシュが指定サイズの画像に対して有効か
+	 */
+	bool valid(long w, long h) const { return !sums.empty() && w == width && h == height; }
+
+	// インスタンス取得
+	static LayerStatsCache *getInstance(iTJSDispatch2 *objthis) {
+		LayerStatsCache *obj = ncbInstanceAdaptor<LayerStatsCache>::GetNativeInstance(objthis);
+		if (!obj) {
+			obj = new LayerStatsCache(objthis);
+			ncbInstanceAdaptor<LayerStatsCache>::SetNativeInstance(objthis, obj);
+		}
+		return obj;
+	}
+
+	/**
+	 * キャッシュの作成
+	 * Layer.buildStatsCache = function(variance=false);
+	 * 画像を書き換えた後は再度呼び出すこと
+	 * @param variance 分散も求められるようにする（メモリ使用量が倍になる）
+	 */
+	static tjs_error TJS_INTF_METHOD buildStatsCacheFunc(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis) {
+		const bool variance = (numparams > 0 && param[0]->Type() != tvtVoid) ? param[0]->operator bool() : false;
+
+		BufRefT src = 0;
+		long w, h, nl;
+		if (!GetLayerBufferAndSize(objthis, w, h, src, nl))
+			TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
+
+		LayerStatsCache *self = getInstance(objthis);
+		const long stride = w + 1;
+		self->width  = w;
+		self->height = h;
+		self->sums.assign(stride * (h + 1) * 4, 0);
+		if (variance) self->squares.assign(stride * (h + 1) * 4, 0);
+		else          std::vector<tjs_uint64>().swap(self->squares);
+
+		for (long y = 0; y < h; y++, src += nl) {
+			long o = y * stride * 4;
+			if (variance) BuildStatsLine(src, w, &self->sums[o], &self->sums[o + stride*4], &self->squares[o], &self->squares[o + stride*4]);
+			else          BuildStatsLine(src, w, &self->sums[o], &self->sums[o + stride*4], NULL, NULL);
+		}
+		return TJS_S_OK;
+	}
+
+	/**
+	 * キャッシュの破棄
+	 */
+	void clearStatsCache() {
+		width = height = 0;
+		std::vector<tjs_uint64>().swap(sums);
+		std::vector<tjs_uint64>().swap(squares);
+	}
+
+	/**
+	 * 領域の統計値を返す
+	 * Layer.getRegionStats = function(x, y, w, h);
+	 * @return %[ count, color, sum, mean, variance ] 形式の辞書
+	 * color は平均色（getAverageColor と同じ値），sum/mean/variance は [a, r, g, b] の配列（variance はキャッシュ作成時に指定した場合のみ）
+	 */
+	static tjs_error TJS_INTF_METHOD getRegionStatsFunc(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis) {
+		if (numparams < 4) return TJS_E_BADPARAMCOUNT;
+
+		BufRefT src = 0;
+		long w, h, nl;
+		if (!GetLayerBufferAndSize(objthis, w, h, src, nl))
+			TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
+
+		// キャッシュ作成後にレイヤのサイズが変わっていたら使えない
+		LayerStatsCache *self = getInstance(objthis);
+		if (self->sums.empty())
+			TVPThrowExceptionMessage(TJS_W("Stats cache is not built."));
+		if (!self->valid(w, h))
+			TVPThrowExceptionMessage(TJS_W("Stats cache is out of date."));
+
+		tjs_int left   = *param[0];
+		tjs_int top    = *param[1];
+		tjs_int width  = *param[2];
+		tjs_int height = *param[3];
+
+		// キャッシュ範囲でクリッピング
+		if (left < 0) { width += left; left = 0; }
+		if (top  < 0) { height += top; top  = 0; }
+		tjs_int cut;
+		if ((cut = left + width  - self->width)  > 0) width  -= cut;
+		if ((cut = top  + height - self->height) > 0) height -= cut;
+
+		// 範囲チェック
+		if (width <= 0 || height <= 0) 
+			TVPThrowExceptionMessage(L"invalid layer range");
+
+		const long stride = self->width + 1;
+		const double count = (double)width * height;
+		tjs_uint64 sum[4], sq[4];
+		regionSum(self->sums, stride, left, top, left + width, top + height, sum);
+		const bool variance = !self->squares.empty();
+		if (variance) regionSum(self->squares, stride, left, top, left + width, top + height, sq);
+
+		if (result) {
+			static const int order[4] = { 3, 2, 1, 0 }; // BGRA -> [a, r, g, b]
+			iTJSDispatch2 *sarr = TJSCreateArrayObject();
+			iTJSDispatch2 *marr = TJSCreateArrayObject();
+			iTJSDispatch2 *varr = variance ? TJSCreateArrayObject() : NULL;
+			ColorSum total;
+			for (int i = 0; i < 4; i++) {
+				const int c = order[i];
+				const double mean = (double)sum[c] / count;
+				tTJSVariant v;
+				v = (tTVInteger)sum[c]; sarr->PropSetByNum(TJS_MEMBERENSURE, i, &v, sarr);
+				v = mean;               marr->PropSetByNum(TJS_MEMBERENSURE, i, &v, marr);
+				if (varr) {
+					double var = (double)sq[c] / count - mean * mean;
+					v = var > 0 ? var : 0.0; varr->PropSetByNum(TJS_MEMBERENSURE, i, &v, varr);
+				}
+				total.v[c] = (tTVInteger)sum[c];
+			}
+			const DWORD color = AverageColor(total, count);
+			ncbDictionaryAccessor dict;
+			dict.SetValue(TJS_W("count"), (tTVInteger)width * height);
+			dict.SetValue(TJS_W("color"), (tTVInteger)color);
+			dict.SetValue(TJS_W("sum"),  tTJSVariant(sarr, sarr));
+			dict.SetValue(TJS_W("mean"), tTJSVariant(marr, marr));
+			if (varr) dict.SetValue(TJS_W("variance"), tTJSVariant(varr, varr));
+			sarr->Release();
+			marr->Release();
+			if (varr) varr->Release();
+			*result = dict;
+		}
+		return TJS_S_OK;
+	}
+};
+
+// インスタンスゲッタ
+NCB_GET_INSTANCE_HOOK(LayerStatsCache)
+{
+	NCB_INSTANCE_GETTER(objthis) {
+		ClassT* obj = GetNativeInstance(objthis);
+		if (!obj) {
+			obj = new ClassT(objthis);
+			SetNativeInstance(objthis, obj);
+		}
+		return obj;
+	}
+};
+
+NCB_ATTACH_CLASS_WITH_HOOK(LayerStatsCache, Layer) {
+	NCB_METHOD_RAW_CALLBACK(buildStatsCache, LayerStatsCache::buildStatsCacheFunc, 0);
+	NCB_METHOD_RAW_CALLBACK(getRegionStats,  LayerStatsCache::getRegionStatsFunc,  0);
+	NCB_METHOD(clearStatsCache);
+};
+
+/**
+ * Layer.getFingerPrintValue = function(ignore_transparent=true, mode=0);
  * 比較用のハッシュ値を返す（同値の場合においてもgetDiffPixelなどを使って厳密に比較すること）
+ * @param mode 0:FNV-1a（従来の値） 1:多レーンの高速ハッシュ（xxHash64 相当。値は mode=0 と異なる）
  */
 #define FNV_1A_BASIS64 (0xCBF29CE484222325uLL)
 #define FNV_1A_PRIME64 (0x00000100000001B3uLL)
 static inline tjs_uint64 fnv_1a_hash(tjs_uint8 n, tjs_uint64 hash) { return (hash ^ n) * FNV_1A_PRIME64; }
+
+enum {
+	FINGERPRINT_FNV1A = 0,
+	FINGERPRINT_WIDE  = 1,
+};
+
+#define WIDE_HASH_PRIME1 (0x9E3779B185EBCA87uLL)
+#define WIDE_HASH_PRIME2 (0xC2B2AE3D27D4EB4FuLL)
+#define WIDE_HASH_PRIME3 (0x165667B19E3779F9uLL)
+#define WIDE_HASH_PRIME4 (0x85EBCA77C2B2AE63uLL)
+static inline tjs_uint64 WideHashRotl(tjs_uint64 x, int r) { return (x << r) | (x >> (64 - r)); }
+static inline tjs_uint64 WideHashRound(tjs_uint64 acc, tjs_uint64 input) {
+	return WideHashRotl(acc + input * WIDE_HASH_PRIME2, 31) * WIDE_HASH_PRIME1;
+}
+static inline tjs_uint64 WideHashMerge(tjs_uint64 acc, tjs_uint64 val) {
+	return (acc ^ WideHashRound(0, val)) * WIDE_HASH_PRIME1 + WIDE_HASH_PRIME4;
+}
+
+/**
+ * 8ピクセル分(32byte)を4レーンの64bit値として取り出す
+ * @param lazy 完全透明ピクセルを 0 とみなす
+ */
+static inline void
+WideHashLoadScalar(BufRefT p, bool lazy, tjs_uint64 *lane)
+{
+	DWORD *d = (DWORD*)lane;
+	memcpy(d, p, 32);
+	if (lazy) for (int i = 0; i < 8; i++) if (!(d[i] >> 24)) d[i] = 0;
+}
+
+#if LAYEREXSAVE_USE_SSE2
+static inline void
+WideHashLoadSSE2(BufRefT p, bool lazy, tjs_uint64 *lane)
+{
+	__m128i a = _mm_loadu_si128((const __m128i*)(p   ));
+	__m128i b = _mm_loadu_si128((const __m128i*)(p+16));
+	if (lazy) {
+		const __m128i amask = _mm_set1_epi32((int)0xFF000000), zero = _mm_setzero_si128();
+		a = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(a, amask), zero), a);
+		b = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(b, amask), zero), b);
+	}
+	_mm_storeu_si128((__m128i*)(lane  ), a);
+	_mm_storeu_si128((__m128i*)(lane+2), b);
+}
+#endif
+
+/**
+ * 画像全体の高速ハッシュ
+ * 4本の独立した 64bit 乗算列で 32byte ずつ処理するので FNV-1a のような1byte毎の依存がない
+ * @param LOAD 8ピクセル分の読み込み処理（実装によらず同じ値になる）
+ */
+typedef tjs_uint64 (*WideHashKernel)(BufRefT src, long w, long h, long nl, bool lazy);
+
+template <void (*LOAD)(BufRefT, bool, tjs_uint64*)>
+static tjs_uint64
+WideHashImageT(BufRefT src, long w, long h, long nl, bool lazy)
+{
+	tjs_uint64 v[4] = { WIDE_HASH_PRIME1 + WIDE_HASH_PRIME2, WIDE_HASH_PRIME2, 0, 0 - WIDE_HASH_PRIME1 };
+	for (long y = 0; y < h; ++y, src += nl) {
+		BufRefT p = src;
+		long x = 0;
+		for (; x + 8 <= w; x += 8, p += 32) {
+			tjs_uint64 lane[4];
+			LOAD(p, lazy, lane);
+			v[0] = WideHashRound(v[0], lane[0]);
+			v[1] = WideHashRound(v[1], lane[1]);
+			v[2] = WideHashRound(v[2], lane[2]);
+			v[3] = WideHashRound(v[3], lane[3]);
+		}
+		// 行末の端数は2ピクセルずつ
+		for (int i = 0; x < w; x += 2, p += 8, i++) {
+			DWORD c0 = *(const DWORD*)p, c1 = (x + 1 < w) ? *(const DWORD*)(p+4) : 0;
+			if (lazy) {
+				if (!(c0 >> 24)) c0 = 0;
+				if (!(c1 >> 24)) c1 = 0;
+			}
+			v[i] = WideHashRound(v[i], (tjs_uint64)c0 | ((tjs_uint64)c1 << 32));
+		}
+	}
+	tjs_uint64 hash = WideHashRotl(v[0], 1) + WideHashRotl(v[1], 7) + WideHashRotl(v[2], 12) + WideHashRotl(v[3], 18);
+	for (int i = 0; i < 4; i++) hash = WideHashMerge(hash, v[i]);
+
+	// 最後に大きさを混ぜる
+	hash += (tjs_uint64)w * h * 4;
+	hash = WideHashMerge(hash, ((tjs_uint64)(DWORD)w << 32) | (DWORD)h);
+	hash ^= hash >> 33;
+	hash *= WIDE_HASH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= WIDE_HASH_PRIME3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+static SimdKernel<WideHashKernel> WideHashImage(WideHashImageT<WideHashLoadScalar>);
+
+// 実行環境に合わせたハッシュカーネルの選択
+static void
+BindWideHashKernel(uint32_t features)
+{
+	WideHashImage = WideHashImageT<WideHashLoadScalar>;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) WideHashImage = WideHashImageT<WideHashLoadSSE2>;
+#endif
+}
+static SimdBinder WideHashBinder(BindWideHashKernel);
+
 static tjs_error TJS_INTF_METHOD
 GetFingerPrintValue(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
 {
@@ -627,6 +2043,14 @@ GetFingerPrintValue(tTJSVariant *result, tjs_int numparams, tTJSVariant **param,
 	// 完全透明カラーの比較有無
 	const bool lazy = (numparams > 0 && param[0]->Type() != tvtVoid) ? param[0]->operator bool() : true;
 
+	// ハッシュ方式
+	const int mode = (numparams > 1 && param[1]->Type() != tvtVoid) ? (int)param[1]->AsInteger() : FINGERPRINT_FNV1A;
+	if (mode == FINGERPRINT_WIDE) {
+		if (result) *result = (tTVInteger)WideHashImage(src, w, h, nl, lazy);
+		return TJS_S_OK;
+	}
+	if (mode != FINGERPRINT_FNV1A) return TJS_E_INVALIDPARAM;
+
 	tjs_uint64 hash = FNV_1A_BASIS64;
 
 	for (long y = 0; y < h; ++y, src += nl) {
@@ -665,18 +2089,141 @@ GetFingerPrintValue(tTJSVariant *result, tjs_int numparams, tTJSVariant **param,
 
 NCB_ATTACH_FUNCTION(getFingerPrintValue, Layer, GetFingerPrintValue);
 
+/**
+ * Layer.getTileHashesOctet = function(tileW=32, tileH=tileW, ignore_transparent=true);
+ * タイルごとのハッシュ値を返す（getFingerPrintValue の mode=1 と同じ方式をタイル単位で適用）
+ * @return タイル横数*タイル縦数*8 byte の octet（左上から行順に 64bit リトルエンディアンで格納）
+ */
+static tjs_error TJS_INTF_METHOD
+GetTileHashesOctet(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
+{
+	const long tsw  = (numparams > 0 && param[0]->Type() != tvtVoid) ? (long)param[0]->AsInteger() : 32;
+	const long tsh  = (numparams > 1 && param[1]->Type() != tvtVoid) ? (long)param[1]->AsInteger() : tsw;
+	const bool lazy = (numparams > 2 && param[2]->Type() != tvtVoid) ? param[2]->operator bool() : true;
+	if (tsw <= 0 || tsh <= 0) return TJS_E_INVALIDPARAM;
+
+	BufRefT src = 0;
+	long w, h, nl;
+	if (!GetLayerBufferAndSize(lay, w, h, src, nl))
+		TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
+
+	// タイル単位で並列処理（横長の画像でも分割できる）
+	const long tw = (w + tsw - 1) / tsw, th = (h + tsh - 1) / tsh;
+	std::vector<tjs_uint8> hashes(tw * th * 8);
+	ParallelTiles(w, h, tsw, tsh, w * h < PARALLEL_MIN_PIXELS ? tw * th : 1, [&](long x, long y, long bw, long bh, int) {
+		tjs_uint64 hash = WideHashImage(src + y*nl + x*4, bw, bh, nl, lazy);
+		tjs_uint8 *out = &hashes[((y / tsh) * tw + x / tsw) * 8];
+		for (int i = 0; i < 8; i++) out[i] = (tjs_uint8)(hash >> (i * 8));
+	});
+	if (result) *result = tTJSVariant(&hashes[0], (tjs_uint)hashes.size());
+	return TJS_S_OK;
+}
+
+NCB_ATTACH_FUNCTION(getTileHashesOctet, Layer, GetTileHashesOctet);
+
 
 /**
- * Layer.getShrinkVectorOctet = function(w, h);
+ * Layer.getShrinkVectorOctet = function(w=16, h=16, mode=0);
  * 縮小ベクトルを返す
+ * @param mode 0:完全透明以外の単純平均 1:α乗算済みの平均 2:αで重み付けした平均
+ */
+enum {
+	SHRINK_PLAIN         = 0,
+	SHRINK_PREMULTIPLIED = 1,
+	SHRINK_ALPHAWEIGHTED = 2,
+};
+#define SHRINK_SPILL_PIXELS (16384) //< 重み付き集計で32bitが溢れない単位
+
+/**
+ * ブロック集計の1ライン分（連続した count ピクセル）
+ * BlockSumLine は完全透明を除いた BGRA の単純和，BlockWeightedLine は BGR に c*α，A に α*255 を加算する
+ * （BlockWeightedLine の count は SHRINK_SPILL_PIXELS 以下であること）
  */
-static inline DWORD calcBlockSum(BufRefT src, long const w, long const h, long const nc, long const nl) {
+typedef void (*BlockSumKernel)(BufRefT p, long count, DWORD *s);
+typedef void (*BlockWeightedKernel)(BufRefT p, long count, tjs_uint64 *s);
+
+static void
+BlockSumLineScalar(BufRefT p, long count, DWORD *s)
+{
+	for (long x = 0; x < count; ++x, p += 4) {
+		if (p[3]) s[0]+=p[0], s[1]+=p[1], s[2]+=p[2], s[3]+=p[3];
+	}
+}
+
+static void
+BlockWeightedLineScalar(BufRefT p, long count, tjs_uint64 *s)
+{
+	for (long x = 0; x < count; ++x, p += 4) {
+		DWORD const a = p[3];
+		s[0]+=p[0]*a, s[1]+=p[1]*a, s[2]+=p[2]*a, s[3]+=a*255;
+	}
+}
+
+#if LAYEREXSAVE_USE_SSE2
+// 4ピクセルずつ（完全透明はマスクして）32bit×4ch に加算
+static void
+BlockSumLineSSE2(BufRefT p, long count, DWORD *s)
+{
+	long x = 0;
+	const __m128i amask = _mm_set1_epi32((int)0xFF000000), zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for (; x + 4 <= count; x += 4, p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		v = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(v, amask), zero), v);
+		__m128i t = _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero));
+		acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(t, zero), _mm_unpackhi_epi16(t, zero)));
+	}
+	DWORD a[4];
+	_mm_storeu_si128((__m128i*)a, acc);
+	s[0]+=a[0], s[1]+=a[1], s[2]+=a[2], s[3]+=a[3];
+	BlockSumLineScalar(p, count - x, s);
+}
+
+// 2ピクセルずつ 16bit の積を 32bit×4ch に加算
+static void
+BlockWeightedLineSSE2(BufRefT p, long count, tjs_uint64 *s)
+{
+	long x = 0;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgb  = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i full = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	__m128i acc = zero;
+	for (; x + 2 <= count; x += 2, p += 8) {
+		__m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+		__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+		__m128i m = _mm_mullo_epi16(v, _mm_or_si128(_mm_and_si128(a, rgb), full));
+		acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(m, zero), _mm_unpackhi_epi16(m, zero)));
+	}
+	DWORD t[4];
+	_mm_storeu_si128((__m128i*)t, acc);
+	s[0]+=t[0], s[1]+=t[1], s[2]+=t[2], s[3]+=t[3];
+	BlockWeightedLineScalar(p, count - x, s);
+}
+#endif
+
+static SimdKernel<BlockSumKernel>      BlockSumLine(BlockSumLineScalar);
+static SimdKernel<BlockWeightedKernel> BlockWeightedLine(BlockWeightedLineScalar);
+
+// 実行環境に合わせたブロック集計カーネルの選択
+static void
+BindBlockSumKernel(uint32_t features)
+{
+	BlockSumLine      = BlockSumLineScalar;
+	BlockWeightedLine = BlockWeightedLineScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) {
+		BlockSumLine      = BlockSumLineSSE2;
+		BlockWeightedLine = BlockWeightedLineSSE2;
+	}
+#endif
+}
+static SimdBinder BlockSumBinder(BindBlockSumKernel);
+
+static inline DWORD calcBlockSum(BufRefT src, long const w, long const h, long const nl) {
 	DWORD s[4] = {0,0,0,0}, total = 0;
 	for (long y = 0; y < h; ++y, src += nl) {
-		BufRefT p = src;
-		for (long x = 0; x < w; ++x,p+=nc,++total) {
-			if (p[3]) s[0]+=p[0], s[1]+=p[1], s[2]+=p[2], s[3]+=p[3];
-		}
+		BlockSumLine(src, w, s);
+		total += w;
 	}
 	DWORD const bias = total>>1;
 	return (((((s[0] + bias) / total) & 0xFF)      ) |
@@ -684,37 +2231,146 @@ static inline DWORD calcBlockSum(BufRefT src, long const w, long const h, long c
 			((((s[2] + bias) / total) & 0xFF) << 16) |
 			((((s[3] + bias) / total) & 0xFF) << 24));
 }
+
+/**
+ * αで重み付けしたブロック集計
+ * BGR は c*α，A は α*255 を集計して α乗算済み平均またはα重み付き平均を求める
+ */
+static inline DWORD calcBlockSumWeighted(BufRefT src, long const w, long const h, long const nl, int const mode) {
+	tjs_uint64 s[4] = {0,0,0,0};
+	for (long y = 0; y < h; ++y, src += nl) {
+		for (long x = 0; x < w; x += SHRINK_SPILL_PIXELS) {
+			BlockWeightedLine(src + x*4, (w - x) > SHRINK_SPILL_PIXELS ? SHRINK_SPILL_PIXELS : w - x, s);
+		}
+	}
+	tjs_uint64 const total = (tjs_uint64)w * h * 255;
+	tjs_uint64 const asum  = s[3] / 255; // Σα
+	DWORD c[4];
+	for (int i = 0; i < 4; i++) {
+		tjs_uint64 const div = (i < 3 && mode == SHRINK_ALPHAWEIGHTED) ? asum : total;
+		c[i] = div ? (DWORD)((s[i] + (div>>1)) / div) : 0;
+	}
+	return ((c[0] & 0xFF)      ) |
+		   ((c[1] & 0xFF) <<  8) |
+		   ((c[2] & 0xFF) << 16) |
+		   ((c[3] & 0xFF) << 24);
+}
+
+/**
+ * 縮小ベクトルの作成
+ * @param parallel ブロック行を並列処理する
+ */
+static void
+MakeShrinkVector(BufRefT src, long w, long h, long nl, long svw, long svh, int mode, bool parallel, std::vector<DWORD> &vector)
+{
+	const long nc = 4;
+	const long step_w = (w + svw - 1)/ svw;
+	const long step_h = (h + svh - 1)/ svh;
+	const long cols = (w + step_w - 1) / step_w;
+	const long rows = (h + step_h - 1) / step_h;
+
+	vector.resize(cols * rows);
+	ParallelRows(rows, parallel ? w * h : 0, [&](long begin, long end, int) {
+		for (long by = begin; by < end; by++) {
+			const long y  = by * step_h;
+			const long bh = (h - y) > step_h ? step_h : (h - y);
+			BufRefT p = src + y * nl;
+			for (long bx = 0, x = 0; bx < cols; bx++, x += step_w, p += nc * step_w) {
+				const long bw = (w - x) > step_w ? step_w : (w - x);
+				vector[by * cols + bx] = (mode == SHRINK_PLAIN) ? calcBlockSum(p, bw, bh, nl) : calcBlockSumWeighted(p, bw, bh, nl, mode);
+			}
+		}
+	});
+}
+
 static tjs_error TJS_INTF_METHOD
 GetShrinkVectorOctet(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *lay)
 {
 	const tjs_int svw = (numparams > 0 && param[0]->Type() != tvtVoid) ? (tjs_int)*param[0] : 16;
 	const tjs_int svh = (numparams > 1 && param[1]->Type() != tvtVoid) ? (tjs_int)*param[1] : 16;
-	if (svw <= 0 || svh < 0) return TJS_E_INVALIDPARAM;
+	const int mode    = (numparams > 2 && param[2]->Type() != tvtVoid) ? (int)param[2]->AsInteger() : SHRINK_PLAIN;
+	if (svw <= 0 || svh <= 0) return TJS_E_INVALIDPARAM;
+	if (mode < SHRINK_PLAIN || mode > SHRINK_ALPHAWEIGHTED) return TJS_E_INVALIDPARAM;
 
 	BufRefT src = 0;
-	long w, h, nl, nc = 4;
+	long w, h, nl;
 	if (!GetLayerBufferAndSize(lay, w, h, src, nl))
 		TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
 
-	const long step_w = (w + svw - 1)/ svw;
-	const long step_h = (h + svh - 1)/ svh;
-	const long next_block = nc * step_w;
-	const long next_line  = nl * step_h;
-
 	std::vector<DWORD> vector;
-	for (long y = 0; y < h; y+=step_h, src += next_line) {
-		BufRefT p = src;
-		const long bh = (h - y) > step_h ? step_h : (h - y);
-		for (long x = 0; x < w; x+=step_w,p+=next_block) {
-			const long bw = (w - x) > step_w ? step_w : (w - x);
-			vector.push_back(calcBlockSum(p, bw, bh, nc, nl));
-		}
-	}
+	MakeShrinkVector(src, w, h, nl, svw, svh, mode, true, vector);
 	if (result) *result = tTJSVariant(reinterpret_cast<tjs_uint8*>(&vector.front()), (tjs_uint)(vector.size() * sizeof(DWORD)));
 	return TJS_S_OK;
 }
 NCB_ATTACH_FUNCTION(getShrinkVectorOctet, Layer, GetShrinkVectorOctet);
 
+/**
+ * Layer.getShrinkVectorsOctet = function(layers, w=16, h=16, mode=0, packed=false);
+ * 複数レイヤの縮小ベクトルをまとめて返す（レイヤ単位で並列処理）
+ * @param layers レイヤの配列
+ * @param packed true なら全ベクトルを連結した1つの octet を返す（全て同じ長さであること）
+ * @return octet の配列，または連結した octet
+ */
+static tjs_error TJS_INTF_METHOD
+GetShrinkVectorsOctet(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *objthis)
+{
+	if (numparams < 1) return TJS_E_BADPARAMCOUNT;
+	const tjs_int svw   = (numparams > 1 && param[1]->Type() != tvtVoid) ? (tjs_int)*param[1] : 16;
+	const tjs_int svh   = (numparams > 2 && param[2]->Type() != tvtVoid) ? (tjs_int)*param[2] : 16;
+	const int mode      = (numparams > 3 && param[3]->Type() != tvtVoid) ? (int)param[3]->AsInteger() : SHRINK_PLAIN;
+	const bool packed   = (numparams > 4 && param[4]->Type() != tvtVoid) ? param[4]->operator bool() : false;
+	if (svw <= 0 || svh <= 0) return TJS_E_INVALIDPARAM;
+	if (mode < SHRINK_PLAIN || mode > SHRINK_ALPHAWEIGHTED) return TJS_E_INVALIDPARAM;
+
+	// バッファの取得はメインスレッドで行う
+	struct Source { BufRefT src; long w, h, nl; };
+	iTJSDispatch2 *layers = param[0]->AsObjectNoAddRef();
+	tTJSVariant val;
+	if (!layers || TJS_FAILED(layers->PropGet(0, TJS_W("count"), 0, &val, layers))) return TJS_E_INVALIDPARAM;
+	const tjs_int count = (tjs_int)val.AsInteger();
+	std::vector<Source> sources(count);
+	double pixels = 0;
+	for (tjs_int i = 0; i < count; i++) {
+		tTJSVariant v;
+		layers->PropGetByNum(0, i, &v, layers);
+		Source &s = sources[i];
+		if (v.Type() != tvtObject || !GetLayerBufferAndSize(v.AsObjectNoAddRef(), s.w, s.h, s.src, s.nl))
+			TVPThrowExceptionMessage(TJS_W("Invalid layer image."));
+		pixels += (double)s.w * s.h;
+	}
+
+	std::vector< std::vector<DWORD> > vectors(count);
+	ParallelRows(count, pixels < PARALLEL_MIN_PIXELS ? 0 : PARALLEL_MIN_PIXELS, [&](long begin, long end, int) {
+		for (long i = begin; i < end; i++) {
+			Source const &s = sources[i];
+			MakeShrinkVector(s.src, s.w, s.h, s.nl, svw, svh, mode, false, vectors[i]);
+		}
+	});
+
+	if (!result) return TJS_S_OK;
+	if (packed) {
+		std::vector<DWORD> all;
+		for (tjs_int i = 0; i < count; i++) {
+			if (vectors[i].size() != vectors[0].size())
+				TVPThrowExceptionMessage(TJS_W("Different vector size."));
+			all.insert(all.end(), vectors[i].begin(), vectors[i].end());
+		}
+		if (all.empty()) *result = tTJSVariant((const tjs_uint8*)NULL, 0);
+		else             *result = tTJSVariant(reinterpret_cast<tjs_uint8*>(&all.front()), (tjs_uint)(all.size() * sizeof(DWORD)));
+	} else {
+		iTJSDispatch2 *arr = TJSCreateArrayObject();
+		if (!arr) return TJS_E_FAIL;
+		for (tjs_int i = 0; i < count; i++) {
+			tTJSVariant v(reinterpret_cast<tjs_uint8*>(&vectors[i].front()), (tjs_uint)(vectors[i].size() * sizeof(DWORD)));
+			arr->PropSetByNum(TJS_MEMBERENSURE, i, &v, arr);
+		}
+		*result = tTJSVariant(arr, arr);
+		arr->Release();
+	}
+	return TJS_S_OK;
+}
+NCB_ATTACH_FUNCTION(getShrinkVectorsOctet, Layer, GetShrinkVectorsOctet);
+
 /**
  * Math.octetDot = function(oct_a,oct_b);
  * octetの各要素を0-255のベクトルとみなして内積を取る
@@ -725,6 +2381,155 @@ struct VectorSumWork {
 	size_t diff;
 	VectorSumWork() : csum((T)0), dsum((T)0), nsum1((T)0), nsum2((T)0), psum1((T)0), psum2((T)0), diff(0) {}
 };
+
+/**
+ * octet 演算の集計結果（b 省略時は b=0 として扱う）
+ */
+struct OctetSums {
+	tjs_uint64 csum, dsum, nsum1, nsum2, psum1, psum2, same;
+};
+typedef void (*OctetSumKernel)(const tjs_uint8 *a, const tjs_uint8 *b, tjs_uint n, OctetSums &s);
+
+// 1要素ずつ集計
+static void
+OctetSumScalar(const tjs_uint8 *a, const tjs_uint8 *b, tjs_uint n, OctetSums &s)
+{
+	for (tjs_uint i = 0; i < n; ++i) {
+		tjs_uint64 const va = a[i];
+		tjs_uint64 const vb = b ? b[i] : 0;
+		tjs_uint64 const vd = (va > vb) ? (va - vb) : (vb - va);
+		s.csum  += va * vb;
+		s.dsum  += vd * vd;
+		s.nsum1 += va;
+		s.nsum2 += vb;
+		s.psum1 += va * va;
+		s.psum2 += vb * vb;
+		if (va == vb) ++s.same;
+	}
+}
+
+// 32bit 積和が溢れる前に 64bit へ移すまでのブロック数
+#define OCTET_SPILL_BLOCKS (4096)
+
+#if LAYEREXSAVE_USE_SSE2
+// 32bit×4 を 64bit×2 に加算
+static inline __m128i OctetSpill(__m128i acc, __m128i v) {
+	const __m128i zero = _mm_setzero_si128();
+	return _mm_add_epi64(acc, _mm_add_epi64(_mm_unpacklo_epi32(v, zero), _mm_unpackhi_epi32(v, zero)));
+}
+static inline tjs_uint64 OctetHorizontal(__m128i v) {
+	tjs_uint64 t[2];
+	_mm_storeu_si128((__m128i*)t, v);
+	return t[0] + t[1];
+}
+
+// 16byte 単位で集計（pmaddwd で積和，psadbw で単純和）
+static void
+OctetSumSSE2(const tjs_uint8 *a, const tjs_uint8 *b, tjs_uint n, OctetSums &s)
+{
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+	__m128i c64 = zero, d64 = zero, p1_64 = zero, p2_64 = zero, n1 = zero, n2 = zero, eq = zero;
+	tjs_uint i = 0;
+	while (i + 16 <= n) {
+		__m128i c32 = zero, d32 = zero, p1 = zero, p2 = zero;
+		for (int k = 0; k < OCTET_SPILL_BLOCKS && i + 16 <= n; k++, i += 16) {
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i vb = b ? _mm_loadu_si128((const __m128i*)(b + i)) : zero;
+			__m128i vd = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+			__m128i al = _mm_unpacklo_epi8(va, zero), ah = _mm_unpackhi_epi8(va, zero);
+			__m128i bl = _mm_unpacklo_epi8(vb, zero), bh = _mm_unpackhi_epi8(vb, zero);
+			__m128i dl = _mm_unpacklo_epi8(vd, zero), dh = _mm_unpackhi_epi8(vd, zero);
+			c32 = _mm_add_epi32(c32, _mm_add_epi32(_mm_madd_epi16(al, bl), _mm_madd_epi16(ah, bh)));
+			d32 = _mm_add_epi32(d32, _mm_add_epi32(_mm_madd_epi16(dl, dl), _mm_madd_epi16(dh, dh)));
+			p1  = _mm_add_epi32(p1,  _mm_add_epi32(_mm_madd_epi16(al, al), _mm_madd_epi16(ah, ah)));
+			p2  = _mm_add_epi32(p2,  _mm_add_epi32(_mm_madd_epi16(bl, bl), _mm_madd_epi16(bh, bh)));
+			n1  = _mm_add_epi64(n1,  _mm_sad_epu8(va, zero));
+			n2  = _mm_add_epi64(n2,  _mm_sad_epu8(vb, zero));
+			eq  = _mm_add_epi64(eq,  _mm_sad_epu8(_mm_and_si128(_mm_cmpeq_epi8(va, vb), one), zero));
+		}
+		c64   = OctetSpill(c64,   c32);
+		d64   = OctetSpill(d64,   d32);
+		p1_64 = OctetSpill(p1_64, p1);
+		p2_64 = OctetSpill(p2_64, p2);
+	}
+	s.csum  += OctetHorizontal(c64);
+	s.dsum  += OctetHorizontal(d64);
+	s.psum1 += OctetHorizontal(p1_64);
+	s.psum2 += OctetHorizontal(p2_64);
+	s.nsum1 += OctetHorizontal(n1);
+	s.nsum2 += OctetHorizontal(n2);
+	s.same  += OctetHorizontal(eq);
+	OctetSumScalar(a + i, b ? b + i : 0, n - i, s);
+}
+#endif
+
+#if LAYEREXSAVE_USE_AVX2
+LAYEREXSAVE_TARGET_AVX2 static inline __m256i OctetSpill256(__m256i acc, __m256i v) {
+	const __m256i zero = _mm256_setzero_si256();
+	return _mm256_add_epi64(acc, _mm256_add_epi64(_mm256_unpacklo_epi32(v, zero), _mm256_unpackhi_epi32(v, zero)));
+}
+LAYEREXSAVE_TARGET_AVX2 static inline tjs_uint64 OctetHorizontal256(__m256i v) {
+	tjs_uint64 t[4];
+	_mm256_storeu_si256((__m256i*)t, v);
+	return t[0] + t[1] + t[2] + t[3];
+}
+
+// 32byte 単位で集計（SSE2 版と同じ手順を 256bit で行う）
+LAYEREXSAVE_TARGET_AVX2 static void
+OctetSumAVX2(const tjs_uint8 *a, const tjs_uint8 *b, tjs_uint n, OctetSums &s)
+{
+	const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+	__m256i c64 = zero, d64 = zero, p1_64 = zero, p2_64 = zero, n1 = zero, n2 = zero, eq = zero;
+	tjs_uint i = 0;
+	while (i + 32 <= n) {
+		__m256i c32 = zero, d32 = zero, p1 = zero, p2 = zero;
+		for (int k = 0; k < OCTET_SPILL_BLOCKS && i + 32 <= n; k++, i += 32) {
+			__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+			__m256i vb = b ? _mm256_loadu_si256((const __m256i*)(b + i)) : zero;
+			__m256i vd = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+			__m256i al = _mm256_unpacklo_epi8(va, zero), ah = _mm256_unpackhi_epi8(va, zero);
+			__m256i bl = _mm256_unpacklo_epi8(vb, zero), bh = _mm256_unpackhi_epi8(vb, zero);
+			__m256i dl = _mm256_unpacklo_epi8(vd, zero), dh = _mm256_unpackhi_epi8(vd, zero);
+			c32 = _mm256_add_epi32(c32, _mm256_add_epi32(_mm256_madd_epi16(al, bl), _mm256_madd_epi16(ah, bh)));
+			d32 = _mm256_add_epi32(d32, _mm256_add_epi32(_mm256_madd_epi16(dl, dl), _mm256_madd_epi16(dh, dh)));
+			p1  = _mm256_add_epi32(p1,  _mm256_add_epi32(_mm256_madd_epi16(al, al), _mm256_madd_epi16(ah, ah)));
+			p2  = _mm256_add_epi32(p2,  _mm256_add_epi32(_mm256_madd_epi16(bl, bl), _mm256_madd_epi16(bh, bh)));
+			n1  = _mm256_add_epi64(n1,  _mm256_sad_epu8(va, zero));
+			n2  = _mm256_add_epi64(n2,  _mm256_sad_epu8(vb, zero));
+			eq  = _mm256_add_epi64(eq,  _mm256_sad_epu8(_mm256_and_si256(_mm256_cmpeq_epi8(va, vb), one), zero));
+		}
+		c64   = OctetSpill256(c64,   c32);
+		d64   = OctetSpill256(d64,   d32);
+		p1_64 = OctetSpill256(p1_64, p1);
+		p2_64 = OctetSpill256(p2_64, p2);
+	}
+	s.csum  += OctetHorizontal256(c64);
+	s.dsum  += OctetHorizontal256(d64);
+	s.psum1 += OctetHorizontal256(p1_64);
+	s.psum2 += OctetHorizontal256(p2_64);
+	s.nsum1 += OctetHorizontal256(n1);
+	s.nsum2 += OctetHorizontal256(n2);
+	s.same  += OctetHorizontal256(eq);
+	OctetSumSSE2(a + i, b ? b + i : 0, n - i, s);
+}
+#endif
+
+static SimdKernel<OctetSumKernel> OctetSum(OctetSumScalar);
+
+// 実行環境に合わせた集計カーネルの選択
+static void
+BindOctetSumKernel(uint32_t features)
+{
+	OctetSum = OctetSumScalar;
+#if LAYEREXSAVE_USE_SSE2
+	if (features & SIMD_SSE2) OctetSum = OctetSumSSE2;
+#endif
+#if LAYEREXSAVE_USE_AVX2
+	if (features & SIMD_AVX2) OctetSum = OctetSumAVX2;
+#endif
+}
+static SimdBinder OctetSumBinder(BindOctetSumKernel);
+
 template <typename T>
 static inline bool octetVectorSum(tTJSVariant const *v1, tTJSVariant const *v2, VectorSumWork<T> &work)
 {
@@ -733,38 +2538,30 @@ static inline bool octetVectorSum(tTJSVariant const *v1, tTJSVariant const *v2,
 	tTJSVariantOctet *oct1 = v1->AsOctetNoAddRef();
 	tTJSVariantOctet *oct2 = (v2 && v2->Type() == tvtOctet) ? v2->AsOctetNoAddRef() : 0;
 	if (!oct1) return false;
+	OctetSums s = { 0, 0, 0, 0, 0, 0, 0 };
+	tjs_uint const sz = oct1->GetLength();
 	if (!oct2) {
-		tjs_uint const sz = oct1->GetLength();
 		const tjs_uint8 *a = oct1->GetData();
 		if (!a) return false;
-		for (tjs_uint n = 0; n < sz; ++n) {
-			T const va = (T)a[n];
-			work.dsum  += va * va;
-			work.nsum1 += va;
-			if (a[n] != 0) ++work.diff;
-		}
-		work.psum1 = work.dsum;
+		OctetSum(a, 0, sz, s);
+		work.dsum  += (T)s.psum1;
+		work.nsum1 += (T)s.nsum1;
+		work.psum1  = work.dsum;
 	} else {
-		tjs_uint const sz1 = oct1->GetLength();
-		tjs_uint const sz2 = oct2->GetLength();
-		if (sz1 != sz2) return false;
+		if (sz != oct2->GetLength()) return false;
 
 		const tjs_uint8 *a = oct1->GetData();
 		const tjs_uint8 *b = oct2->GetData();
 		if (!a || !b) return false;
-		for (tjs_uint n = 0; n < sz1; ++n) {
-			T const va = (T)a[n];
-			T const vb = (T)b[n];
-			T const vd = (va > vb) ? (va - vb) : (vb - va);
-			work.csum  += va * vb;
-			work.dsum  += vd * vd;
-			work.nsum1 += va;
-			work.nsum2 += vb;
-			work.psum1 += va * va;
-			work.psum2 += vb * vb;
-			if (a[n] != b[n]) ++work.diff;
-		}
+		OctetSum(a, b, sz, s);
+		work.csum  += (T)s.csum;
+		work.dsum  += (T)s.dsum;
+		work.nsum1 += (T)s.nsum1;
+		work.nsum2 += (T)s.nsum2;
+		work.psum1 += (T)s.psum1;
+		work.psum2 += (T)s.psum2;
 	}
+	work.diff += (size_t)(sz - s.same);
 	return true;
 }
 static tjs_error TJS_INTF_METHOD
@@ -793,3 +2590,91 @@ MathOctetVectorSum(tTJSVariant *result, tjs_int numparams, tTJSVariant **param,
 	return TJS_S_OK;
 }
 NCB_ATTACH_FUNCTION(octetVectorSum, Math, MathOctetVectorSum);
+
+// ベクトル間の距離
+double
+OctetDistance(const tjs_uint8 *a, const tjs_uint8 *b, tjs_uint dim, int metric)
+{
+	OctetSums s = { 0, 0, 0, 0, 0, 0, 0 };
+	OctetSum(a, b, dim, s);
+	if (metric == VECTOR_METRIC_COSINE) {
+		if (!s.psum1 || !s.psum2) return 1.0;
+		return 1.0 - (double)s.csum / (std::sqrt((double)s.psum1) * std::sqrt((double)s.psum2));
+	}
+	return std::sqrt((double)s.dsum);
+}
+
+struct VectorMatch {
+	double distance;
+	tjs_int index;
+	bool operator<(VectorMatch const &o) const { return distance != o.distance ? distance < o.distance : index < o.index; }
+};
+
+// 上位 k 件を最大ヒープで保持
+static inline void
+PushVectorMatch(std::vector<VectorMatch> &heap, size_t k, VectorMatch const &m)
+{
+	if (heap.size() < k) {
+		heap.push_back(m);
+		std::push_heap(heap.begin(), heap.end());
+	} else if (m < heap.front()) {
+		std::pop_heap(heap.begin(), heap.end());
+		heap.back() = m;
+		std::push_heap(heap.begin(), heap.end());
+	}
+}
+
+/**
+ * Math.octetVectorSearch = function(query, packed, dim=void, k=1, metric=0);
+ * 連結したベクトル群から query に近いものを k 個探す
+ */
+static tjs_error TJS_INTF_METHOD
+MathOctetVectorSearch(tTJSVariant *result, tjs_int numparams, tTJSVariant **param, iTJSDispatch2 *obj)
+{
+	if (numparams < 2) return TJS_E_BADPARAMCOUNT;
+	if (param[0]->Type() != tvtOctet || param[1]->Type() != tvtOctet) return TJS_E_INVALIDPARAM;
+
+	tTJSVariantOctet *query  = param[0]->AsOctetNoAddRef();
+	tTJSVariantOctet *packed = param[1]->AsOctetNoAddRef();
+	if (!query || !packed) return TJS_E_INVALIDPARAM;
+	const tjs_uint dim = (numparams > 2 && param[2]->Type() != tvtVoid) ? (tjs_uint)param[2]->AsInteger() : query->GetLength();
+	const tjs_int  k   = (numparams > 3 && param[3]->Type() != tvtVoid) ? (tjs_int)param[3]->AsInteger() : 1;
+	const int metric   = (numparams > 4 && param[4]->Type() != tvtVoid) ? (int)param[4]->AsInteger() : VECTOR_METRIC_L2;
+	if (!dim || dim != query->GetLength() || packed->GetLength() % dim) return TJS_E_INVALIDPARAM;
+	if (k <= 0 || (metric != VECTOR_METRIC_L2 && metric != VECTOR_METRIC_COSINE)) return TJS_E_INVALIDPARAM;
+
+	const tjs_uint8 *q = query->GetData(), *db = packed->GetData();
+	const long count = (long)(packed->GetLength() / dim);
+
+	// 範囲を分割して各スレッドで上位 k 件を求め，最後にまとめる
+	std::vector<VectorMatch> matches = ParallelRowsReduce(count, (long)packed->GetLength(), std::vector<VectorMatch>(), [&](long begin, long end) {
+		std::vector<VectorMatch> heap;
+		for (long i = begin; i < end; i++) {
+			VectorMatch m;
+			m.distance = OctetDistance(q, db + (size_t)i * dim, dim, metric);
+			m.index    = (tjs_int)i;
+			PushVectorMatch(heap, (size_t)k, m);
+		}
+		return heap;
+	}, [&](std::vector<VectorMatch> a, std::vector<VectorMatch> const &b) {
+		for (size_t i = 0; i < b.size(); i++) PushVectorMatch(a, (size_t)k, b[i]);
+		return a;
+	});
+	std::sort(matches.begin(), matches.end());
+
+	if (result) {
+		iTJSDispatch2 *arr = TJSCreateArrayObject();
+		if (!arr) return TJS_E_FAIL;
+		for (size_t i = 0; i < matches.size(); i++) {
+			ncbDictionaryAccessor dict;
+			dict.SetValue(TJS_W("index"),    matches[i].index);
+			dict.SetValue(TJS_W("distance"), matches[i].distance);
+			tTJSVariant v = dict;
+			arr->PropSetByNum(TJS_MEMBERENSURE, (tjs_int)i, &v, arr);
+		}
+		*result = tTJSVariant(arr, arr);
+		arr->Release();
+	}
+	return TJS_S_OK;
+}
+NCB_ATTACH_FUNCTION(octetVectorSearch, Math, MathOctetVectorSearch);
@@ -1,9 +1,7 @@
 #ifndef _layerexsave_utils_hpp_
 #define _layerexsave_utils_hpp_
 
-// バッファ参照用の型
-typedef unsigned char const *BufRefT;
-typedef unsigned char       *WrtRefT;
+#include "encoder.hpp" // BufRefT/WrtRefT
 
 bool GetLayerSize(iTJSDispatch2 *lay, long &w, long &h, long *pitch=0);
 bool GetLayerBufferAndSize(iTJSDispatch2 *lay, long &w, long &h, BufRefT &ptr, long &pitch);
@@ -11,4 +9,12 @@ bool GetLayerBufferAndSize(iTJSDispatch2 *lay, long &w, long &h, WrtRefT &ptr, l
 
 bool GetProvinceBufferAndSize(iTJSDispatch2 *lay, long &w, long &h, BufRefT &ptr, long &pitch);
 
+// octet ベクトルの距離の種類
+enum {
+	VECTOR_METRIC_L2     = 0, //< ユークリッド距離
+	VECTOR_METRIC_COSINE = 1, //< 1 - コサイン類似度
+};
+
+double OctetDistance(const tjs_uint8 *a, const tjs_uint8 *b, tjs_uint dim, int metric);
+
 #endif